@@ -0,0 +1,49 @@
+// Benchmarks for the Haar transform in haar.cpp, comparing the original
+// double-precision transform with the single-precision one.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[haar]"`.
+
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/haar.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+TEST_CASE("signature", "[haar]") {
+    const rgb_image img = make_image(false, 1);
+    std::vector<Unit> da(NUM_PIXELS_SQUARED), db(NUM_PIXELS_SQUARED), dc(NUM_PIXELS_SQUARED);
+    std::vector<float> fa(NUM_PIXELS_SQUARED), fb(NUM_PIXELS_SQUARED), fc(NUM_PIXELS_SQUARED);
+    rgb_image copy = img;
+    Idx sig[3][NUM_COEFS];
+    double avgl[3];
+
+    BENCHMARK("double transform") {
+        transformChar(copy.r.data(), copy.g.data(), copy.b.data(), da.data(), db.data(), dc.data());
+        return da[0];
+    };
+
+    BENCHMARK("float transform") {
+        transformChar(img.r.data(), img.g.data(), img.b.data(), fa.data(), fb.data(), fc.data());
+        return fa[0];
+    };
+
+    BENCHMARK("float calcHaar") {
+        calcHaar(static_cast<const float*>(fa.data()), fb.data(), fc.data(), sig[0], sig[1], sig[2], avgl);
+        return sig[0][0];
+    };
+
+    BENCHMARK("double signature") {
+        transformChar(copy.r.data(), copy.g.data(), copy.b.data(), da.data(), db.data(), dc.data());
+        calcHaar(da.data(), db.data(), dc.data(), sig[0], sig[1], sig[2], avgl);
+        return sig[0][0];
+    };
+
+    BENCHMARK("float signature") {
+        transformChar(img.r.data(), img.g.data(), img.b.data(), fa.data(), fb.data(), fc.data());
+        calcHaar(static_cast<const float*>(fa.data()), fb.data(), fc.data(), sig[0], sig[1], sig[2], avgl);
+        return sig[0][0];
+    };
+}
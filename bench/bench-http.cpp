@@ -0,0 +1,120 @@
+// End-to-end benchmarks for `POST /query`, against a server running in this
+// process on 127.0.0.1:15588.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[http]"`.
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <httplib.h>
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+#include <iqdb/server.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+static const char* host = "127.0.0.1";
+static const int port = 15588;
+
+// Run `requests` queries on each of `connections` keep-alive connections at once.
+template <typename F>
+static void run_clients(int connections, int requests, F query) {
+    std::vector<std::thread> clients;
+    std::atomic<int> failures = 0;
+
+    for (int c = 0; c < connections; c++) {
+        clients.emplace_back([&, c] {
+            httplib::Client client(host, port);
+            client.set_keep_alive(true);
+
+            for (int i = 0; i < requests; i++) {
+                const httplib::Result result = query(client, c * requests + i);
+                if (!result || result->status != 200) {
+                    failures++;
+                }
+            }
+        });
+    }
+
+    for (std::thread& client : clients) {
+        client.join();
+    }
+
+    if (failures > 0) {
+        throw fatal_error(std::to_string(failures.load()) + " queries failed");
+    }
+}
+
+// The server can only be started once per process, so every benchmark is in
+// this one test case.
+TEST_CASE("POST /query", "[http]") {
+    const size_t n = 100000;
+    const std::string database = (std::filesystem::temp_directory_path() / "iqdb-bench-http.sqlite").string();
+
+    auto remove_files = [&] {
+        for (const std::string& file : { database, database + "-wal", database + "-shm" }) {
+            std::filesystem::remove(file);
+        }
+    };
+
+    remove_files();
+
+    {
+        IQDB db(database);
+        add_synthetic_images(db, n);
+    }
+
+    std::thread server([&] { http_server(host, port, database); });
+
+    // Wait for the server to load the DB and start listening.
+    httplib::Client client(host, port);
+    client.set_keep_alive(true);
+    while (!client.Get("/status")) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    signature_generator generator(5678);
+    std::vector<std::string> hashes;
+    for (int i = 0; i < 64; i++) {
+        hashes.push_back(generator().to_string());
+    }
+
+    const httplib::MultipartFormDataItems file = { { "file", synthetic_image_file(500, 500, image_format::jpeg), "image.jpg", "image/jpeg" } };
+
+    auto query_hash = [&](httplib::Client& c, int i) {
+        return c.Post("/query", httplib::Params{ { "hash", hashes[i % hashes.size()] } });
+    };
+
+    auto query_file = [&](httplib::Client& c, int) {
+        return c.Post("/query", file);
+    };
+
+    int next = 0;
+    BENCHMARK("hash n=" + std::to_string(n)) {
+        return query_hash(client, next++);
+    };
+
+    BENCHMARK("file n=" + std::to_string(n)) {
+        return query_file(client, next++);
+    };
+
+    // The time of 256 queries spread over 8 connections, for the throughput
+    // of concurrent queries.
+    BENCHMARK("hash x256 over 8 connections n=" + std::to_string(n)) {
+        run_clients(8, 32, query_hash);
+    };
+
+    BENCHMARK("file x256 over 8 connections n=" + std::to_string(n)) {
+        run_clients(8, 32, query_file);
+    };
+
+    stop_http_server();
+    server.join();
+    remove_files();
+}
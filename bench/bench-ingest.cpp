@@ -0,0 +1,100 @@
+// Benchmarks for adding and removing images: computing the signature of an
+// uploaded file, adding signatures to the buckets, and compacting them.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[ingest]"`.
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+TEST_CASE("from_file_content", "[ingest]") {
+    const bool png = GENERATE(false, true);
+    const auto [width, height] = GENERATE(std::pair(500, 500), std::pair(2000, 1500));
+    const std::string file = synthetic_image_file(width, height, png ? image_format::png : image_format::jpeg);
+
+    BENCHMARK(std::string(png ? "png " : "jpeg ") + std::to_string(width) + "x" + std::to_string(height)) {
+        return HaarSignature::from_file_content(file);
+    };
+}
+
+TEST_CASE("bucket_set", "[ingest]") {
+    signature_generator generator;
+    std::vector<HaarSignature> signatures;
+    for (int i = 0; i < 100000; i++) {
+        signatures.push_back(generator());
+    }
+
+    BENCHMARK_ADVANCED("add x100000")(Catch::Benchmark::Chronometer meter) {
+        std::vector<std::unique_ptr<bucket_set>> buckets;
+        for (int run = 0; run < meter.runs(); run++) {
+            buckets.push_back(std::make_unique<bucket_set>());
+        }
+
+        meter.measure([&](int run) {
+            for (size_t i = 0; i < signatures.size(); i++) {
+                buckets[run]->add(signatures[i], static_cast<imageId>(i));
+            }
+        });
+    };
+
+    image_table images;
+    bucket_set buckets;
+    for (const HaarSignature& sig : signatures) {
+        buckets.add(sig, images.add(sig));
+    }
+
+    BENCHMARK("compacted n=100000") {
+        return buckets.compacted();
+    };
+
+    // Removing an image only marks it as deleted, so the cost of removing
+    // images is in dropping their IDs the next time the buckets are compacted.
+    const bucket_set compacted = buckets.compacted();
+    for (imageId id = 0; id < signatures.size(); id += 10) {
+        images.setDeleted(id);
+    }
+
+    BENCHMARK("compacted n=100000 deleted=10%") {
+        return compacted.compacted(&images);
+    };
+}
+
+TEST_CASE("addImage and removeImage", "[ingest]") {
+    IQDB db;
+    add_synthetic_images(db, 100000);
+
+    signature_generator generator(5678);
+    size_t next = 100000;
+
+    BENCHMARK_ADVANCED("addImage")(Catch::Benchmark::Chronometer meter) {
+        const std::vector<image_info> images = generator.images(next, meter.runs());
+        meter.measure([&](int i) { db.addImage(images[i].post_id, images[i].md5, images[i].haar); });
+        next += images.size();
+    };
+
+    BENCHMARK_ADVANCED("addImages x10000")(Catch::Benchmark::Chronometer meter) {
+        std::vector<std::vector<image_info>> batches;
+        for (int i = 0; i < meter.runs(); i++) {
+            batches.push_back(generator.images(next, 10000));
+            next += 10000;
+        }
+
+        meter.measure([&](int i) { db.addImages(std::move(batches[i])); });
+    };
+
+    BENCHMARK_ADVANCED("removeImage")(Catch::Benchmark::Chronometer meter) {
+        const std::vector<image_info> images = generator.images(next, meter.runs());
+        db.addImages(images);
+        next += images.size();
+
+        meter.measure([&](int i) { db.removeImage(images[i].post_id); });
+    };
+}
@@ -0,0 +1,53 @@
+// Benchmarks for loading the in-memory index at startup, from the SQLite DB
+// and from a snapshot file.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[load]"`.
+
+#include <filesystem>
+#include <string>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+TEST_CASE("loadDatabase", "[load]") {
+    const size_t n = GENERATE(100000, 1000000);
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string database = (dir / ("iqdb-bench-" + std::to_string(n) + ".sqlite")).string();
+    const std::string snapshot = (dir / ("iqdb-bench-" + std::to_string(n) + ".snapshot")).string();
+
+    auto remove_files = [&] {
+        for (const std::string& file : { database, database + "-wal", database + "-shm", snapshot }) {
+            std::filesystem::remove(file);
+        }
+    };
+
+    remove_files();
+
+    {
+        IQDB db(database);
+        add_synthetic_images(db, n);
+    }
+
+    {
+        IQDB db(database);
+        BENCHMARK("loadDatabase n=" + std::to_string(n)) {
+            db.loadDatabase(database);
+            return db.getImgCount();
+        };
+    }
+
+    {
+        // The first load saves the snapshot, which the later ones map.
+        IQDB db(database, 1, snapshot);
+        BENCHMARK("loadDatabase from snapshot n=" + std::to_string(n)) {
+            db.loadDatabase(database);
+            return db.getImgCount();
+        };
+    }
+
+    remove_files();
+}
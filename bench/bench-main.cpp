@@ -0,0 +1,13 @@
+// The Catch2 main() for iqdb_bench. Run `iqdb_bench --help` for options.
+// debug.h comes first, since Catch2 defines INFO and WARN macros.
+#include <iqdb/debug.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch2/catch.hpp>
+
+int main(int argc, char* argv[]) {
+    // Turn off logging, so the benchmarks that load a DB or run the server
+    // don't log every load and request.
+    iqdb::debug_level = 4;
+    return Catch::Session().run(argc, argv);
+}
@@ -0,0 +1,58 @@
+// Benchmarks for queries against an in-memory index of synthetic signatures.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[query]"`. The
+// 10 million image index needs about 10 GB of memory, so it only runs when
+// asked for with `iqdb_bench "[query-10m]"`.
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+static void benchmark_queries(size_t n, size_t shards) {
+    IQDB db(":memory:", shards);
+    add_synthetic_images(db, n);
+
+    // The queries use a different seed than the images, so they're new images
+    // with the same coefficient skew.
+    signature_generator generator(5678);
+    std::vector<HaarSignature> queries;
+    for (int i = 0; i < 64; i++) {
+        queries.push_back(generator());
+    }
+
+    const std::string suffix = " n=" + std::to_string(n) + " shards=" + std::to_string(shards);
+    size_t next = 0;
+
+    BENCHMARK("queryFromSignature" + suffix) {
+        return db.queryFromSignature(queries[next++ % queries.size()], 10);
+    };
+
+    // A dedupe lookup: the query is one of the images, and only near-duplicates are wanted.
+    const HaarSignature existing = signature_generator()();
+    BENCHMARK("queryFromSignature min_score=95" + suffix) {
+        return db.queryFromSignature(existing, 10, 95);
+    };
+
+    std::vector<HaarSignature> batch(queries.begin(), queries.begin() + 16);
+    BENCHMARK("queryBatch x16" + suffix) {
+        return db.queryBatch(batch, 10);
+    };
+}
+
+TEST_CASE("queryFromSignature", "[query]") {
+    const size_t n = GENERATE(10000, 1000000);
+    const size_t shards = GENERATE(1, 4);
+    benchmark_queries(n, shards);
+}
+
+TEST_CASE("queryFromSignature 10m", "[.][query-10m]") {
+    benchmark_queries(10000000, std::max(1u, std::thread::hardware_concurrency()));
+}
@@ -0,0 +1,56 @@
+// Microbenchmarks for the query kernels in simd.cpp, run once per instruction
+// set supported by this CPU.
+//
+// Build with `-DIQDB_BUILD_BENCHMARKS=ON` and run `iqdb_bench "[simd]"`.
+
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imglib.h>
+#include <iqdb/simd.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+static const simd_level levels[] = { simd_level::scalar, simd_level::avx2, simd_level::avx512 };
+
+TEST_CASE("lumin_distance", "[simd]") {
+    const size_t n = GENERATE(10000, 1000000);
+    const auto y = random_avgl(n, 0, 1), i = random_avgl(n, -0.5, 0.5), q = random_avgl(n, -0.5, 0.5);
+    const Score* avgl[3] = { y.data(), i.data(), q.data() };
+    const Score query[3] = { 0.5f, 0.1f, -0.1f };
+    std::vector<Score> scores(n);
+
+    for (simd_level level : levels) {
+        if (!simd_supported(level)) {
+            continue;
+        }
+
+        const simd_kernels& simd = get_simd_kernels(level);
+        BENCHMARK(std::string(simd.name) + " n=" + std::to_string(n)) {
+            simd.lumin_distance(scores.data(), avgl, query, weights[0], 3, n);
+            return scores[0];
+        };
+    }
+}
+
+TEST_CASE("subtract_weight", "[simd]") {
+    const size_t n = 1000000;
+    const size_t stride = GENERATE(1, 16, 256);
+    const auto bucket = make_bucket(n, stride);
+    std::vector<Score> scores(n, 0);
+
+    for (simd_level level : levels) {
+        if (!simd_supported(level)) {
+            continue;
+        }
+
+        const simd_kernels& simd = get_simd_kernels(level);
+        BENCHMARK(std::string(simd.name) + " entries=" + std::to_string(bucket.size())) {
+            simd.subtract_weight(scores.data(), bucket.data(), bucket.size(), 0.5f);
+            return scores[0];
+        };
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef IQDB_APPEND_ARRAY_H
+#define IQDB_APPEND_ARRAY_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace iqdb {
+
+// An array that can only grow at the end, and that never moves its elements.
+// The elements are stored in fixed-size blocks, and a copy of the array is a
+// cheap view that shares the blocks with the original.
+//
+// This lets a single writer keep appending to an array while readers use older
+// copies of it: a copy only sees the elements that existed when it was made,
+// and appending never touches those. The blocks are freed once the last copy
+// using them is gone.
+template <typename T, size_t BlockSize = 65536>
+class append_array {
+public:
+    static constexpr size_t block_size = BlockSize;
+
+    size_t size() const { return size_; }
+
+    T& operator[](size_t i) { return (*(*blocks_)[i / BlockSize])[i % BlockSize]; }
+    const T& operator[](size_t i) const { return (*(*blocks_)[i / BlockSize])[i % BlockSize]; }
+
+    // Append a value-initialized element and return it.
+    T& append() {
+        if (size_ % BlockSize == 0) {
+            // The block list itself is copied, never modified, so the copies
+            // using the old list are unaffected.
+            auto blocks = blocks_ ? std::make_shared<block_list>(*blocks_) : std::make_shared<block_list>();
+            blocks->push_back(std::make_shared<block>());
+            blocks_ = std::move(blocks);
+        }
+
+        return (*this)[size_++];
+    }
+
+    // The elements `[b * block_size, b * block_size + blockLength(b))`, which
+    // are contiguous in memory.
+    size_t blockCount() const { return (size_ + BlockSize - 1) / BlockSize; }
+    size_t blockLength(size_t b) const { return std::min(BlockSize, size_ - b * BlockSize); }
+    const T* blockData(size_t b) const { return (*blocks_)[b]->data(); }
+
+    // The approximate number of bytes used by the blocks.
+    size_t memoryUsage() const { return blocks_ ? blocks_->size() * sizeof(block) : 0; }
+
+private:
+    using block = std::array<T, BlockSize>;
+    using block_list = std::vector<std::shared_ptr<block>>;
+
+    std::shared_ptr<const block_list> blocks_;
+    size_t size_ = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef IQDB_BULK_H
+#define IQDB_BULK_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include <iqdb/imgdb.h>
+
+namespace iqdb {
+
+// The formats of a stream of precomputed signatures, used to import many
+// images at once without decoding them.
+//
+// ndjson: one JSON object per line, e.g.
+//     {"post_id": "1234", "md5": "...", "hash": "iqdb_..."}
+//
+// binary: a sequence of records, in native byte order and without padding:
+//     uint16_t post_id_length; char post_id[post_id_length];
+//     uint16_t md5_length;     char md5[md5_length];
+//     double   avglf[3];
+//     int16_t  sig[3][40];
+enum class bulk_format { ndjson, binary };
+
+// How many images are added to the DB at a time by a bulk import.
+constexpr size_t bulk_batch_size = 10000;
+
+// Parse a stream of signatures that arrives in chunks of any size. A function
+// is called for each image as soon as it has been read.
+class bulk_parser {
+public:
+    bulk_parser(bulk_format format, std::function<void(image_info&&)> func);
+
+    // Parse the next chunk of the stream. Throws a param_error if the stream is invalid.
+    void feed(const char* data, size_t size);
+
+    // End the stream. Throws a param_error if it ends in the middle of an image.
+    void finish();
+
+    // How many images have been read.
+    size_t count() const { return count_; }
+
+private:
+    // Parse the complete lines or records at the start of `data`, and return
+    // how many bytes were used.
+    size_t parse(const char* data, size_t size);
+    size_t parseLines(const char* data, size_t size);
+    size_t parseRecords(const char* data, size_t size);
+
+    void parseLine(std::string_view line);
+    void emit(postId post_id, std::string md5, HaarSignature haar);
+
+    bulk_format format_;
+    std::function<void(image_info&&)> func_;
+    std::string buffer_; // The incomplete line or record at the end of the last chunk.
+    size_t line_ = 0;
+    size_t count_ = 0;
+};
+
+// Options for `iqdb import`, given as `--name=value` on the command line.
+struct import_options {
+    bulk_format format = bulk_format::ndjson; // --format: `ndjson` or `binary`.
+    size_t shards = 1;                        // --shards: as for `iqdb http`, used to build the snapshot.
+    std::string snapshot;                     // --snapshot: the snapshot file to rebuild after importing.
+};
+
+// Import a file of precomputed signatures into the DB. Reads stdin if `input` is "-".
+void import_file(const std::string& input, const std::string& database_filename, const import_options& options = {});
+
+}
+
+#endif
@@ -20,33 +20,35 @@ std::string get_backtrace(int skip = 1);
 // Demangle a C++ symbol name.
 std::string demangle_name(std::string symbol_name);
 
+// Log a message at the given level. Nothing is formatted or allocated if the
+// level is disabled.
 template<typename... Args>
-inline void LOG(std::string format, int level, Args... args) {
+inline void LOG(const char* prefix, fmt::string_view format, int level, const Args&... args) {
     if (level >= debug_level) {
         auto now = std::chrono::system_clock::now();
-        fmt::print(stderr, "{:%FT%H:%M:%S} ", now);
-        fmt::print(stderr, format, args...); \
+        fmt::print(stderr, "{:%FT%H:%M:%S} {}", now, prefix);
+        fmt::vprint(stderr, format, fmt::make_format_args(args...));
     }
 }
 
 template<typename... Args>
-inline void DEBUG(std::string format, Args... args) {
-  LOG("[debug] " + format, 0, args...);
+inline void DEBUG(fmt::string_view format, const Args&... args) {
+  LOG("[debug] ", format, 0, args...);
 }
 
 template<typename... Args>
-inline void ERROR(std::string format, Args... args) {
-  LOG("[error] " + format, 1, args...);
+inline void ERROR(fmt::string_view format, const Args&... args) {
+  LOG("[error] ", format, 1, args...);
 }
 
 template<typename... Args>
-inline void WARN(std::string format, Args... args) {
-  LOG("[warn] " + format, 2, args...);
+inline void WARN(fmt::string_view format, const Args&... args) {
+  LOG("[warn] ", format, 2, args...);
 }
 
 template<typename... Args>
-inline void INFO(std::string format, Args... args) {
-  LOG("[info] " + format, 3, args...);
+inline void INFO(fmt::string_view format, const Args&... args) {
+  LOG("[info] ", format, 3, args...);
 }
 
 }
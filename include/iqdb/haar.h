@@ -49,10 +49,16 @@ typedef struct valStruct_ {
   }
 } valStruct;
 
+/* The original double-precision transform. */
 void transform(Unit *a, Unit *b, Unit *c);
 void transformChar(unsigned char *c1, unsigned char *c2, unsigned char *c3, Unit *a, Unit *b, Unit *c);
 int calcHaar(Unit *cdata1, Unit *cdata2, Unit *cdata3, Idx *sig1, Idx *sig2, Idx *sig3, double *avgl);
 
+/* The faster single-precision transform used for new signatures. It matches
+   the double-precision one within float rounding; see haar.cpp. */
+void transformChar(const unsigned char *c1, const unsigned char *c2, const unsigned char *c3, float *a, float *b, float *c);
+int calcHaar(const float *cdata1, const float *cdata2, const float *cdata3, Idx *sig1, Idx *sig2, Idx *sig3, double *avgl);
+
 }
 
 #endif
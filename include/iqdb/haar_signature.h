@@ -1,7 +1,10 @@
 #ifndef HAAR_SIGNATURE_H
 #define HAAR_SIGNATURE_H
 
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <iqdb/haar.h>
 
 namespace iqdb {
@@ -15,12 +18,43 @@ struct HaarSignature {
 
   HaarSignature() {};
   explicit HaarSignature(lumin_t avglf, signature_t sig);
+  // Parse the output of `to_string()`. The coefficients are checked, as they
+  // index the buckets.
   static HaarSignature from_hash(const std::string hash);
-  static HaarSignature from_file_content(const std::string blob);
+  static HaarSignature from_file_content(std::string_view blob);
+
+  // The signature as raw bytes: `avglf` then `sig`, in native byte order. The
+  // coefficients are checked, and sorted, as they index the buckets.
+  static HaarSignature from_bytes(std::string_view bytes);
+  std::string to_bytes() const;
 
   std::string to_string() const;
+
+  // The compact encoding used to store signatures in the DB and in snapshots.
+  // It's a version byte, the avgl values as floats, and then the coefficients
+  // of each channel, sorted and delta-coded as varints.
+  std::string encode() const;
+
+  // Decode the output of `encode()`. Returns nothing if the data is truncated,
+  // corrupt, has an invalid coefficient, or is from an unknown version of the
+  // encoding.
+  static std::optional<HaarSignature> decode(std::string_view data);
+
+  // The signature as it is once stored, i.e. `decode(encode())`: with the
+  // avgl values rounded to floats and the coefficients sorted. Throws a
+  // param_error if it isn't valid, as it couldn't be decoded.
+  HaarSignature quantized() const;
+
   std::string to_json() const;
   bool is_grayscale() const noexcept;
+
+  // Whether every coefficient can index the buckets, i.e. none is 0 and none
+  // is out of the range of the Haar matrix.
+  bool is_valid() const noexcept;
+
+  // A 64-bit hash of the whole signature, for finding identical signatures.
+  uint64_t digest() const noexcept;
+  bool operator==(const HaarSignature& other) const noexcept;
   int num_colors() const noexcept;
 };
 
@@ -0,0 +1,83 @@
+#ifndef IQDB_HASH_INDEX_H
+#define IQDB_HASH_INDEX_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+// An open-addressing hash table from 64-bit keys to image IDs, used to find
+// images by md5 or by signature without scanning the index. A key can have
+// several IDs. Only the high half of a key, its tag, is kept, so keys with the
+// same tag are found together, and the caller has to check that the images it
+// finds really match.
+//
+// Each slot is a single atomic word holding the tag and the ID, so one writer
+// can insert and erase while readers look up keys. Erased slots are never
+// reused until the table is rebuilt. Growing the table makes a new one, which
+// the writer publishes like a new snapshot of the index.
+class hash_index {
+public:
+    explicit hash_index(size_t capacity = 16);
+
+    // Add `id` under `key`. Returns false, without adding it, if the table is
+    // too full; make a bigger one with `grown()` and add it to that instead.
+    bool insert(uint64_t key, imageId id);
+
+    // Remove `id` from under `key`, if it's there.
+    void erase(uint64_t key, imageId id);
+
+    // Call `func(id)` for each ID that may have been added under `key`.
+    template <typename F>
+    void find(uint64_t key, F func) const {
+        const uint32_t tag = static_cast<uint32_t>(key >> 32);
+
+        for (size_t pos = slotOf(key);; pos = (pos + 1) & mask_) {
+            const uint64_t slot = slots_[pos].load(std::memory_order_acquire);
+            const imageId id = static_cast<imageId>(slot);
+
+            if (id == empty) {
+                return;
+            } else if (id != erased && static_cast<uint32_t>(slot >> 32) == tag) {
+                func(id);
+            }
+        }
+    }
+
+    // A copy of this table without the erased slots, with room for the IDs in
+    // it to double.
+    hash_index grown() const;
+
+    // The number of IDs in the table.
+    size_t size() const { return size_; }
+
+    // The approximate number of bytes used by the table.
+    size_t memoryUsage() const { return (mask_ + 1) * sizeof(uint64_t); }
+
+private:
+    static constexpr imageId empty = UINT32_MAX;
+    static constexpr imageId erased = UINT32_MAX - 1;
+
+    // The first slot to look for a key in. It only depends on the tag, so the
+    // table can be rebuilt from the slots alone. The tag is mixed first, so
+    // that similar tags don't end up next to each other.
+    size_t slotOf(uint64_t key) const {
+        uint64_t tag = key >> 32;
+        tag *= 0xff51afd7ed558ccdULL;
+        tag ^= tag >> 32;
+        return static_cast<size_t>(tag) & mask_;
+    }
+
+    std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+    size_t mask_;     // The capacity minus 1. The capacity is a power of 2.
+    size_t used_ = 0; // The number of slots used, including the erased ones.
+    size_t size_ = 0;
+};
+
+}
+
+#endif
@@ -24,16 +24,25 @@
 #ifndef IMGDBASE_H
 #define IMGDBASE_H
 
+#include <atomic>
+#include <bitset>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 
+#include <iqdb/append_array.h>
 #include <iqdb/haar.h>
 #include <iqdb/haar_signature.h>
+#include <iqdb/hash_index.h>
 #include <iqdb/imglib.h>
 #include <iqdb/resizer.h>
 #include <iqdb/sqlite_db.h>
+#include <iqdb/thread_pool.h>
 #include <iqdb/types.h>
 
 namespace iqdb {
@@ -61,75 +70,238 @@ DEFINE_ERROR(simple_error, base_error)
 DEFINE_ERROR(param_error, simple_error) // An argument was invalid, e.g. non-existent image ID.
 DEFINE_ERROR(image_error, simple_error) // Could not successfully extract image data from the given file.
 
-typedef struct {
-    Score v[3];
-} lumin_native;
-
+// A query result. The md5 and signature are taken from the in-memory index, so
+// building the results of a query never needs the SQLite DB.
 struct sim_value {
     postId id;
     Score score;
-    sim_value(postId id_, Score score_) : id(id_), score(score_) {};
+    std::string md5;
+    HaarSignature haar;
+    sim_value(postId id_, Score score_, std::string md5_, const HaarSignature& haar_) : id(id_), score(score_), md5(std::move(md5_)), haar(haar_) {};
     bool operator<(const sim_value &other) const { return score < other.score; }
 };
 
+// Per-image data that is only needed to build the results of a query. The
+// data used while scoring lives in `image_table`.
 struct image_info {
-    image_info() {}
-    image_info(postId i, const std::string& md5, const lumin_native &a)
-        : id(i), md5(md5), avgl(a) {}
-
-    postId id;
+    postId post_id;
     std::string md5;
-    lumin_native avgl;
+    HaarSignature haar;
+};
+
+// An immutable view of the whole in-memory index, as of when it was published.
+// Queries run against a snapshot, so they never wait on writers.
+struct index_snapshot {
+    std::vector<index_shard> shards;
+    append_array<image_info> info;
+    std::shared_ptr<const hash_index> md5s;       // image IDs by md5
+    std::shared_ptr<const hash_index> signatures; // image IDs by signature digest
+
+    // check if an image is deleted
+    bool isDeleted(imageId id) const { return shards[id % shards.size()].images.isDeleted(static_cast<imageId>(id / shards.size())); }
 };
 
 typedef std::vector<sim_value> sim_vector;
 typedef Idx sig_t[NUM_COEFS];
 
+// The buckets of a query's coefficients that aren't empty, one bit per
+// coefficient, in the order of the signature's colors and coefficients. The
+// score scale of a query depends only on these, so instances holding parts of
+// the same collection can compute the scale the whole collection would give.
+typedef std::bitset<3 * NUM_COEFS> bucket_mask;
+
+class query_cache;
+
+// Queries can run concurrently with each other and with writes. Writes (adding,
+// removing, compacting and loading) must not run concurrently with each other.
 class IQDB {
 public:
-    IQDB(std::string filename = ":memory:");
-
-    // query for similar images by hash string
-    sim_vector queryFromSignature(const HaarSignature& img, size_t numres = 10);
+    // Open the database at `filename`, splitting the in-memory index into
+    // `shards` slices that queries score in parallel. If `snapshot_file` is
+    // given, the in-memory index is loaded from that snapshot instead of being
+    // rebuilt from the database, and the snapshot is kept up to date. up to
+    // `query_cache_size` query results are cached until the next write.
+    IQDB(std::string filename = ":memory:", size_t shards = 1, std::string snapshot_file = "", size_t query_cache_size = 0);
+    ~IQDB();
+
+    // query for similar images by hash string. if `min_score` is given, only
+    // the matches scoring at least that much are returned, and the images
+    // that can't reach it are skipped without being scored when possible, which
+    // makes looking for near-duplicates much faster. if `buckets` is given,
+    // it's set to the non-empty buckets the scores were scaled by
+    sim_vector queryFromSignature(const HaarSignature& img, size_t numres = 10, std::optional<Score> min_score = std::nullopt, bucket_mask* buckets = nullptr);
+
+    // query for similar images for several signatures at once. returns the
+    // results of each signature, in the same order as `signatures`. if
+    // `buckets` is given, it's set to the non-empty buckets of each signature
+    std::vector<sim_vector> queryBatch(const std::vector<HaarSignature>& signatures, size_t numres = 10, std::optional<Score> min_score = std::nullopt, std::vector<bucket_mask>* buckets = nullptr);
 
     // query for similar images by binary blob
-    sim_vector queryFromBlob(const std::string blob, int numres = 10);
+    sim_vector queryFromBlob(std::string_view blob, int numres = 10, std::optional<Score> min_score = std::nullopt);
+
+    // get the images with exactly this signature, as matches with a score of
+    // 100, without scanning the index
+    sim_vector queryExact(const HaarSignature& signature, size_t numres = 10);
 
     // get how many images are stored in this DB
     uint64_t getImgCount();
 
-    // check if a post is deleted or not
-    bool isDeleted(postId iqdb_id); 
+    // check if an image is deleted or not
+    bool isDeleted(imageId id);
 
     // add a new image to the DB
     void addImage(postId id, const std::string& md5, const HaarSignature& signature);
 
+    // add many images to the DB at once, in a single transaction. this is much
+    // faster than adding them one at a time. if a post is given more than once,
+    // its last image is kept
+    void addImages(std::vector<image_info> images);
+
     // get an image from the DB. will be std::nullopt if not found
     std::optional<Image> getImage(postId post_id);
 
-    // get all images from the DB with the matching md5 hash
-    std::vector<Image> getByMD5(const std::string& md5);
+    // get all images with the matching md5 hash. only the in-memory index is
+    // used, so this doesn't read the DB
+    std::vector<image_info> getByMD5(const std::string& md5);
 
     // remove an image from the DB
     void removeImage(postId id);
 
+    // run `func`, committing the images it adds and removes to the DB in a
+    // single transaction. the in-memory index is only changed, and queries
+    // only see the changes, once they're committed. a transaction run inside
+    // another is a savepoint of it: if `func` throws, only its own changes are
+    // undone. `func` must not call `loadDatabase`
+    void transaction(const std::function<void()>& func);
+
+    // check if the buckets have enough uncompressed entries or deleted images to be worth compacting
+    bool needsCompaction();
+
+    // merge the uncompressed bucket entries of recently added images into the
+    // compressed posting lists, and drop the IDs of deleted images from them.
+    void compact();
+
     // load an sqlite DB from file
     void loadDatabase(std::string filename);
 
+    // save the in-memory index to a snapshot file, which `loadDatabase` can
+    // load much faster than it can rebuild the index. only the changes made
+    // to the DB after the snapshot was saved are replayed when loading it.
+    void saveSnapshot(const std::string& path);
+
+    // replace the in-memory index with the one in a snapshot file, and replay
+    // the changes made to the DB since it was saved. throws a snapshot_error,
+    // leaving the index empty, if the snapshot can't be used
+    void loadSnapshot(const std::string& path);
+
+    // the score scale of a query: the inverse of the total weight of its
+    // non-empty buckets. a score is the raw score times `100 * scale`
+    static Score scaleOf(const HaarSignature& signature, const bucket_mask& buckets);
+
 private:
+    // the buckets of a query's coefficients that aren't empty in any shard
+    static bucket_mask bucketsOf(const index_snapshot& index, const HaarSignature& signature);
+
+    // merge the per-shard top results of a query into the final results,
+    // dropping the ones scoring below `min_score`
+    static sim_vector mergeResults(const index_snapshot& index, const std::vector<std::vector<scored_image>>& shard_results, size_t numres, Score scale, std::optional<Score> min_score);
+
+    // make the current state of the in-memory index visible to queries
+    void publish();
+
+    // the last published snapshot of the in-memory index
+    std::shared_ptr<const index_snapshot> snapshot() const;
+
+    // a change made to the DB in the open transaction: an image added, or the
+    // post removed if `image` is empty
+    struct pending_change {
+        postId post_id;
+        std::optional<image_info> image;
+    };
+
+    // record a change to make to the in-memory index once the transaction is
+    // committed
+    void addPendingChange(postId post_id, std::optional<image_info> image);
+
+    // forget the pending changes after the first `n`, which were rolled back
+    void discardPendingChanges(size_t n);
+
+    // make the committed changes to the in-memory index, and publish them
+    void applyPendingChanges();
+
+    // check if a post is in the DB, counting the pending changes
+    bool hasPost(const postId& post_id) const;
+
+    // remove a post from memory only. returns false if it's not in memory
+    bool removeImageInMemory(postId post_id);
+
+    // empty the in-memory index
+    void clearInMemory();
+
+    // load every image in the DB into the empty in-memory index
+    void loadImages();
+
     // cache a post in memory
     void addImageInMemory(postId post_id, const std::string& md5, const HaarSignature& signature);
 
-    // cached data
-    std::map<postId, image_info> m_info;
+    // cache many posts in memory at once, filling the shards in parallel. the
+    // posts must not be in memory already
+    void addImagesInMemory(std::vector<image_info> images);
+
+    // add an image in `m_info` to the md5 and signature indexes
+    void addToHashIndexes(imageId id);
+
+    // the shard containing an image, and the image's index in that shard
+    index_shard& shardOf(imageId id) { return m_shards[id % m_shards.size()]; }
+    imageId shardIndex(imageId id) const { return static_cast<imageId>(id / m_shards.size()); }
+
+    // cached data used for scoring, split into shards. this is the writers'
+    // copy; queries use the shards of `m_snapshot`
+    std::vector<index_shard> m_shards;
+
+    // the worker threads that score the shards of a query
+    std::unique_ptr<thread_pool> m_pool;
+
+    // cached data used for results, indexed by the internal image ID
+    append_array<image_info> m_info;
+
+    // maps an external post ID to its internal image ID
+    std::unordered_map<postId, imageId> m_ids;
+
+    // the image IDs by md5 and by signature digest. a full table is replaced
+    // by a bigger copy, so the snapshots using the old one are unaffected
+    std::shared_ptr<hash_index> m_md5s;
+    std::shared_ptr<hash_index> m_signatures;
+
+    // what queries see. only accessed with std::atomic_load and std::atomic_store
+    std::shared_ptr<const index_snapshot> m_snapshot;
+
+    // bumped after every change to what queries see, so that the results
+    // cached before it are never used again
+    std::atomic<uint64_t> m_epoch = 0;
+
+    // the results of recent queries, or null if they aren't cached
+    std::unique_ptr<query_cache> m_query_cache;
+
+    // the snapshot file to load the in-memory index from, if any
+    std::string m_snapshot_file;
+
+    // whether a transaction is open, and the changes made in it so far
+    bool m_in_transaction = false;
+    std::vector<pending_change> m_pending;
+
+    // the index in `m_pending` of the last change to each post
+    std::unordered_map<postId, size_t> m_last_pending;
+
+    // the last change in the DB before the open transaction, which is the
+    // last change the in-memory index has
+    int64_t m_committed_change = 0;
 
     // SQLite DB that is operated on
     std::unique_ptr<SqliteDB> sqlite_db_;
 
-    bucket_set imgbuckets;
-
     // how many images are stored in the DB
-    uint64_t img_count = 0;
+    std::atomic<uint64_t> img_count = 0;
 
 private:
     void operator=(const IQDB &);
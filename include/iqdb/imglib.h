@@ -24,8 +24,16 @@
 #ifndef IMGDBLIB_H
 #define IMGDBLIB_H
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+
+#include <iqdb/append_array.h>
 #include <iqdb/haar.h>
+#include <iqdb/snapshot.h>
 #include <iqdb/sqlite_db.h>
+#include <iqdb/thread_pool.h>
 
 namespace iqdb {
 
@@ -69,22 +77,227 @@ struct ImgBin {
 
 constexpr static auto imgBin = ImgBin<NUM_PIXELS>();
 
-using bucket_t = std::vector<postId>;
+// Per-image data that is read by every query, stored as a structure of arrays
+// indexed by image ID so that the luminance pass streams linearly through
+// memory. Cold data like the md5 is kept elsewhere.
+//
+// A copy of the table is a snapshot of it: it shares the arrays with the
+// original, but only sees the images that existed when it was made. The
+// deleted bits are shared too, so a snapshot sees images that are deleted
+// later as deleted.
+class image_table {
+public:
+    using avgl_array = append_array<Score>;
+    using bit_array = append_array<std::atomic<uint64_t>, avgl_array::block_size / 64>;
+
+    // Append an image to the table and return its image ID.
+    imageId add(const HaarSignature &sig);
+    void clear() { *this = image_table(); }
+
+    size_t size() const { return avgl_[0].size(); }
+
+    // The avgl value of color channel `c` of an image.
+    Score avgl(int c, imageId id) const { return avgl_[c][id]; }
+
+    // Call `func(first, n, avgl)` for each block of images, where `avgl[c]` are
+    // the avgl values of color channel `c` (0 = Y, 1 = I, 2 = Q) of images
+    // `[first, first + n)`.
+    template <typename F>
+    void eachBlock(F func) const {
+        for (size_t b = 0; b < avgl_[0].blockCount(); b++) {
+            const Score* avgl[3] = { avgl_[0].blockData(b), avgl_[1].blockData(b), avgl_[2].blockData(b) };
+            func(b * avgl_array::block_size, avgl_[0].blockLength(b), avgl);
+        }
+    }
+
+    bool isDeleted(imageId id) const { return testBit(deleted_, id); }
+    bool isGrayscale(imageId id) const { return testBit(grayscale_, id); }
+    void setDeleted(imageId id) { deleted_[id / 64].fetch_or(uint64_t(1) << (id % 64), std::memory_order_relaxed); }
+
+    // The deleted bitmap, in blocks of `avgl_array::block_size` images.
+    const bit_array& deletedBits() const { return deleted_; }
+
+    size_t memoryUsage() const;
+
+    // Write the table to a snapshot file, or replace it with the one in a snapshot file.
+    void save(snapshot_writer &out) const;
+    void load(snapshot_reader &in);
 
+private:
+    static bool testBit(const bit_array& bits, imageId id) {
+        return (bits[id / 64].load(std::memory_order_relaxed) >> (id % 64)) & 1;
+    }
+
+    avgl_array avgl_[3]; // The Y, I and Q avgl values.
+    bit_array deleted_;   // Bitmap of removed images.
+    bit_array grayscale_; // Bitmap of grayscale images.
+};
+
+// The buckets of the image index. Bucket (color, coef) holds the IDs of every
+// image whose signature contains `coef` in the given color channel.
+//
+// Each bucket is a sorted posting list. The bulk of the list is delta-encoded
+// as varints in one arena shared by all buckets of the same color and sign,
+// and the most recent inserts go into a small uncompressed tail. `compacted()`
+// merges the tails into the arenas.
+//
+// The compressed lists never change once built. The tails can be appended to
+// by one writer while queries read them: the IDs are stored in chunks that
+// never move, and a query only reads the IDs below the size of the
+// `image_table` it was given.
+//
+// Images are never removed from the buckets directly. Removed images are
+// marked as deleted in the `image_table` instead, and their IDs are dropped
+// from the buckets the next time they are compacted.
 class bucket_set {
 public:
-    bucket_t& at(int col, int coef);
-    void add(const HaarSignature &sig, postId iqdb_id);
-    void remove(const HaarSignature &sig, postId iqdb_id);
-    void eachBucket(const HaarSignature &sig, std::function<void(bucket_t&)> func);
+    bucket_set();
+
+    void add(const HaarSignature &sig, imageId id);
+
+    // Check if bucket (color, coef) has no IDs below `end`.
+    bool empty(int color, int coef, imageId end) const;
+
+    // The number of IDs in bucket (color, coef). This includes the IDs added
+    // after a snapshot was made, so it's only an estimate for a snapshot.
+    size_t size(int color, int coef) const;
+
+    // Decode the IDs below `end` in bucket (color, coef), in ascending order,
+    // and call `func(ids, n)` on each chunk of up to `chunk_size` of them.
+    static constexpr size_t chunk_size = 2048;
+    void eachChunk(int color, int coef, imageId end, const std::function<void(const imageId*, size_t)>& func) const;
+
+    // Return a copy of these buckets with the tails merged into the compressed
+    // arenas. If `purge` is given, the IDs of the images deleted from it are
+    // dropped too. This only reads the buckets, so it can run concurrently with
+    // queries, but not with `add`.
+    bucket_set compacted(const image_table *purge = nullptr) const;
+
+    // Merge several bucket sets with distinct IDs into one compacted set, as if
+    // every ID had been added to the same set. Each plane is merged by one of
+    // the threads of `pool`.
+    static bucket_set merged(const std::vector<bucket_set> &parts, thread_pool &pool);
+
+    // The number of IDs in the uncompressed tails and in the compressed arenas.
+    size_t tailSize() const { return tail_size_; }
+    size_t compactedSize() const { return compacted_size_; }
+
+    // The approximate number of bytes used by the buckets.
+    size_t memoryUsage() const;
+
+    // Write the buckets to a snapshot file, or replace them with the ones in a
+    // snapshot file. Only compacted buckets can be saved. The loaded posting
+    // lists are used in place in the mapped file, once they've been checked to
+    // only hold IDs below `end`, the number of images in the shard.
+    void save(snapshot_writer &out) const;
+    void load(snapshot_reader &in, imageId end);
 
 private:
     static const size_t n_colors  = 3;                     // 3 color channels (YIQ)
     static const size_t n_signs   = 2;                     // 2 Haar coefficient signs (positive and negative)
     static const size_t n_indexes = NUM_PIXELS*NUM_PIXELS; // 16384 Haar matrix indexes (128*128)
 
+    // The compressed part of a bucket.
+    struct posting_list {
+        uint64_t offset = 0; // The position of the list in the arena.
+        uint32_t bytes = 0;  // The encoded size of the list.
+        uint32_t count = 0;  // The number of IDs in the list.
+        imageId last = 0;    // The last ID in the list, which the tail's deltas continue from.
+    };
+
+    // The uncompressed part of a bucket, as a list of chunks of growing size.
+    // `count` is only increased after the new ID has been written, so a reader
+    // never sees an ID that is still being written.
+    struct tail_chunk {
+        std::unique_ptr<imageId[]> ids;
+        uint32_t capacity = 0;
+        uint32_t used = 0;
+        std::unique_ptr<tail_chunk> next;
+    };
+
+    struct tail {
+        std::unique_ptr<tail_chunk> head;
+        tail_chunk* last = nullptr;
+        std::atomic<uint32_t> count = 0;
+
+        void push_back(imageId id);
+
+        // Call `func(ids, n)` on each chunk of the first `count` IDs.
+        template <typename F> void eachChunk(uint32_t count, F func) const;
+    };
+
+    // The buckets of one color and sign. The arena is either a vector owned by
+    // `arena_owner`, or part of a mapped snapshot file.
+    struct plane {
+        const uint8_t* arena = nullptr;
+        size_t arena_size = 0;
+        std::shared_ptr<const void> arena_owner;
+        std::vector<posting_list> lists;
+        std::unique_ptr<tail[]> tails;
+    };
+
+    plane& planeOf(int color, int coef) { return planes[color][coef < 0]; }
+    const plane& planeOf(int color, int coef) const { return planes[color][coef < 0]; }
+
+    // Call `func(plane, index)` for each bucket in the signature.
+    void eachBucket(const HaarSignature &sig, std::function<void(plane&, size_t)> func);
+
+    // Call `func(id)` for each ID in the compressed part of a bucket.
+    static void eachCompressed(const plane &p, const posting_list &list, const std::function<void(imageId)>& func);
+
+    // Check that a posting list decodes within its bytes of the arena, to
+    // ascending IDs below `end` that end at its `last` ID.
+    static bool isValid(const plane &p, const posting_list &list, imageId end);
+
+    // Append `id` to a posting list being built in `arena`.
+    static void appendCompressed(std::vector<uint8_t> &arena, posting_list &list, imageId id);
+
+    // Make `arena` the arena of plane `p`.
+    static void setArena(plane &p, std::vector<uint8_t> arena);
+
     // 3 * 2 * 16384 = 98304 total buckets
-    bucket_t buckets[n_colors][n_signs][n_indexes];
+    plane planes[n_colors][n_signs];
+
+    size_t tail_size_ = 0;
+    size_t compacted_size_ = 0;
+};
+
+// A (score, image ID) pair, as collected while selecting the best results.
+using scored_image = std::pair<Score, imageId>;
+
+// A slice of the in-memory image index. The index is split into N shards so
+// that a query can score all of them in parallel. Image `id` lives in shard
+// `id % N`, at index `id / N` within that shard.
+//
+// A copy of a shard is a snapshot of it, as of when the copy was made.
+struct index_shard {
+    image_table images;
+    std::shared_ptr<bucket_set> buckets = std::make_shared<bucket_set>();
+
+    // The number of deleted images whose IDs are still in the buckets.
+    size_t unpurged = 0;
+
+    // Score every image in this shard against `signature` and return the
+    // `numres` best ones, as (raw score, index in shard) pairs in no order.
+    // Adds the number of bucket entries scanned to `*scanned`, if given.
+    std::vector<scored_image> query(const HaarSignature &signature, size_t numres, size_t* scanned = nullptr) const;
+
+    // Like `query`, but for several signatures at once. The avgl arrays are
+    // walked once for all of them, and a bucket shared by several signatures is
+    // scanned once. `scanned`, if given, must have one count per signature.
+    std::vector<std::vector<scored_image>> queryBatch(const std::vector<HaarSignature> &signatures, size_t numres, size_t* scanned = nullptr) const;
+
+    // Like `query`, but only for the images with a raw score of at most
+    // `threshold`. The buckets are scanned cheapest first, by weight per entry,
+    // and the scan stops once the weight of the remaining buckets is too low
+    // for an image that hasn't been seen yet to reach the threshold, or the
+    // `numres`th best score so far. Each image is scored from its signature,
+    // given by `signature_of(index in shard)`, the first time it's seen, so
+    // the images that are never seen are never scored at all.
+    //
+    // Returns std::nullopt, without scanning anything, if the threshold is too
+    // low to skip enough of the buckets for this to be faster than `query`.
+    std::optional<std::vector<scored_image>> queryPruned(const HaarSignature &signature, size_t numres, Score threshold, const std::function<const HaarSignature&(imageId)> &signature_of, size_t* scanned = nullptr) const;
 };
 
 }
@@ -0,0 +1,97 @@
+#ifndef IQDB_INGEST_QUEUE_H
+#define IQDB_INGEST_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <iqdb/imgdb.h>
+#include <iqdb/write_queue.h>
+
+namespace iqdb {
+
+// A queue of uploaded images to add in the background, for clients that don't
+// want to wait for the image to be decoded and added.
+//
+// Each image is a job. A fixed pool of signature workers computes the
+// signatures of the queued images. The finished signatures are then added in
+// batches by the writer thread of a `write_queue`: every signature finished
+// while a batch is waiting for the writer joins that batch. The queue is
+// bounded, so that a burst of uploads can't use up all the memory; once it's
+// full, new jobs are rejected until the workers catch up.
+class ingest_queue {
+public:
+    enum class job_state { queued, running, done, failed };
+
+    struct job_status {
+        job_state state;
+        postId post_id;
+        std::string md5;
+        HaarSignature signature; // Once the job is done.
+        std::string error;       // Why the job failed.
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    // Add a batch of images, e.g. with `IQDB::addImages`. Called by the writer.
+    using add_func = std::function<void(std::vector<image_info> images)>;
+
+    // Start `n_workers` signature workers, and queue up to `capacity` images.
+    // The status of the last `max_finished` finished jobs is kept.
+    ingest_queue(write_queue& writer, add_func add, size_t n_workers, size_t capacity, size_t max_finished = 10000);
+
+    // Finish the queued jobs, and stop the workers.
+    ~ingest_queue();
+
+    // Queue an image file to be added as `post_id`. Returns the ID of the job,
+    // or nothing if the queue is full.
+    std::optional<uint64_t> submit(postId post_id, std::string md5, std::string file);
+
+    // The status of a job, or nothing if there's no such job or it finished
+    // too long ago.
+    std::optional<job_status> status(uint64_t id) const;
+
+private:
+    struct task {
+        uint64_t id;
+        std::string file;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void worker();
+
+    // Add the finished signatures, whose jobs are put in `ids`. Runs on the writer.
+    void flush(std::vector<uint64_t>& ids);
+
+    // Mark a job as done or failed. `mutex_` must be held.
+    void finish(uint64_t id, job_state state, std::string error = "");
+
+    write_queue& writer_;
+    add_func add_;
+    const size_t capacity_;
+    const size_t max_finished_;
+
+    std::deque<task> tasks_;
+    std::vector<uint64_t> ready_;   // The jobs whose signatures are waiting for the writer.
+    bool flush_queued_ = false;     // Whether a flush is waiting for the writer.
+    std::unordered_map<uint64_t, job_status> jobs_;
+    std::deque<uint64_t> finished_; // The finished jobs, oldest first.
+    uint64_t next_id_ = 1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+}
+
+#endif
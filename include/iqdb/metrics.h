@@ -0,0 +1,149 @@
+#ifndef IQDB_METRICS_H
+#define IQDB_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace iqdb {
+
+// A metric that is exported in the Prometheus text format by `GET /metrics`.
+// Metrics are updated with relaxed atomic operations and never take a lock,
+// so they are cheap enough to use on the hot paths.
+//
+// Metrics register themselves when they are constructed, so they must be
+// globals. The metrics with the same name, which differ by their labels, must
+// be defined next to each other, since they are exported as one family.
+class metric {
+public:
+    // `labels` are in the Prometheus format without the braces, e.g. `stage="decode"`.
+    metric(const char* name, const char* help, const char* type, std::string labels = "");
+    virtual ~metric() = default;
+
+    metric(const metric&) = delete;
+    void operator=(const metric&) = delete;
+
+    // Append the metric's samples to `out`.
+    virtual void write(std::string& out) const = 0;
+
+    const char* const name;
+    const char* const help;
+    const char* const type;
+    const std::string labels;
+};
+
+// A count of events that only goes up.
+class counter : public metric {
+public:
+    counter(const char* name, const char* help, std::string labels = "") : metric(name, help, "counter", std::move(labels)) {}
+
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+    void write(std::string& out) const override;
+
+private:
+    std::atomic<uint64_t> value_ = 0;
+};
+
+// A value that can go up and down, e.g. the length of a queue.
+class gauge : public metric {
+public:
+    gauge(const char* name, const char* help, std::string labels = "") : metric(name, help, "gauge", std::move(labels)) {}
+
+    void add(int64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n = 1) { value_.fetch_sub(n, std::memory_order_relaxed); }
+    void set(int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+    void write(std::string& out) const override;
+
+private:
+    std::atomic<int64_t> value_ = 0;
+};
+
+// The distribution of a value, e.g. a duration in seconds, counted in buckets
+// with fixed upper bounds.
+class histogram : public metric {
+public:
+    histogram(const char* name, const char* help, std::string labels, std::vector<double> bounds);
+
+    // `n` bounds from `start`, each `factor` times the last one.
+    static std::vector<double> exponential(double start, double factor, size_t n);
+
+    // The bounds used for durations: 10us to 10s, in 1-2.5-5 steps.
+    static std::vector<double> seconds();
+
+    void observe(double value);
+    void write(std::string& out) const override;
+
+private:
+    const std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_; // The count of each bucket, and of the values above the last bound.
+    std::atomic<double> sum_ = 0;
+};
+
+// Observe the time from its construction to its destruction in a histogram.
+class scoped_timer {
+public:
+    explicit scoped_timer(histogram& h) : histogram_(h), start_(std::chrono::steady_clock::now()) {}
+    ~scoped_timer() { histogram_.observe(elapsed()); }
+
+    scoped_timer(const scoped_timer&) = delete;
+    void operator=(const scoped_timer&) = delete;
+
+    // The seconds since the timer was started.
+    double elapsed() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count(); }
+
+private:
+    histogram& histogram_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+// All the metrics, in the Prometheus text exposition format.
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+std::string metrics_text();
+
+namespace metrics {
+
+// How long each request to the HTTP server takes, by endpoint.
+extern histogram request_query, request_query_batch, request_add_image, request_add_images_bulk, request_remove_image;
+
+// How long each stage of adding or querying an image takes. The stages of a
+// query that run for each shard are observed once per shard.
+//   decode:    decoding and resizing an uploaded image
+//   signature: computing the signature of the resized image
+//   lumin:     scoring every image by its DC coefficients
+//   buckets:   scanning the buckets of the query's coefficients
+//   select:    selecting the best scores
+//   merge:     merging the shards' results and building the final results
+//   json:      building the JSON response
+extern histogram stage_decode, stage_signature, stage_lumin, stage_buckets, stage_select, stage_merge, stage_json;
+
+// How many bucket entries are scanned by each query.
+extern histogram query_bucket_entries;
+
+// How long writes wait for the writer thread, how long it takes to run and
+// commit a group of them, and how many are in each group.
+extern histogram write_queue_wait, write_group_duration, write_group_size;
+
+// How long the shards of a query wait for a thread of the thread pool.
+extern histogram thread_pool_wait;
+
+// How long compacting the buckets takes.
+extern histogram compaction_duration;
+
+// How long async uploads wait for a signature worker, and how long they take
+// from being queued to being added or failing.
+extern histogram ingest_wait, ingest_job_duration;
+
+extern counter queries, images_added, images_removed, ingest_rejected, query_cache_hits, query_cache_misses;
+extern gauge write_queue_depth, thread_pool_queue_depth, ingest_queue_depth, images;
+
+}
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef IQDB_QUERY_CACHE_H
+#define IQDB_QUERY_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include <iqdb/haar_signature.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+// A bounded cache of query results, so that an image that's queried over and
+// over again, e.g. by a bot checking the same upload, is only scored once.
+//
+// The results are tagged with the write epoch of the index they were computed
+// from. Every write to the index bumps the epoch, which makes all the cached
+// results stale at once without touching the cache. Stale results are misses,
+// and the clock hand replaces them without giving them another pass.
+//
+// Entries are evicted with the CLOCK algorithm: a hit marks its entry as used,
+// and the clock hand gives each used entry one more pass before evicting it.
+class query_cache {
+public:
+    // The results of a query, as `IQDB::queryFromSignature` returns them.
+    struct results {
+        sim_vector matches;
+        bucket_mask buckets;
+    };
+
+    explicit query_cache(size_t capacity);
+
+    // The cached results of a query, if they were computed as of `epoch`.
+    std::optional<results> find(const HaarSignature& signature, size_t numres, std::optional<Score> min_score, uint64_t epoch);
+
+    // Cache the results of a query computed as of `epoch`.
+    void insert(const HaarSignature& signature, size_t numres, std::optional<Score> min_score, uint64_t epoch, results value);
+
+private:
+    struct entry {
+        uint64_t key;
+        HaarSignature signature;
+        size_t numres;
+        std::optional<Score> min_score;
+        uint64_t epoch;
+        results value;
+        bool used; // Whether the entry was hit since the clock hand last passed it.
+    };
+
+    // The key of a query in `slots_`. Different queries can have the same
+    // key, so a hit still has to check that the entry is for the same query.
+    static uint64_t keyOf(const HaarSignature& signature, size_t numres, std::optional<Score> min_score);
+
+    // The entry to replace with a new one: a free one, a stale one, or the
+    // first one the clock hand finds unused.
+    size_t victim(uint64_t epoch);
+
+    const size_t capacity_;
+    std::vector<entry> entries_;
+    std::unordered_map<uint64_t, size_t> slots_; // The index in `entries_` of each key.
+    size_t hand_ = 0;
+    std::mutex mutex_;
+};
+
+}
+
+#endif
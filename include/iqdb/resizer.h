@@ -25,12 +25,17 @@
 #include <gd.h>
 #include <memory>
 
+// AVIF support was added in libgd 2.3.2.
+#if GD_MAJOR_VERSION > 2 || (GD_MAJOR_VERSION == 2 && (GD_MINOR_VERSION > 3 || (GD_MINOR_VERSION == 3 && GD_RELEASE_VERSION >= 2)))
+#define IQDB_GD_HAVE_AVIF 1
+#endif
+
 namespace iqdb {
 
 typedef std::unique_ptr<gdImage, decltype(&gdImageDestroy)> RawImage;
 
 // Take image data at given memory location and length, and resize
-// to thu_x*thu_y and return it.
+// to thu_x*thu_y and return it. The result is always a truecolor image.
 RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y);
 
 }
@@ -1,13 +1,52 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <cstddef>
+#include <ctime>
+#include <optional>
 #include <string>
+#include <vector>
 #include <iqdb/imgdb.h>
 
 namespace iqdb {
 
+// Options for `iqdb http`, given as `--name=value` on the command line.
+struct http_options {
+    size_t shards = 1;             // --shards: how many slices to split the in-memory index into.
+    std::string snapshot;          // --snapshot: the snapshot file to load the in-memory index from and save it to.
+    size_t threads = 0;            // --threads: how many requests to handle at once, or 0 for httplib's default.
+    size_t keep_alive_max = 100;   // --keep-alive-max: how many requests a keep-alive connection can make.
+    time_t keep_alive_timeout = 5; // --keep-alive-timeout: how many seconds an idle keep-alive connection is kept.
+    size_t max_payload = 0;        // --max-payload: the largest request body accepted, in bytes, or 0 for no limit.
+    size_t ingest_threads = 0;     // --ingest-threads: how many threads compute the signatures of async uploads, or 0 for one per CPU.
+    size_t ingest_queue = 1024;    // --ingest-queue: how many async uploads can wait for a signature worker.
+    size_t query_cache = 1024;     // --query-cache: how many query results to cache until the next write, or 0 for none.
+};
+
 void help();
-void http_server(const std::string host, const int port, const std::string database_filename);
+void http_server(const std::string host, const int port, const std::string database_filename, const http_options& options = {});
+
+// Run a coordinator on host/port, with the same API as `http_server`, in front
+// of the `iqdb http` servers at `shard_urls` (e.g. "http://10.0.0.1:5588").
+// Each post is stored on one shard, picked by a hash of its post ID, and each
+// query is sent to every shard. The shards must always be given in the same
+// order. Only the `threads`, `keep_alive_*` and `max_payload` options are used.
+void coordinator_server(const std::string host, const int port, const std::vector<std::string>& shard_urls, const http_options& options = {});
+
+// Make a running `http_server` or `coordinator_server` stop listening and return, as SIGINT or SIGTERM do.
+void stop_http_server();
+
+// The matches of a query on one shard, as `POST /query?buckets=true` returns them.
+struct shard_matches {
+    sim_vector matches;
+    bucket_mask buckets; // The buckets that aren't empty in the shard.
+    bool exact = false;  // Whether the matches are exact duplicates.
+};
+
+// Merge the matches of a query on every shard of a coordinator into the top
+// `limit` matches one instance holding all of their images would give. The
+// matches are moved out of `shards`.
+sim_vector merge_shard_matches(const HaarSignature& signature, std::vector<shard_matches>& shards, size_t limit, std::optional<Score> min_score);
 
 }
 
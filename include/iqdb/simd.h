@@ -0,0 +1,41 @@
+#ifndef IQDB_SIMD_H
+#define IQDB_SIMD_H
+
+#include <cstddef>
+
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+// The vector instruction sets the query kernels are implemented for. The best
+// level supported by the CPU is picked at runtime, so a generic x86-64 build
+// still uses AVX2 or AVX-512 where available.
+enum class simd_level { scalar, avx2, avx512 };
+
+// The kernels for the two inner loops of `IQDB::queryFromSignature`.
+struct simd_kernels {
+    simd_level level;
+    const char* name;
+
+    // Set `scores[i] = sum(weight[c] * |avgl[c][i] - query[c]|)` over the
+    // first `n_colors` color channels, for every image `i < n`.
+    void (*lumin_distance)(Score* scores, const Score* const avgl[3], const Score query[3], const Score weight[3], int n_colors, size_t n);
+
+    // Do `scores[ids[i]] -= weight` for every `i < n`. The IDs in `ids` must be
+    // unique, which is always true for the IDs in a bucket.
+    void (*subtract_weight)(Score* scores, const imageId* ids, size_t n, Score weight);
+};
+
+// Get the kernels for the best instruction set supported by this CPU.
+const simd_kernels& get_simd_kernels();
+
+// Get the kernels for a given instruction set. Falls back to the scalar
+// kernels if the CPU doesn't support the requested one.
+const simd_kernels& get_simd_kernels(simd_level level);
+
+// Check if the CPU supports a given instruction set.
+bool simd_supported(simd_level level);
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef IQDB_SNAPSHOT_H
+#define IQDB_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace iqdb {
+
+// Thrown when a snapshot file can't be written, or is missing, truncated or
+// incompatible when read.
+class snapshot_error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// The on-disk snapshot format is a flat sequence of values in native byte
+// order. Arrays are aligned to 8 bytes, so that a reader can use them in place
+// in the mapped file.
+
+// Write a snapshot file.
+class snapshot_writer {
+public:
+    explicit snapshot_writer(const std::string& path);
+
+    template <typename T>
+    void write(const T& value) { writeBytes(&value, sizeof(T)); }
+
+    template <typename T>
+    void writeArray(const T* data, size_t n) {
+        align();
+        writeBytes(data, n * sizeof(T));
+    }
+
+    void writeString(const std::string& value);
+
+    // Flush the file, and throw if anything failed to be written.
+    void close();
+
+private:
+    void align();
+    void writeBytes(const void* data, size_t n);
+
+    std::ofstream out_;
+    uint64_t size_ = 0;
+};
+
+// Read a snapshot file, by mapping it read-only into memory.
+class snapshot_reader {
+public:
+    explicit snapshot_reader(const std::string& path);
+
+    template <typename T>
+    T read() {
+        T value;
+        std::memcpy(&value, readBytes(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    // Return a pointer to `n` values in the mapped file. The pointer is valid
+    // for as long as `mapping()` is kept alive.
+    template <typename T>
+    const T* readArray(size_t n) {
+        align();
+        return reinterpret_cast<const T*>(readBytes(n * sizeof(T)));
+    }
+
+    std::string readString();
+
+    // The mapped file, which is unmapped once this and every copy of it are gone.
+    const std::shared_ptr<const void>& mapping() const { return mapping_; }
+
+private:
+    void align();
+    const uint8_t* readBytes(size_t n);
+
+    std::shared_ptr<const void> mapping_;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+};
+
+}
+
+#endif
@@ -3,10 +3,12 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <sqlite_orm/sqlite_orm.h>
@@ -19,27 +21,49 @@ namespace iqdb {
 struct Image {
     postId post_id;        // The external (Danbooru) post ID.
     std::string md5;
-    double avglf1;         // The `double avglf[3]` array.
-    double avglf2;
-    double avglf3;
-    std::vector<char> sig; // The `int16_t sig[3][40]` array, stored as a binary blob.
+    std::vector<char> sig; // The signature, as encoded by `HaarSignature::encode()`.
 
     HaarSignature haar() const;
 };
 
-// Initialize the database, creating the table if it doesn't exist.
+// A row of the images table, as read by `SqliteDB::eachImageRow`. The strings
+// and the signature point into SQLite's own buffers, so they are only valid
+// until the next row is read.
+struct ImageRow {
+    std::string_view post_id;
+    std::string_view md5;
+    std::string_view sig; // The encoded signature.
+};
+
+// A model representing a change to the images table. When the database is
+// opened to keep a snapshot up to date, every add or remove of an image is
+// logged, so that a snapshot of the in-memory index can be brought up to date
+// by replaying the changes made after it was written.
+//
+// When it's opened without logging changes, the log is replaced by a single
+// change with an empty post ID. A snapshot older than that change may have
+// missed changes, so it can't be brought up to date.
+struct Change {
+    int64_t seq;    // Increases with every change.
+    postId post_id; // The post that was added or removed, or "" if changes weren't logged after this one.
+};
+
+// Initialize the database, creating the table if it doesn't exist. An images
+// table in the old layout, with the signature as three avglf columns and the
+// raw coefficients, has to be moved out of the way by `SqliteDB` first.
 static auto initStorage(const std::string& path = ":memory:") {
     using namespace sqlite_orm;
 
     auto storage = make_storage(path,
         // index has to be made before the table, it's done in reverse order as input
         make_index("idx_images_md5", &Image::md5),
+        make_table("changes",
+            make_column("seq",     &Change::seq, autoincrement(), primary_key()),
+            make_column("post_id", &Change::post_id)
+        ),
         make_table("images",
             make_column("post_id",  &Image::post_id, primary_key()),
             make_column("md5",  &Image::md5),
-            make_column("avglf1",   &Image::avglf1),
-            make_column("avglf2",   &Image::avglf2),
-            make_column("avglf3",   &Image::avglf3),
             make_column("sig",      &Image::sig)
         )
     );
@@ -53,27 +77,92 @@ class SqliteDB {
 public:
     using Storage = decltype(initStorage());
 
-    // Open database at path. Default to a temporary memory-only database.
-    SqliteDB(const std::string& path = ":memory:") : storage_(initStorage(path)) {};
+    // Open database at path. Default to a temporary memory-only database. The
+    // changes to the images table are only logged if `log_changes` is set.
+    SqliteDB(const std::string& path = ":memory:", bool log_changes = false);
 
     // Get an image from the database, if it exists.
     std::optional<Image> getImage(postId post_id);
 
     std::vector<Image> getByMD5(const std::string& md5);
 
-    // Add the image to the database. Replace the image if it already exists. Returns the internal IQDB id.
+    // Add the image to the database. Replace the image if it already exists.
     void addImage(postId post_id, const std::string& md5, HaarSignature signature);
 
     // Remove the image from the database.
     void removeImage(postId post_id);
 
+    // Call `func`, committing the images it adds and removes in a single
+    // transaction. This is much faster than committing each change on its own.
+    // If a transaction is already open, `func` just runs as part of it.
+    void transaction(const std::function<void ()>& func);
+
+    // Call `func` in a savepoint of the open transaction. If `func` throws, the
+    // changes it made are rolled back, and the rest of the transaction is kept.
+    void savepoint(const std::function<void ()>& func);
+
     // Call a function for each image in the database.
     void eachImage(std::function<void (const Image&)>);
 
+    // Like `eachImage`, but without copying each row into an `Image`.
+    void eachImageRow(const std::function<void (const ImageRow&)>& func);
+
+    // The sequence number of the last change, or 0 if nothing was changed.
+    int64_t lastChange();
+
+    // The posts changed after change `seq`, in the order they were last changed.
+    std::vector<postId> changesSince(int64_t seq);
+
+    // Forget the changes before change `seq`. The last change is always kept,
+    // so `lastChange()` keeps increasing.
+    void trimChanges(int64_t seq);
+
 private:
+    using Statement = std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)>;
+
+    // Compile a statement, which is kept for as long as the database is open.
+    Statement prepare(const char* sql);
+
+    // Run a statement that returns no rows, and reset it so it can be run again.
+    void execute(const Statement& stmt);
+
+    // Log a change to the images table, if changes are logged. Must be called
+    // in a transaction.
+    void logChange(const postId& post_id);
+
+    // Replace the change log with a change saying that the changes after it
+    // aren't logged.
+    void stopLoggingChanges();
+
+    // Insert or replace an image, without logging the change.
+    void insertImage(std::string_view post_id, std::string_view md5, const HaarSignature& signature);
+
+    // Copy the images left in the old layout by `initStorage` to the images
+    // table, encoding their signatures.
+    void migrate();
+
     // The SQLite database.
     Storage storage_;
 
+    // The connection to the database, which is kept open so the prepared
+    // statements stay valid.
+    sqlite3* db_;
+
+    // Whether the changes to the images table are logged.
+    bool log_changes_;
+
+    // The prepared statements used to write to the database. They're declared
+    // after `storage_`, so they're finalized before the connection is closed.
+    Statement begin_;
+    Statement commit_;
+    Statement rollback_;
+    Statement savepoint_;
+    Statement release_;
+    Statement rollback_to_;
+    Statement insert_image_;
+    Statement delete_image_;
+    Statement insert_change_;
+
     // A mutex around the database
     std::shared_mutex sql_mutex_;
 };
@@ -0,0 +1,43 @@
+#ifndef IQDB_THREAD_POOL_H
+#define IQDB_THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace iqdb {
+
+// A fixed-size pool of worker threads, shared by all queries.
+class thread_pool {
+public:
+    explicit thread_pool(size_t n_threads);
+    ~thread_pool();
+
+    // Call `func(i)` for every `i < n`, spread across the pool, and wait for all
+    // calls to finish. The calling thread runs tasks too, so this never waits
+    // on a pool that is busy with other work. If a call throws, the first
+    // exception is rethrown after all calls have finished.
+    void parallel_for(size_t n, const std::function<void(size_t)>& func);
+
+    size_t size() const { return threads_.size(); }
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads_;
+    // The queued tasks, and when they were queued.
+    std::deque<std::pair<std::function<void()>, std::chrono::steady_clock::time_point>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+}
+
+#endif
@@ -2,13 +2,18 @@
 #define IQDB_TYPES_H_N
 
 #include <cstdint>
+#include <string>
 
 namespace iqdb {
 
 using postId = std::string; // An external (Danbooru) post ID.
 
+// An internal, dense IQDB image index. Assigned sequentially as images are
+// loaded, and never exposed outside of the `IQDB` class.
+using imageId = uint32_t;
+
 // The type used for calculating similarity scores during queries, and for
-// storing `avgl` values in the `m_info` array.
+// storing `avgl` values in the `image_table`.
 using Score = float;
 
 }
@@ -0,0 +1,69 @@
+#ifndef IQDB_WRITE_QUEUE_H
+#define IQDB_WRITE_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace iqdb {
+
+// A queue of jobs that are run one at a time, in order, by a single writer
+// thread. All changes to the database go through this queue, so the request
+// threads never wait on each other for the write lock, and a job can rely on
+// no other write happening while it runs.
+//
+// The jobs are run in groups, for group commit: the writer runs every job that
+// was queued while it was busy (up to `max_group` of them) inside a single call
+// to `group`. A job is only done once `group` returns, so a caller waiting on
+// it knows its changes were committed along with the rest of the group. Each
+// job of a group is run by `each`, e.g. in a savepoint, so that a job that
+// fails can be undone without undoing the rest of its group.
+class write_queue {
+public:
+    // Run `group_jobs()` for each group of jobs, e.g. in a database transaction.
+    using group_func = std::function<void(const std::function<void()>& group_jobs)>;
+
+    // Run a job of a group, e.g. in a savepoint of the group's transaction.
+    using job_func = std::function<void(const std::function<void()>& job)>;
+
+    // Without a `group` function, each job is run on its own. Without an
+    // `each` function, the jobs of a group are just called.
+    write_queue(group_func group = nullptr, job_func each = nullptr, size_t max_group = 1024);
+    ~write_queue();
+
+    // Queue a job and return a future that is ready once the job has run. If
+    // the job, or the group it was run in, throws, the exception is rethrown by
+    // `future.get()`.
+    std::future<void> submit(std::function<void()> job);
+
+    // Queue a job and wait for it to run.
+    void run(std::function<void()> job) { submit(std::move(job)).get(); }
+
+private:
+    struct job {
+        std::function<void()> func;
+        std::promise<void> done;
+        std::exception_ptr error;
+        std::chrono::steady_clock::time_point queued;
+    };
+
+    void worker();
+
+    group_func group_;
+    job_func each_;
+    size_t max_group_;
+
+    std::deque<job> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}
+
+#endif
@@ -0,0 +1,208 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <fmt/format.h>
+#include <nlohmann/json.hpp>
+
+#include <iqdb/bulk.h>
+#include <iqdb/debug.h>
+#include <iqdb/sqlite_db.h>
+
+using nlohmann::json;
+
+namespace iqdb {
+
+bulk_parser::bulk_parser(bulk_format format, std::function<void(image_info&&)> func) : format_(format), func_(std::move(func)) {
+}
+
+void bulk_parser::feed(const char* data, size_t size) {
+    // Only the incomplete line or record at the end of a chunk is copied.
+    if (buffer_.empty()) {
+        const size_t used = parse(data, size);
+        buffer_.assign(data + used, size - used);
+    } else {
+        buffer_.append(data, size);
+        const size_t used = parse(buffer_.data(), buffer_.size());
+        buffer_.erase(0, used);
+    }
+}
+
+void bulk_parser::finish() {
+    if (format_ == bulk_format::ndjson && !buffer_.empty()) {
+        // The last line doesn't need to end with a newline.
+        line_++;
+        parseLine(buffer_);
+        buffer_.clear();
+    } else if (!buffer_.empty()) {
+        throw param_error(fmt::format("image #{}: the stream ends in the middle of the image", count_ + 1));
+    }
+}
+
+size_t bulk_parser::parse(const char* data, size_t size) {
+    return format_ == bulk_format::ndjson ? parseLines(data, size) : parseRecords(data, size);
+}
+
+size_t bulk_parser::parseLines(const char* data, size_t size) {
+    size_t pos = 0;
+
+    while (const char* end = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos))) {
+        line_++;
+        parseLine(std::string_view(data + pos, end - (data + pos)));
+        pos = end - data + 1;
+    }
+
+    return pos;
+}
+
+void bulk_parser::parseLine(std::string_view line) {
+    if (line.find_first_not_of(" \t\r") == std::string_view::npos) {
+        return;
+    }
+
+    try {
+        const json object = json::parse(line.begin(), line.end());
+        const json& post_id = object.at("post_id");
+
+        // Post IDs are strings, but numeric post IDs are accepted too.
+        emit(post_id.is_number_integer() ? post_id.dump() : post_id.get<std::string>(),
+             object.at("md5").get<std::string>(),
+             HaarSignature::from_hash(object.at("hash").get<std::string>()));
+    } catch (const json::exception& e) {
+        throw param_error(fmt::format("line {}: {}", line_, e.what()));
+    } catch (const param_error& e) {
+        throw param_error(fmt::format("line {}: {}", line_, e.what()));
+    }
+}
+
+size_t bulk_parser::parseRecords(const char* data, size_t size) {
+    size_t pos = 0;
+
+    // Read a length-prefixed string at `p`, or return false if the record isn't complete.
+    auto read_string = [&](size_t& p, std::string& value) {
+        uint16_t length;
+        if (size - p < sizeof(length)) {
+            return false;
+        }
+
+        std::memcpy(&length, data + p, sizeof(length));
+        if (size - p - sizeof(length) < length) {
+            return false;
+        }
+
+        value.assign(data + p + sizeof(length), length);
+        p += sizeof(length) + length;
+        return true;
+    };
+
+    while (true) {
+        size_t p = pos;
+        std::string post_id, md5;
+        HaarSignature haar;
+
+        if (!read_string(p, post_id) || !read_string(p, md5) || size - p < sizeof(haar.avglf) + sizeof(haar.sig)) {
+            return pos;
+        }
+
+        std::memcpy(haar.avglf, data + p, sizeof(haar.avglf));
+        std::memcpy(haar.sig, data + p + sizeof(haar.avglf), sizeof(haar.sig));
+        pos = p + sizeof(haar.avglf) + sizeof(haar.sig);
+
+        try {
+            emit(std::move(post_id), std::move(md5), haar);
+        } catch (const param_error& e) {
+            throw param_error(fmt::format("image #{}: {}", count_ + 1, e.what()));
+        }
+    }
+}
+
+void bulk_parser::emit(postId post_id, std::string md5, HaarSignature haar) {
+    if (post_id.empty()) {
+        throw param_error("the post ID is empty");
+    }
+
+    // The coefficients index the buckets, so a corrupt signature must never reach them.
+    for (int c = 0; c < 3; c++) {
+        for (int16_t coef : haar.sig[c]) {
+            if (coef == 0 || std::abs(coef) >= NUM_PIXELS_SQUARED) {
+                throw param_error(fmt::format("invalid coefficient {} in signature", coef));
+            }
+        }
+    }
+
+    // The constructor sorts the coefficients, which a hand-made signature may not have.
+    haar = HaarSignature(haar.avglf, haar.sig);
+
+    count_++;
+    func_(image_info{ std::move(post_id), std::move(md5), haar });
+}
+
+void import_file(const std::string& input, const std::string& database_filename, const import_options& options) {
+    std::ifstream file;
+    if (input != "-") {
+        file.open(input, std::ios::binary);
+        if (!file) {
+            throw param_error("couldn't open " + input);
+        }
+    }
+
+    std::istream& in = input == "-" ? std::cin : file;
+    INFO("importing images from {} [format={}]\n", input == "-" ? "stdin" : input, options.format == bulk_format::ndjson ? "ndjson" : "binary");
+
+    // The images are only written to the DB here, not loaded into memory; the
+    // snapshot is rebuilt from the DB once they're all in.
+    SqliteDB sqlite_db(database_filename);
+    std::vector<image_info> batch;
+    auto flush = [&] {
+        sqlite_db.transaction([&] {
+            for (const auto& image : batch) {
+                sqlite_db.addImage(image.post_id, image.md5, image.haar);
+            }
+        });
+        batch.clear();
+    };
+
+    bulk_parser parser(options.format, [&](image_info&& image) {
+        batch.push_back(std::move(image));
+        if (batch.size() == bulk_batch_size) {
+            flush();
+        }
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    auto last_progress = start;
+    std::vector<char> chunk(1024 * 1024);
+
+    while (in) {
+        in.read(chunk.data(), chunk.size());
+        parser.feed(chunk.data(), in.gcount());
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now - last_progress >= std::chrono::seconds(5)) {
+            const double seconds = std::chrono::duration<double>(now - start).count();
+            INFO("imported {} images ({:.0f} images/sec)...\n", parser.count(), parser.count() / seconds);
+            last_progress = now;
+        }
+    }
+
+    if (in.bad()) {
+        throw fatal_error("couldn't read " + input);
+    }
+
+    parser.finish();
+    flush();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    INFO("imported {} images in {:.1f}s\n", parser.count(), seconds);
+
+    if (!options.snapshot.empty()) {
+        IQDB db(database_filename, options.shards);
+        db.saveSnapshot(options.snapshot);
+    }
+}
+
+}
@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
 #include <vector>
 
-#include <fmt/format.h>
 #include <nlohmann/json.hpp>
 #include <iqdb/haar_signature.h>
 #include <iqdb/haar.h>
 #include <iqdb/imgdb.h>
+#include <iqdb/metrics.h>
 #include <iqdb/resizer.h>
 
 namespace iqdb {
@@ -18,6 +23,42 @@ HaarSignature::HaarSignature(lumin_t avglf_, signature_t sig_) {
   std::sort(&sig[2][0], &sig[2][NUM_COEFS]);
 }
 
+// Write `value` to `out` as `digits` hex digits, most significant first.
+static char* put_hex(char* out, uint64_t value, int digits) {
+  static const char hex_digits[] = "0123456789abcdef";
+
+  for (int i = digits - 1; i >= 0; i--) {
+    out[i] = hex_digits[value & 0xF];
+    value >>= 4;
+  }
+
+  return out + digits;
+}
+
+// Read `digits` hex digits from `in`. Returns false if any of them isn't one.
+static bool get_hex(const char* in, int digits, uint64_t& value) {
+  value = 0;
+
+  for (int i = 0; i < digits; i++) {
+    const char c = in[i];
+    int nibble;
+
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = c - 'A' + 10;
+    } else {
+      return false;
+    }
+
+    value = value << 4 | static_cast<uint64_t>(nibble);
+  }
+
+  return true;
+}
+
 HaarSignature HaarSignature::from_hash(const std::string hash) {
     if (hash.size() != 5 + 2*sizeof(HaarSignature)) {
         throw param_error("Invalid hash (hash=" + hash + ")");
@@ -25,71 +66,245 @@ HaarSignature HaarSignature::from_hash(const std::string hash) {
 
     HaarSignature haar;
     const char* p = hash.c_str() + 5; // skip "iqdb_" prefix
+    uint64_t value;
 
     for (double& avglf : haar.avglf) {
-        sscanf(p, "%16lx", reinterpret_cast<uint64_t*>(&avglf));
+        if (!get_hex(p, 16, value)) {
+            throw param_error("Invalid hash (hash=" + hash + ")");
+        }
+
+        std::memcpy(&avglf, &value, sizeof(avglf));
         p += 2 * sizeof(uint64_t);
     }
 
     for (int c = 0; c < 3; c++) {
         for (int16_t& coef : haar.sig[c]) {
-            sscanf(p, "%4hx", reinterpret_cast<uint16_t*>(&coef));
+            if (!get_hex(p, 4, value)) {
+                throw param_error("Invalid hash (hash=" + hash + ")");
+            }
+
+            coef = static_cast<int16_t>(static_cast<uint16_t>(value));
             p += 2 * sizeof(int16_t);
         }
     }
 
+    if (!haar.is_valid()) {
+        throw param_error("Invalid hash: a coefficient is out of range (hash=" + hash + ")");
+    }
+
     return haar;
 }
 
-HaarSignature HaarSignature::from_file_content(const std::string blob) {
+// Whether a coefficient can index the buckets: 0 is the avgl value, and isn't
+// one of the coefficients.
+static bool valid_coef(int32_t coef) {
+  return coef != 0 && std::abs(coef) < NUM_PIXELS_SQUARED;
+}
+
+HaarSignature HaarSignature::from_bytes(std::string_view bytes) {
+  if (bytes.size() != sizeof(lumin_t) + sizeof(signature_t)) {
+    throw param_error("Invalid signature: it's " + std::to_string(bytes.size()) + " bytes, not " + std::to_string(sizeof(lumin_t) + sizeof(signature_t)));
+  }
+
+  HaarSignature haar;
+  std::memcpy(haar.avglf, bytes.data(), sizeof(lumin_t));
+  std::memcpy(haar.sig, bytes.data() + sizeof(lumin_t), sizeof(signature_t));
+
+  for (int c = 0; c < 3; c++) {
+    for (int16_t coef : haar.sig[c]) {
+      if (!valid_coef(coef)) {
+        throw param_error("Invalid signature: coefficient " + std::to_string(coef) + " is out of range");
+      }
+    }
+  }
+
+  return HaarSignature(haar.avglf, haar.sig);
+}
+
+std::string HaarSignature::to_bytes() const {
+  std::string bytes(sizeof(lumin_t) + sizeof(signature_t), '\0');
+  std::memcpy(bytes.data(), avglf, sizeof(lumin_t));
+  std::memcpy(bytes.data() + sizeof(lumin_t), sig, sizeof(signature_t));
+  return bytes;
+}
+
+// The working planes of from_file_content. Each thread allocates its own once
+// and reuses it, so computing a signature doesn't allocate them every time.
+struct haar_scratch {
+  unsigned char rchan[NUM_PIXELS_SQUARED];
+  unsigned char gchan[NUM_PIXELS_SQUARED];
+  unsigned char bchan[NUM_PIXELS_SQUARED];
+  float cdata1[NUM_PIXELS_SQUARED];
+  float cdata2[NUM_PIXELS_SQUARED];
+  float cdata3[NUM_PIXELS_SQUARED];
+};
+
+static thread_local std::unique_ptr<haar_scratch> scratch;
+
+HaarSignature HaarSignature::from_file_content(std::string_view blob) {
   HaarSignature signature;
-  std::vector<unsigned char> rchan(NUM_PIXELS * NUM_PIXELS);
-  std::vector<unsigned char> gchan(NUM_PIXELS * NUM_PIXELS);
-  std::vector<unsigned char> bchan(NUM_PIXELS * NUM_PIXELS);
 
-  auto image = resize_image_data((const unsigned char *)blob.data(), blob.size(), NUM_PIXELS, NUM_PIXELS);
+  if (!scratch) {
+    scratch = std::make_unique<haar_scratch>();
+  }
+  haar_scratch& s = *scratch;
+
+  RawImage image(nullptr, &gdImageDestroy);
+  {
+    scoped_timer timer(metrics::stage_decode);
+    image = resize_image_data((const unsigned char *)blob.data(), blob.size(), NUM_PIXELS, NUM_PIXELS);
+  }
 
+  scoped_timer timer(metrics::stage_signature);
   for (int y = 0; y < NUM_PIXELS; y++) {
     for (int x = 0; x < NUM_PIXELS; x++) {
-      // https://libgd.github.io/manuals/2.3.1/files/gd-c.html#gdImageGetPixel
+      // The resized image is always truecolor, so its pixels can be read directly.
+      // https://libgd.github.io/manuals/2.3.1/files/gd-h.html#gdImageTrueColorPixel
       // https://libgd.github.io/manuals/2.3.1/files/gd-h.html#gdTrueColorGetRed
-      int pixel = gdImageGetPixel(image.get(), x, y);
-      rchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetRed(pixel));
-      gchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetGreen(pixel));
-      bchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetBlue(pixel));
+      int pixel = gdImageTrueColorPixel(image.get(), x, y);
+      s.rchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetRed(pixel));
+      s.gchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetGreen(pixel));
+      s.bchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetBlue(pixel));
     }
   }
 
-  std::vector<Unit> cdata1(NUM_PIXELS * NUM_PIXELS);
-  std::vector<Unit> cdata2(NUM_PIXELS * NUM_PIXELS);
-  std::vector<Unit> cdata3(NUM_PIXELS * NUM_PIXELS);
-  transformChar(rchan.data(), gchan.data(), bchan.data(), cdata1.data(), cdata2.data(), cdata3.data());
-  calcHaar(cdata1.data(), cdata2.data(), cdata3.data(), signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
-
-  std::sort(&signature.sig[0][0], &signature.sig[0][NUM_COEFS]);
-  std::sort(&signature.sig[1][0], &signature.sig[1][NUM_COEFS]);
-  std::sort(&signature.sig[2][0], &signature.sig[2][NUM_COEFS]);
+  transformChar(s.rchan, s.gchan, s.bchan, s.cdata1, s.cdata2, s.cdata3);
+  calcHaar(s.cdata1, s.cdata2, s.cdata3, signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
 
   return signature;
 }
 
 std::string HaarSignature::to_string() const {
-  std::string str = "iqdb_";
-  str.reserve(5 + sizeof(HaarSignature)*2);
+  std::string str(5 + sizeof(HaarSignature)*2, '\0');
+  std::memcpy(str.data(), "iqdb_", 5);
+  char* p = str.data() + 5;
 
-  str += fmt::format("{:016x}", reinterpret_cast<const uint64_t&>(avglf[0]));
-  str += fmt::format("{:016x}", reinterpret_cast<const uint64_t&>(avglf[1]));
-  str += fmt::format("{:016x}", reinterpret_cast<const uint64_t&>(avglf[2]));
+  for (double value : avglf) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    p = put_hex(p, bits, 16);
+  }
 
   for (size_t c = 0; c < 3; c++) {
     for (size_t i = 0; i < NUM_COEFS; i++) {
-      str += fmt::format("{:04x}", reinterpret_cast<const uint16_t&>(sig[c][i]));
+      p = put_hex(p, static_cast<uint16_t>(sig[c][i]), 4);
     }
   }
 
   return str;
 }
 
+// The version of the encoding written by `encode()`.
+static const uint8_t encoding_version = 1;
+
+// Append `value` to `out` as a varint: 7 bits per byte, least significant
+// bits first, with the high bit set on every byte but the last.
+static void put_varint(std::string& out, uint32_t value) {
+  while (value >= 0x80) {
+    out += static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+
+  out += static_cast<char>(value);
+}
+
+// Read a varint of at most 3 bytes, which is all a coefficient needs.
+static bool get_varint(std::string_view data, size_t& pos, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 21 && pos < data.size(); shift += 7) {
+    const uint8_t byte = static_cast<uint8_t>(data[pos++]);
+    value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string HaarSignature::encode() const {
+  std::string out;
+  out.reserve(1 + 3 * sizeof(float) + 3 * NUM_COEFS * 2);
+  out += static_cast<char>(encoding_version);
+
+  for (double value : avglf) {
+    const float f = static_cast<float>(value);
+    out.append(reinterpret_cast<const char*>(&f), sizeof(f));
+  }
+
+  // The coefficients are at most 15 bits plus a sign. Sorted, most of the
+  // gaps between them fit in one or two bytes. The first one is zigzag coded,
+  // so that it's positive.
+  for (int c = 0; c < 3; c++) {
+    // The signatures in the index are already sorted.
+    Idx coefs[NUM_COEFS];
+    std::copy(sig[c], sig[c] + NUM_COEFS, coefs);
+    if (!std::is_sorted(coefs, coefs + NUM_COEFS)) {
+      std::sort(coefs, coefs + NUM_COEFS);
+    }
+
+    const int32_t first = coefs[0];
+    put_varint(out, (static_cast<uint32_t>(first) << 1) ^ static_cast<uint32_t>(first >> 31));
+    for (int i = 1; i < NUM_COEFS; i++) {
+      put_varint(out, static_cast<uint32_t>(coefs[i] - coefs[i - 1]));
+    }
+  }
+
+  return out;
+}
+
+std::optional<HaarSignature> HaarSignature::decode(std::string_view data) {
+  HaarSignature signature;
+  size_t pos = 1 + 3 * sizeof(float);
+
+  if (data.size() < pos || static_cast<uint8_t>(data[0]) != encoding_version) {
+    return std::nullopt;
+  }
+
+  for (int c = 0; c < 3; c++) {
+    float f;
+    std::memcpy(&f, data.data() + 1 + c * sizeof(float), sizeof(f));
+    signature.avglf[c] = f;
+  }
+
+  for (int c = 0; c < 3; c++) {
+    int32_t coef = 0;
+
+    for (int i = 0; i < NUM_COEFS; i++) {
+      uint32_t value;
+      if (!get_varint(data, pos, value)) {
+        return std::nullopt;
+      }
+
+      coef = i == 0 ? static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1) : coef + static_cast<int32_t>(value);
+      if (!valid_coef(coef)) {
+        return std::nullopt;
+      }
+
+      signature.sig[c][i] = static_cast<Idx>(coef);
+    }
+  }
+
+  if (pos != data.size()) {
+    return std::nullopt;
+  }
+
+  return signature;
+}
+
+HaarSignature HaarSignature::quantized() const {
+  // Round-tripping is the simplest way to be sure it's the same. Rounding a
+  // copy's avgl values in place comes out wrong with GCC 12.2 at -O2, which
+  // leaves two of them unrounded; it's right with -fno-tree-slp-vectorize.
+  std::optional<HaarSignature> decoded = decode(encode());
+  if (!decoded) {
+    throw param_error("Invalid signature: a coefficient is out of range");
+  }
+
+  return *decoded;
+}
+
 std::string HaarSignature::to_json() const {
   return nlohmann::json({
     { "avglf", avglf },
@@ -97,10 +312,47 @@ std::string HaarSignature::to_json() const {
   }).dump();
 }
 
+uint64_t HaarSignature::digest() const noexcept {
+  // The signature is hashed 8 bytes at a time, and mixed at the end so that
+  // every bit of the digest depends on every bit of the signature.
+  static_assert(sizeof(HaarSignature) % sizeof(uint64_t) == 0);
+  uint64_t words[sizeof(HaarSignature) / sizeof(uint64_t)];
+  std::memcpy(words, this, sizeof(words));
+
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+  for (uint64_t word : words) {
+    h = (h ^ word) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+bool HaarSignature::operator==(const HaarSignature& other) const noexcept {
+  return std::memcmp(this, &other, sizeof(HaarSignature)) == 0;
+}
+
 bool HaarSignature::is_grayscale() const noexcept {
   return std::abs(avglf[1]) + std::abs(avglf[2]) < 6.0 / 1000;
 }
 
+bool HaarSignature::is_valid() const noexcept {
+  for (int c = 0; c < 3; c++) {
+    for (int16_t coef : sig[c]) {
+      if (!valid_coef(coef)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 int HaarSignature::num_colors() const noexcept {
   return is_grayscale() ? 1 : 3;
 }
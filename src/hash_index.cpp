@@ -0,0 +1,72 @@
+#include <algorithm>
+
+#include <iqdb/hash_index.h>
+
+namespace iqdb {
+
+hash_index::hash_index(size_t capacity) {
+    size_t n = 16;
+    while (n < capacity) {
+        n *= 2;
+    }
+
+    slots_ = std::make_unique<std::atomic<uint64_t>[]>(n);
+    mask_ = n - 1;
+
+    for (size_t i = 0; i < n; i++) {
+        slots_[i].store(empty, std::memory_order_relaxed);
+    }
+}
+
+bool hash_index::insert(uint64_t key, imageId id) {
+    // Keep the table at most half full, so that lookups stay short.
+    if ((used_ + 1) * 2 > mask_ + 1) {
+        return false;
+    }
+
+    size_t pos = slotOf(key);
+    while (static_cast<imageId>(slots_[pos].load(std::memory_order_relaxed)) != empty) {
+        pos = (pos + 1) & mask_;
+    }
+
+    slots_[pos].store((key >> 32 << 32) | id, std::memory_order_release);
+    used_++;
+    size_++;
+    return true;
+}
+
+void hash_index::erase(uint64_t key, imageId id) {
+    const uint64_t slot = (key >> 32 << 32) | id;
+
+    for (size_t pos = slotOf(key);; pos = (pos + 1) & mask_) {
+        const uint64_t current = slots_[pos].load(std::memory_order_relaxed);
+
+        if (static_cast<imageId>(current) == empty) {
+            return;
+        } else if (current == slot) {
+            // The slot keeps its place in the probe sequence of the keys after it.
+            slots_[pos].store((key >> 32 << 32) | erased, std::memory_order_release);
+            size_--;
+            return;
+        }
+    }
+}
+
+hash_index hash_index::grown() const {
+    // A table filled to a quarter after growing can double before it's half full again.
+    hash_index table(std::max<size_t>(size_ * 4, 16));
+
+    // A slot holds the tag in the high half of the key, which is all `insert` uses.
+    for (size_t pos = 0; pos <= mask_; pos++) {
+        const uint64_t slot = slots_[pos].load(std::memory_order_relaxed);
+        const imageId id = static_cast<imageId>(slot);
+
+        if (id != empty && id != erased) {
+            table.insert(slot, id);
+        }
+    }
+
+    return table;
+}
+
+}
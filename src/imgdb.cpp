@@ -24,142 +24,1503 @@
 #include <sys/mman.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <thread>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <tuple>
 #include <vector>
 
 #include <iqdb/debug.h>
 #include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
 #include <iqdb/haar_signature.h>
+#include <iqdb/metrics.h>
+#include <iqdb/query_cache.h>
+#include <iqdb/simd.h>
+#include <iqdb/snapshot.h>
 #include <iqdb/sqlite_db.h>
 
 namespace iqdb {
 
-void bucket_set::add(const HaarSignature &sig, postId iqdb_id) {
-    eachBucket(sig, [&](bucket_t& bucket) {
-        bucket.push_back(iqdb_id);
-    });
+// Append `value` to `out` as a varint: 7 bits per byte, least significant
+// bits first, with the high bit set on every byte but the last.
+static void put_varint(std::vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+
+    out.push_back(static_cast<uint8_t>(value));
 }
 
-void bucket_set::remove(const HaarSignature &sig, postId iqdb_id) {
-    eachBucket(sig, [&](bucket_t& bucket) {
-        // https://en.wikipedia.org/wiki/Erase-remove_idiom
-        bucket.erase(std::remove(bucket.begin(), bucket.end(), iqdb_id), bucket.end());
-    });
+static const uint8_t* get_varint(const uint8_t* in, uint32_t& value) {
+    value = 0;
+    for (int shift = 0;; shift += 7) {
+        const uint8_t byte = *in++;
+        value |= static_cast<uint32_t>(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+}
+
+bucket_set::bucket_set() {
+    for (auto& color_planes : planes) {
+        for (plane& p : color_planes) {
+            p.lists.resize(n_indexes);
+            p.tails = std::make_unique<tail[]>(n_indexes);
+        }
+    }
 }
 
-bucket_t& bucket_set::at(int color, int coef) {
-    const int sign = coef < 0;
-    return buckets[color][sign][abs(coef)];
+void bucket_set::tail::push_back(imageId id) {
+    if (last == nullptr || last->used == last->capacity) {
+        // Each chunk is twice as big as the last one, up to `chunk_size`.
+        auto chunk = std::make_unique<tail_chunk>();
+        chunk->capacity = last ? std::min<uint32_t>(last->capacity * 2, chunk_size) : 8;
+        chunk->ids = std::make_unique<imageId[]>(chunk->capacity);
+
+        tail_chunk* next = chunk.get();
+        (last ? last->next : head) = std::move(chunk);
+        last = next;
+    }
+
+    last->ids[last->used++] = id;
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 }
 
-void bucket_set::eachBucket(const HaarSignature &sig, std::function<void(bucket_t&)> func) {
+template <typename F>
+void bucket_set::tail::eachChunk(uint32_t n, F func) const {
+    // A chunk is only looked at if it has some of the IDs, since the writer may
+    // be adding it right now.
+    for (const std::unique_ptr<tail_chunk>* chunk = &head; n > 0; chunk = &(*chunk)->next) {
+        const uint32_t k = std::min(n, (*chunk)->capacity);
+        func((*chunk)->ids.get(), k);
+        n -= k;
+    }
+}
+
+void bucket_set::eachBucket(const HaarSignature &sig, std::function<void(plane&, size_t)> func) {
     for (int c = 0; c < sig.num_colors(); c++) {
         for (int i = 0; i < NUM_COEFS; i++) {
             const int coef = sig.sig[c][i];
-            auto& bucket = at(c, coef);
-            func(bucket);
+            func(planeOf(c, coef), abs(coef));
+        }
+    }
+}
+
+void bucket_set::add(const HaarSignature &sig, imageId id) {
+    eachBucket(sig, [&](plane& p, size_t index) {
+        p.tails[index].push_back(id);
+        tail_size_++;
+    });
+}
+
+bool bucket_set::empty(int color, int coef, imageId end) const {
+    const plane& p = planeOf(color, coef);
+    const tail& t = p.tails[abs(coef)];
+
+    return p.lists[abs(coef)].count == 0 && (t.count.load(std::memory_order_acquire) == 0 || t.head->ids[0] >= end);
+}
+
+size_t bucket_set::size(int color, int coef) const {
+    const plane& p = planeOf(color, coef);
+    return p.lists[abs(coef)].count + p.tails[abs(coef)].count.load(std::memory_order_acquire);
+}
+
+void bucket_set::eachChunk(int color, int coef, imageId end, const std::function<void(const imageId*, size_t)>& func) const {
+    const plane& p = planeOf(color, coef);
+    const posting_list& list = p.lists[abs(coef)];
+    const tail& t = p.tails[abs(coef)];
+
+    imageId chunk[chunk_size];
+    const uint8_t* in = p.arena + list.offset;
+    imageId current = 0;
+
+    for (uint32_t i = 0; i < list.count;) {
+        const size_t n = std::min<size_t>(chunk_size, list.count - i);
+
+        for (size_t k = 0; k < n; k++) {
+            uint32_t delta;
+            in = get_varint(in, delta);
+            current += delta;
+            chunk[k] = current;
+        }
+
+        func(chunk, n);
+        i += n;
+    }
+
+    // The compressed IDs are all below `end`, but the tail can have newer IDs
+    // that were added after the caller's images were. The IDs are sorted, so
+    // they are cut off at the first one that is too new.
+    bool done = false;
+    t.eachChunk(t.count.load(std::memory_order_acquire), [&](const imageId* ids, size_t n) {
+        if (!done) {
+            const size_t k = std::lower_bound(ids, ids + n, end) - ids;
+            func(ids, k);
+            done = k < n;
+        }
+    });
+}
+
+void bucket_set::eachCompressed(const plane &p, const posting_list &list, const std::function<void(imageId)>& func) {
+    const uint8_t* in = p.arena + list.offset;
+    imageId current = 0;
+
+    for (uint32_t i = 0; i < list.count; i++) {
+        uint32_t delta;
+        in = get_varint(in, delta);
+        current += delta;
+        func(current);
+    }
+}
+
+bool bucket_set::isValid(const plane &p, const posting_list &list, imageId end) {
+    // Every ID takes at least a byte, and the list has to fit in the arena.
+    if (list.count > list.bytes || list.offset > p.arena_size || list.bytes > p.arena_size - list.offset) {
+        return false;
+    } else if (list.count == 0) {
+        return true;
+    } else if (list.last >= end) {
+        return false;
+    }
+
+    const uint8_t* in = p.arena + list.offset;
+    const uint8_t* const in_end = in + list.bytes;
+    uint64_t current = 0;
+
+    for (uint32_t i = 0; i < list.count; i++) {
+        uint64_t delta = 0;
+        for (int shift = 0;; shift += 7) {
+            if (in == in_end || shift > 28) {
+                return false;
+            }
+
+            const uint8_t byte = *in++;
+            delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+
+        // Only the first ID can be 0, as the rest are ascending.
+        current += delta;
+        if ((i > 0 && delta == 0) || current > list.last) {
+            return false;
+        }
+    }
+
+    return in == in_end && current == list.last;
+}
+
+void bucket_set::appendCompressed(std::vector<uint8_t> &arena, posting_list &list, imageId id) {
+    put_varint(arena, id - list.last);
+    list.last = id;
+    list.count++;
+}
+
+void bucket_set::setArena(plane &p, std::vector<uint8_t> arena) {
+    arena.shrink_to_fit();
+    auto owner = std::make_shared<const std::vector<uint8_t>>(std::move(arena));
+    p.arena = owner->data();
+    p.arena_size = owner->size();
+    p.arena_owner = std::move(owner);
+}
+
+bucket_set bucket_set::compacted(const image_table *purge) const {
+    bucket_set result;
+
+    for (size_t c = 0; c < n_colors; c++) {
+        for (size_t sign = 0; sign < n_signs; sign++) {
+            const plane& p = planes[c][sign];
+            plane& out = result.planes[c][sign];
+            std::vector<uint8_t> arena;
+            arena.reserve(p.arena_size + p.arena_size / 8);
+
+            for (size_t index = 0; index < n_indexes; index++) {
+                const posting_list& list = p.lists[index];
+                posting_list& new_list = out.lists[index];
+                new_list.offset = arena.size();
+
+                auto append = [&](imageId id) {
+                    if (!purge || !purge->isDeleted(id)) {
+                        appendCompressed(arena, new_list, id);
+                    }
+                };
+
+                // Without deleted IDs to drop, the compressed list is copied as
+                // is and the tail's deltas are appended to it.
+                if (purge) {
+                    eachCompressed(p, list, append);
+                } else {
+                    arena.insert(arena.end(), p.arena + list.offset, p.arena + list.offset + list.bytes);
+                    new_list.count = list.count;
+                    new_list.last = list.last;
+                }
+
+                const tail& t = p.tails[index];
+                t.eachChunk(t.count.load(std::memory_order_relaxed), [&](const imageId* ids, size_t n) {
+                    std::for_each(ids, ids + n, append);
+                });
+
+                new_list.bytes = static_cast<uint32_t>(arena.size() - new_list.offset);
+                result.compacted_size_ += new_list.count;
+            }
+
+            setArena(out, std::move(arena));
+        }
+    }
+
+    return result;
+}
+
+bucket_set bucket_set::merged(const std::vector<bucket_set> &parts, thread_pool &pool) {
+    bucket_set result;
+    size_t plane_sizes[n_colors * n_signs] = {};
+
+    pool.parallel_for(n_colors * n_signs, [&](size_t i) {
+        plane& out = result.planes[i / n_signs][i % n_signs];
+        std::vector<uint8_t> arena;
+        std::vector<imageId> ids;
+        std::vector<size_t> run_ends, positions;
+        std::vector<std::pair<imageId, size_t>> heap; // the next ID of each run, and the run
+
+        for (size_t index = 0; index < n_indexes; index++) {
+            // The IDs of each part are sorted, so the bucket is a k-way merge
+            // of the sorted runs of every part.
+            ids.clear();
+            run_ends.clear();
+            positions.clear();
+            heap.clear();
+
+            for (const bucket_set& part : parts) {
+                const plane& p = part.planes[i / n_signs][i % n_signs];
+                positions.push_back(ids.size());
+
+                eachCompressed(p, p.lists[index], [&](imageId id) { ids.push_back(id); });
+                const tail& t = p.tails[index];
+                t.eachChunk(t.count.load(std::memory_order_relaxed), [&](const imageId* chunk, size_t n) {
+                    ids.insert(ids.end(), chunk, chunk + n);
+                });
+
+                run_ends.push_back(ids.size());
+                if (positions.back() < ids.size()) {
+                    heap.emplace_back(ids[positions.back()], run_ends.size() - 1);
+                }
+            }
+
+            posting_list& list = out.lists[index];
+            list.offset = arena.size();
+
+            std::make_heap(heap.begin(), heap.end(), std::greater<>());
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+                const size_t run = heap.back().second;
+                appendCompressed(arena, list, heap.back().first);
+
+                if (++positions[run] < run_ends[run]) {
+                    heap.back().first = ids[positions[run]];
+                    std::push_heap(heap.begin(), heap.end(), std::greater<>());
+                } else {
+                    heap.pop_back();
+                }
+            }
+
+            list.bytes = static_cast<uint32_t>(arena.size() - list.offset);
+            plane_sizes[i] += list.count;
+        }
+
+        setArena(out, std::move(arena));
+    });
+
+    for (size_t size : plane_sizes) {
+        result.compacted_size_ += size;
+    }
+
+    return result;
+}
+
+size_t bucket_set::memoryUsage() const {
+    size_t bytes = sizeof(*this);
+
+    for (const auto& color_planes : planes) {
+        for (const plane& p : color_planes) {
+            bytes += p.arena_size + p.lists.capacity() * sizeof(posting_list) + n_indexes * sizeof(tail);
+
+            for (size_t index = 0; index < n_indexes; index++) {
+                for (const tail_chunk* chunk = p.tails[index].head.get(); chunk; chunk = chunk->next.get()) {
+                    bytes += sizeof(tail_chunk) + chunk->capacity * sizeof(imageId);
+                }
+            }
+        }
+    }
+
+    return bytes;
+}
+
+void bucket_set::save(snapshot_writer &out) const {
+    if (tail_size_ > 0) {
+        throw snapshot_error("can't save buckets that aren't compacted");
+    }
+
+    for (const auto& color_planes : planes) {
+        for (const plane& p : color_planes) {
+            out.write<uint64_t>(p.arena_size);
+            out.writeArray(p.arena, p.arena_size);
+            out.writeArray(p.lists.data(), p.lists.size());
         }
     }
+
+    out.write<uint64_t>(compacted_size_);
+}
+
+void bucket_set::load(snapshot_reader &in, imageId end) {
+    *this = bucket_set();
+
+    for (auto& color_planes : planes) {
+        for (plane& p : color_planes) {
+            p.arena_size = in.read<uint64_t>();
+            p.arena = in.readArray<uint8_t>(p.arena_size);
+            p.arena_owner = in.mapping();
+
+            const posting_list* lists = in.readArray<posting_list>(n_indexes);
+            p.lists.assign(lists, lists + n_indexes);
+
+            // A corrupt list would be decoded past the arena, or to IDs past
+            // the end of a query's scores.
+            for (const posting_list& list : p.lists) {
+                if (!isValid(p, list, end)) {
+                    throw snapshot_error("posting list is corrupt");
+                }
+            }
+        }
+    }
+
+    compacted_size_ = in.read<uint64_t>();
+}
+
+imageId image_table::add(const HaarSignature &sig) {
+    const imageId id = static_cast<imageId>(size());
+
+    if (id % 64 == 0) {
+        deleted_.append();
+        grayscale_.append();
+    }
+
+    if (sig.is_grayscale()) {
+        grayscale_[id / 64].fetch_or(uint64_t(1) << (id % 64), std::memory_order_relaxed);
+    }
+
+    // The avgl values are appended last, because they define the size.
+    for (int c = 0; c < 3; c++) {
+        avgl_[c].append() = static_cast<Score>(sig.avglf[c]);
+    }
+
+    return id;
+}
+
+size_t image_table::memoryUsage() const {
+    return avgl_[0].memoryUsage() * 3 + deleted_.memoryUsage() + grayscale_.memoryUsage();
 }
 
-void IQDB::addImage(postId post_id, const std::string& md5, const HaarSignature& haar) {
-    removeImage(post_id);
-    sqlite_db_->addImage(post_id, md5, haar);
-    addImageInMemory(post_id, md5, haar);
+void image_table::save(snapshot_writer &out) const {
+    const size_t n_images = size();
+    out.write<uint64_t>(n_images);
+
+    for (const avgl_array& avgl : avgl_) {
+        for (size_t b = 0; b < avgl.blockCount(); b++) {
+            out.writeArray(avgl.blockData(b), avgl.blockLength(b));
+        }
+    }
+
+    for (const bit_array* bits : { &deleted_, &grayscale_ }) {
+        for (size_t w = 0; w < bits->size(); w++) {
+            out.write<uint64_t>((*bits)[w].load(std::memory_order_relaxed));
+        }
+    }
+}
+
+void image_table::load(snapshot_reader &in) {
+    *this = image_table();
+    const size_t n_images = in.read<uint64_t>();
+
+    for (avgl_array& avgl : avgl_) {
+        for (size_t first = 0; first < n_images; first += avgl_array::block_size) {
+            const size_t n = std::min(avgl_array::block_size, n_images - first);
+            const Score* values = in.readArray<Score>(n);
+
+            for (size_t i = 0; i < n; i++) {
+                avgl.append() = values[i];
+            }
+        }
+    }
+
+    for (bit_array* bits : { &deleted_, &grayscale_ }) {
+        for (size_t w = 0; w < (n_images + 63) / 64; w++) {
+            bits->append().store(in.read<uint64_t>(), std::memory_order_relaxed);
+        }
+    }
+}
+
+// Select the `numres` lowest scores in a single pass over the scores. The
+// heap is a bounded max-heap, so the worst of the current results is at the
+// front and is replaced whenever a better score is found.
+static std::vector<scored_image> select_best(const Score* scores, const image_table& images, size_t numres) {
+    // The deleted bitmap is read one word at a time, for 64 images at once.
+    const image_table::bit_array& deleted = images.deletedBits();
+    const size_t n_images = images.size();
+
+    // `numres` is the client's, so it can be much more than there are images.
+    std::vector<scored_image> results;
+    results.reserve(std::min(numres, n_images));
+
+    for (size_t first = 0; first < n_images && numres > 0; first += 64) {
+        const uint64_t deleted_word = deleted[first / 64].load(std::memory_order_relaxed);
+        const size_t last = std::min<size_t>(first + 64, n_images);
+
+        for (imageId id = static_cast<imageId>(first); id < last; id++) {
+            if ((deleted_word >> (id % 64)) & 1) {
+                continue;
+            }
+
+            if (results.size() < numres) {
+                results.emplace_back(scores[id], id);
+                std::push_heap(results.begin(), results.end());
+            } else if (scores[id] < results.front().first) {
+                std::pop_heap(results.begin(), results.end());
+                results.back() = { scores[id], id };
+                std::push_heap(results.begin(), results.end());
+            }
+        }
+    }
+
+    return results;
+}
+
+static void query_avgl(const HaarSignature &signature, Score avgl[3]) {
+    for (int c = 0; c < 3; c++) {
+        avgl[c] = static_cast<Score>(signature.avglf[c]);
+    }
+}
+
+std::vector<scored_image> index_shard::query(const HaarSignature &signature, size_t numres, size_t* scanned) const {
+    // The score of every image, indexed by image ID. Kept per thread and reused
+    // across queries so that a query doesn't have to allocate it every time.
+    thread_local std::vector<Score> scores;
+    const size_t n_images = images.size();
+    scores.resize(n_images);
+
+    const simd_kernels& simd = get_simd_kernels();
+
+    // luminance score (DC coefficient)
+    {
+        scoped_timer timer(metrics::stage_lumin);
+        Score query[3];
+        query_avgl(signature, query);
+        images.eachBlock([&](size_t first, size_t n, const Score* const avgl[3]) {
+            simd.lumin_distance(scores.data() + first, avgl, query, weights[0], signature.num_colors(), n);
+        });
+    }
+
+    {
+        scoped_timer timer(metrics::stage_buckets);
+        size_t entries = 0;
+
+        for (int c = 0; c < signature.num_colors(); c++) {
+            for (int b = 0; b < NUM_COEFS; b++) { // for every coef on a sig
+                const int coef = signature.sig[c][b];
+                const Score weight = weights[imgBin.bin[abs(coef)]][c];
+
+                buckets->eachChunk(c, coef, static_cast<imageId>(n_images), [&](const imageId* ids, size_t n) {
+                    simd.subtract_weight(scores.data(), ids, n, weight);
+                    entries += n;
+                });
+            }
+        }
+
+        if (scanned) {
+            *scanned += entries;
+        }
+    }
+
+    scoped_timer timer(metrics::stage_select);
+    return select_best(scores.data(), images, numres);
+}
+
+// The parts of the score of one image that `index_shard::query` computes with
+// the lumin pass and with the buckets, computed from the image's avgl values and
+// signature instead. Both signatures are sorted, so the common coefficients are
+// found by merging them.
+static Score lumin_score(const HaarSignature &query, const Score query_avgl[3], const image_table &images, imageId id) {
+    Score score = 0;
+    for (int c = 0; c < query.num_colors(); c++) {
+        score += weights[0][c] * std::abs(images.avgl(c, id) - query_avgl[c]);
+    }
+
+    return score;
+}
+
+static Score matched_weight(const HaarSignature &query, const HaarSignature &image) {
+    Score weight = 0;
+
+    // A grayscale image is only in the Y buckets, so a full query never finds
+    // it in the I and Q buckets, even if its I and Q coefficients match.
+    const int n_colors = std::min(query.num_colors(), image.num_colors());
+    for (int c = 0; c < n_colors; c++) {
+        const Idx* coefs = image.sig[c];
+        int i = 0;
+
+        for (int b = 0; b < NUM_COEFS; b++) {
+            const Idx coef = query.sig[c][b];
+            while (i < NUM_COEFS && coefs[i] < coef) {
+                i++;
+            }
+
+            if (i < NUM_COEFS && coefs[i] == coef) {
+                weight += weights[imgBin.bin[abs(coef)]][c];
+            }
+        }
+    }
+
+    return weight;
+}
+
+std::optional<std::vector<scored_image>> index_shard::queryPruned(const HaarSignature &signature, size_t numres, Score threshold, const std::function<const HaarSignature&(imageId)> &signature_of, size_t* scanned) const {
+    // Don't bother unless the scan can stop before this fraction of the bucket
+    // entries of a full query. An entry costs about 100 times as much here as
+    // in `query`, because each entry is a new image to check.
+    const double max_scanned_fraction = 1.0 / 128;
+
+    const size_t n_images = images.size();
+    if (numres == 0 || n_images == 0) {
+        return std::vector<scored_image>();
+    }
+
+    struct bucket_ref {
+        int color;
+        int coef;
+        Score weight;
+        size_t size;
+    };
+
+    // The non-empty buckets of the query.
+    std::vector<bucket_ref> refs;
+    Score total_weight = 0;
+    size_t total_size = 0;
+
+    for (int c = 0; c < signature.num_colors(); c++) {
+        for (int b = 0; b < NUM_COEFS; b++) {
+            const int coef = signature.sig[c][b];
+            const size_t size = buckets->size(c, coef);
+
+            if (size > 0) {
+                refs.push_back({ c, coef, weights[imgBin.bin[abs(coef)]][c], size });
+                total_weight += refs.back().weight;
+                total_size += size;
+            }
+        }
+    }
+
+    std::sort(refs.begin(), refs.end(), [](const bucket_ref& a, const bucket_ref& b) {
+        return a.weight * static_cast<Score>(b.size) > b.weight * static_cast<Score>(a.size);
+    });
+
+    // Estimate how much of the buckets will be scanned before the threshold
+    // alone stops the scan.
+    {
+        Score left = total_weight;
+        size_t estimate = 0;
+
+        for (const bucket_ref& ref : refs) {
+            if (left < -threshold) {
+                break;
+            }
+
+            estimate += ref.size;
+            left -= ref.weight;
+        }
+
+        if (static_cast<double>(estimate) > max_scanned_fraction * static_cast<double>(total_size)) {
+            return std::nullopt;
+        }
+    }
+
+    // A bit per image, set once the image has been scored. Kept per thread like
+    // the scores of `query`.
+    thread_local std::vector<uint64_t> seen;
+    seen.assign((n_images + 63) / 64, 0);
+
+    Score query[3];
+    query_avgl(signature, query);
+
+    std::vector<scored_image> results;
+    results.reserve(std::min(numres, n_images));
+    Score remaining = total_weight;
+    size_t entries = 0;
+
+    scoped_timer timer(metrics::stage_buckets);
+
+    // An image that isn't in any of the buckets scanned so far can at best
+    // match all of the remaining ones, and its lumin score can't be negative.
+    for (const bucket_ref& ref : refs) {
+        if (remaining < -threshold) {
+            break;
+        }
+
+        buckets->eachChunk(ref.color, ref.coef, static_cast<imageId>(n_images), [&](const imageId* ids, size_t n) {
+            entries += n;
+
+            for (size_t k = 0; k < n; k++) {
+                const imageId id = ids[k];
+                uint64_t& word = seen[id / 64];
+                const uint64_t bit = uint64_t(1) << (id % 64);
+
+                if ((word & bit) || images.isDeleted(id)) {
+                    continue;
+                }
+
+                // Most images are too far off in lumin alone to reach the
+                // threshold, even if they matched every bucket, so their
+                // signatures are never looked at.
+                word |= bit;
+                const Score lumin = lumin_score(signature, query, images, id);
+                if (lumin - total_weight > threshold) {
+                    continue;
+                }
+
+                const Score score = lumin - matched_weight(signature, signature_of(id));
+                if (score > threshold) {
+                    continue;
+                }
+
+                // Keep the `numres` best scores in a bounded max-heap, like
+                // `select_best`. Once it's full, only a better score than the
+                // worst of them is worth keeping.
+                if (results.size() < numres) {
+                    results.emplace_back(score, id);
+                    std::push_heap(results.begin(), results.end());
+                } else {
+                    std::pop_heap(results.begin(), results.end());
+                    results.back() = { score, id };
+                    std::push_heap(results.begin(), results.end());
+                }
+
+                if (results.size() == numres) {
+                    threshold = results.front().first;
+                }
+            }
+        });
+
+        remaining -= ref.weight;
+    }
+
+    if (scanned) {
+        *scanned += entries;
+    }
+
+    return results;
+}
+
+std::vector<std::vector<scored_image>> index_shard::queryBatch(const std::vector<HaarSignature> &signatures, size_t numres, size_t* scanned) const {
+    // Every query needs its own score array, so the queries are run in groups
+    // that keep the score arrays of a group under this many bytes.
+    const size_t max_scores_size = 256 * 1024 * 1024;
+
+    // The score arrays are kept per thread for the next batch, like the scores
+    // of `query`, but only up to this many bytes. Every thread that ever ran a
+    // big batch would otherwise hold on to `max_scores_size` bytes.
+    const size_t max_kept_size = 16 * 1024 * 1024;
+
+    // How many images to score against every query of a group before moving on
+    // to the next images, so that the avgl values stay in cache.
+    const size_t lumin_block = 4096;
+
+    const size_t n_images = images.size();
+    const size_t group_size = std::clamp<size_t>(max_scores_size / (std::max<size_t>(n_images, 1) * sizeof(Score)), 1, signatures.size());
+    const simd_kernels& simd = get_simd_kernels();
+
+    thread_local std::vector<Score> scores;
+    std::vector<std::vector<scored_image>> results;
+
+    for (size_t first = 0; first < signatures.size(); first += group_size) {
+        const size_t n_queries = std::min(group_size, signatures.size() - first);
+        scores.resize(n_queries * n_images);
+
+        auto scores_of = [&](size_t q) { return scores.data() + q * n_images; };
+
+        // luminance score (DC coefficient), for every query in one pass over
+        // the avgl arrays.
+        std::optional<scoped_timer> timer(metrics::stage_lumin);
+        images.eachBlock([&](size_t block_first, size_t block_size, const Score* const avgl[3]) {
+            for (size_t i = 0; i < block_size; i += lumin_block) {
+                const size_t n = std::min(lumin_block, block_size - i);
+                const Score* block[3] = { avgl[0] + i, avgl[1] + i, avgl[2] + i };
+
+                for (size_t q = 0; q < n_queries; q++) {
+                    const HaarSignature& signature = signatures[first + q];
+                    Score query[3];
+                    query_avgl(signature, query);
+                    simd.lumin_distance(scores_of(q) + block_first + i, block, query, weights[0], signature.num_colors(), n);
+                }
+            }
+        });
+
+        timer.emplace(metrics::stage_buckets);
+
+        // Collect the buckets of every query, sorted by bucket so the queries
+        // that share a bucket are next to each other.
+        struct bucket_visit {
+            int color;
+            int coef;
+            size_t query;
+            bool operator<(const bucket_visit& other) const {
+                return std::tie(color, coef, query) < std::tie(other.color, other.coef, other.query);
+            }
+        };
+
+        std::vector<bucket_visit> visits;
+        for (size_t q = 0; q < n_queries; q++) {
+            const HaarSignature& signature = signatures[first + q];
+            for (int c = 0; c < signature.num_colors(); c++) {
+                for (int b = 0; b < NUM_COEFS; b++) {
+                    visits.push_back({ c, signature.sig[c][b], q });
+                }
+            }
+        }
+        std::sort(visits.begin(), visits.end());
+
+        // Scan each bucket once, for all the queries that contain it.
+        for (auto it = visits.begin(); it != visits.end();) {
+            auto end = std::find_if(it, visits.end(), [&](const bucket_visit& v) {
+                return v.color != it->color || v.coef != it->coef;
+            });
+
+            // The bucket is decoded one chunk at a time, and each chunk is
+            // subtracted from every query while it is still in cache.
+            const Score weight = weights[imgBin.bin[abs(it->coef)]][it->color];
+            buckets->eachChunk(it->color, it->coef, static_cast<imageId>(n_images), [&](const imageId* ids, size_t n) {
+                for (auto v = it; v != end; ++v) {
+                    simd.subtract_weight(scores_of(v->query), ids, n, weight);
+
+                    if (scanned) {
+                        scanned[first + v->query] += n;
+                    }
+                }
+            });
+
+            it = end;
+        }
+
+        timer.emplace(metrics::stage_select);
+        for (size_t q = 0; q < n_queries; q++) {
+            results.push_back(select_best(scores_of(q), images, numres));
+        }
+    }
+
+    if (scores.capacity() * sizeof(Score) > max_kept_size) {
+        scores = std::vector<Score>();
+    }
+
+    return results;
+}
+
+void IQDB::addImage(postId post_id, const std::string& md5, const HaarSignature& signature) {
+    // the index holds the signature as it's stored, so it's the same after a reload
+    const HaarSignature haar = signature.quantized();
+
+    // the old image is replaced in the DB by the insert itself, and in memory
+    // once the transaction is committed
+    transaction([&] {
+        sqlite_db_->addImage(post_id, md5, haar);
+        addPendingChange(post_id, image_info{ post_id, md5, haar });
+    });
 
     DEBUG("Added post {} to memory and database (haar={})\n", post_id, haar.to_string());
 }
 
+void IQDB::addImages(std::vector<image_info> images) {
+    for (image_info& image : images) {
+        image.haar = image.haar.quantized();
+    }
+
+    // if a post is given more than once, its last image is kept when the
+    // pending changes are applied, as if they were added one at a time
+    transaction([&] {
+        for (image_info& image : images) {
+            sqlite_db_->addImage(image.post_id, image.md5, image.haar);
+
+            postId post_id = image.post_id;
+            addPendingChange(std::move(post_id), std::move(image));
+        }
+    });
+
+    DEBUG("added {} posts to memory and database\n", images.size());
+}
+
+void IQDB::addImagesInMemory(std::vector<image_info> images) {
+    const imageId first = static_cast<imageId>(m_info.size());
+    for (image_info& image : images) {
+        const imageId id = static_cast<imageId>(m_info.size());
+        m_ids[image.post_id] = id;
+        m_info.append() = std::move(image);
+        addToHashIndexes(id);
+    }
+
+    // Each shard adds its own images, so the shards are filled in parallel.
+    const imageId end = static_cast<imageId>(m_info.size());
+    const size_t n_shards = m_shards.size();
+    m_pool->parallel_for(n_shards, [&](size_t s) {
+        index_shard& shard = m_shards[s];
+        for (imageId id = static_cast<imageId>(first + (s + n_shards - first % n_shards) % n_shards); id < end; id += n_shards) {
+            shard.images.add(m_info[id].haar);
+            shard.buckets->add(m_info[id].haar, shardIndex(id));
+        }
+    });
+
+    img_count += end - first;
+}
+
 void IQDB::addImageInMemory(postId post_id, const std::string& md5, const HaarSignature& haar) {
-    imgbuckets.add(haar, post_id);
+    const imageId id = static_cast<imageId>(m_info.size());
+    index_shard& shard = shardOf(id);
+
+    shard.images.add(haar);
+    shard.buckets->add(haar, shardIndex(id));
     img_count++;
 
-    image_info info;
-    info.id = post_id;
-    info.md5 = md5;
-    info.avgl.v[0] = static_cast<Score>(haar.avglf[0]);
-    info.avgl.v[1] = static_cast<Score>(haar.avglf[1]);
-    info.avgl.v[2] = static_cast<Score>(haar.avglf[2]);
+    m_info.append() = { post_id, md5, haar };
+    m_ids[post_id] = id;
+    addToHashIndexes(id);
+}
+
+// The key of an md5 in `m_md5s`.
+static uint64_t md5_key(std::string_view md5) {
+    return std::hash<std::string_view>()(md5);
+}
+
+// Add `id` under `key`, replacing the table with a bigger copy if it's full.
+static void insert_id(std::shared_ptr<hash_index>& table, uint64_t key, imageId id) {
+    if (!table->insert(key, id)) {
+        table = std::make_shared<hash_index>(table->grown());
+        table->insert(key, id);
+    }
+}
+
+void IQDB::addToHashIndexes(imageId id) {
+    insert_id(m_md5s, md5_key(m_info[id].md5), id);
+    insert_id(m_signatures, m_info[id].haar.digest(), id);
+}
+
+void IQDB::publish() {
+    auto snapshot = std::make_shared<const index_snapshot>(index_snapshot{ m_shards, m_info, m_md5s, m_signatures });
+    std::atomic_store(&m_snapshot, std::move(snapshot));
+    m_epoch++;
+}
+
+std::shared_ptr<const index_snapshot> IQDB::snapshot() const {
+    return std::atomic_load(&m_snapshot);
+}
+
+void IQDB::clearInMemory() {
+    m_info = {};
+    m_ids.clear();
+    m_md5s = std::make_shared<hash_index>();
+    m_signatures = std::make_shared<hash_index>();
+    img_count = 0;
 
-    m_info.emplace(post_id, info);
+    for (auto& shard : m_shards) {
+        shard = index_shard();
+    }
 }
 
 void IQDB::loadDatabase(std::string filename) {
-    INFO("loading DB [filename={}]\n", filename);
-    sqlite_db_ = std::make_unique<SqliteDB>(filename);
-    m_info.clear();
-    imgbuckets = bucket_set();
+    INFO("loading DB [filename={}] [shards={}]\n", filename, m_shards.size());
+    // the changes are only needed to bring a snapshot up to date
+    sqlite_db_ = std::make_unique<SqliteDB>(filename, !m_snapshot_file.empty());
+    clearInMemory();
+
+    if (!m_snapshot_file.empty()) {
+        try {
+            loadSnapshot(m_snapshot_file);
+            return;
+        } catch (const snapshot_error& e) {
+            WARN("couldn't load snapshot, loading the database instead: {}\n", e.what());
+        }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    loadImages();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    INFO("loaded {} images from {} in {:.1f}s ({:.0f} rows/sec)\n", getImgCount(), filename, seconds, getImgCount() / std::max(seconds, 1e-3));
+
+    // save a snapshot to start from next time
+    if (!m_snapshot_file.empty()) {
+        saveSnapshot(m_snapshot_file);
+    }
+}
+
+void IQDB::loadImages() {
+    // The rows are read in batches by this thread, and every worker goes
+    // through every batch, decoding the images of the partial buckets it owns
+    // and adding them to those. Each partial belongs to one worker, and holds
+    // part of one shard, so a worker never shares its buckets and each shard
+    // is merged from only a few of them at the end. The last worker done with
+    // a batch adds it to the image tables, in row order, so the image IDs are
+    // the same as in a sequential load.
+    struct batch {
+        imageId first_id;
+        std::vector<image_info> info;
+        std::string sigs;              // the encoded signatures, one after another
+        std::vector<size_t> sig_ends;  // where each image's signature ends in `sigs`
+        size_t remaining = 0;          // how many workers haven't finished the batch
+    };
+
+    // The reader can only get a few batches ahead of the slowest worker.
+    const size_t batch_size = 4096;
+    const size_t n_workers = std::max<size_t>(std::thread::hardware_concurrency(), 2) - 1;
+    const size_t max_queued = 4;
+
+    // With more workers than shards, each shard is split into `n_parts`
+    // partial buckets, one per worker; with fewer, each worker owns several
+    // whole shards. Either way there's at most one partial per worker or shard.
+    const size_t n_shards = m_shards.size();
+    const size_t n_parts = std::max<size_t>(n_workers / n_shards, 1);
+    const size_t n_partials = n_shards * n_parts;
+    const size_t n_threads = std::min(n_workers, n_partials);
+    std::vector<bucket_set> partials(n_partials);
+
+    // The partial an image is added to: part `p` of its shard holds every
+    // `n_parts`th image of the shard. And the worker that owns a partial.
+    auto partial_of = [&](imageId id) { return (id % n_shards) * n_parts + (id / n_shards) % n_parts; };
+    auto owner_of = [&](size_t partial) { return partial % n_threads; };
+
+    // How many uncompressed IDs the partial buckets can hold before they are
+    // compacted, to bound the memory used while loading.
+    const size_t max_tail_size = 4 * 1024 * 1024;
+
+    std::mutex mutex;
+    std::condition_variable queue_cv, reader_cv;
+    std::deque<std::shared_ptr<batch>> queue; // the batches not yet added to the image tables
+    size_t first_batch = 0;                   // the number of the batch at the front of `queue`
+    bool reading = true;
+    std::exception_ptr error;
+
+    auto worker = [&](size_t w) {
+        try {
+            for (size_t next = 0;; next++) {
+                std::shared_ptr<batch> b;
+
+                {
+                    std::unique_lock lock(mutex);
+                    queue_cv.wait(lock, [&] { return next < first_batch + queue.size() || !reading || error; });
+                    if (next >= first_batch + queue.size() || error) {
+                        return;
+                    }
+
+                    b = queue[next - first_batch];
+                }
+
+                for (size_t i = 0; i < b->info.size(); i++) {
+                    const imageId id = static_cast<imageId>(b->first_id + i);
+                    const size_t partial = partial_of(id);
+                    if (owner_of(partial) != w) {
+                        continue;
+                    }
+
+                    const size_t begin = i == 0 ? 0 : b->sig_ends[i - 1];
+                    std::optional<HaarSignature> decoded = HaarSignature::decode(std::string_view(b->sigs).substr(begin, b->sig_ends[i] - begin));
+                    if (!decoded) {
+                        throw fatal_error(fmt::format("post {} has an invalid signature", b->info[i].post_id));
+                    }
+
+                    HaarSignature& signature = b->info[i].haar;
+                    signature = *decoded;
+                    partials[partial].add(signature, shardIndex(id));
+                }
+
+                for (size_t partial = w; partial < n_partials; partial += n_threads) {
+                    if (partials[partial].tailSize() >= max_tail_size / n_partials) {
+                        partials[partial] = partials[partial].compacted();
+                    }
+                }
+
+                // The workers finish the batches in order, so once the last
+                // one finishes this batch, every earlier batch has been added.
+                std::unique_lock lock(mutex);
+                if (--b->remaining > 0) {
+                    continue;
+                }
+
+                for (size_t i = 0; i < b->info.size(); i++) {
+                    const imageId id = static_cast<imageId>(b->first_id + i);
+                    shardOf(id).images.add(b->info[i].haar);
+                    m_ids[b->info[i].post_id] = id;
+                    m_info.append() = std::move(b->info[i]);
+                    addToHashIndexes(id);
+                }
+
+                img_count += b->info.size();
+                queue.pop_front();
+                first_batch++;
+                reader_cv.notify_all();
+            }
+        } catch (...) {
+            std::unique_lock lock(mutex);
+            error = std::current_exception();
+            queue_cv.notify_all();
+            reader_cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t w = 0; w < n_threads; w++) {
+        workers.emplace_back(worker, w);
+    }
+
+    auto current = std::make_shared<batch>();
+    size_t n_rows = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto last_progress = start;
+
+    auto push = [&] {
+        std::unique_lock lock(mutex);
+        reader_cv.wait(lock, [&] { return queue.size() < max_queued || error; });
+
+        current->remaining = n_threads;
+        queue.push_back(std::move(current));
+        current = std::make_shared<batch>();
+        current->first_id = static_cast<imageId>(n_rows);
+        queue_cv.notify_all();
+    };
+
+    try {
+        sqlite_db_->eachImageRow([&](const ImageRow& row) {
+            current->info.push_back({ postId(row.post_id), std::string(row.md5), {} });
+            current->sigs += row.sig;
+            current->sig_ends.push_back(current->sigs.size());
+            n_rows++;
+
+            if (current->info.size() == batch_size) {
+                push();
+
+                const auto now = std::chrono::steady_clock::now();
+                if (now - last_progress >= std::chrono::seconds(5)) {
+                    const double seconds = std::chrono::duration<double>(now - start).count();
+                    INFO("loaded {} images ({:.0f} rows/sec)...\n", n_rows, n_rows / seconds);
+                    last_progress = now;
+                }
+            }
+        });
+
+        if (!current->info.empty()) {
+            push();
+        }
+    } catch (...) {
+        std::unique_lock lock(mutex);
+        error = std::current_exception();
+    }
+
+    {
+        std::unique_lock lock(mutex);
+        reading = false;
+    }
+    queue_cv.notify_all();
+    reader_cv.notify_all();
+
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // a shard in one part just needs its tails compacted, and the shards in
+    // several parts are merged a plane at a time
+    thread_pool pool(n_workers);
+    if (n_parts == 1) {
+        pool.parallel_for(n_shards, [&](size_t s) {
+            m_shards[s].buckets = std::make_shared<bucket_set>(partials[s].compacted());
+            partials[s] = bucket_set();
+        });
+    } else {
+        for (size_t s = 0; s < n_shards; s++) {
+            std::vector<bucket_set> parts;
+            for (size_t p = 0; p < n_parts; p++) {
+                parts.push_back(std::move(partials[s * n_parts + p]));
+            }
+
+            m_shards[s].buckets = std::make_shared<bucket_set>(bucket_set::merged(parts, pool));
+        }
+    }
+
+    publish();
+}
+
+// The snapshot file format. The version is bumped whenever the layout of the
+// in-memory index changes, or what it holds does: version 3 holds the
+// signatures quantized as they're stored in the DB. The signatures are saved
+// decoded, so that loading a snapshot doesn't have to decode them.
+static const char snapshot_magic[8] = { 'I', 'Q', 'D', 'B', 'S', 'N', 'A', 'P' };
+static const uint32_t snapshot_version = 3;
+
+void IQDB::saveSnapshot(const std::string& path) {
+    // only compacted buckets can be saved, and the deleted images don't need to be
+    if (std::any_of(m_shards.begin(), m_shards.end(), [](const index_shard& shard) { return shard.buckets->tailSize() > 0 || shard.unpurged > 0; })) {
+        compact();
+    }
+
+    // the changes made in the open transaction aren't in memory yet, so they're
+    // replayed when the snapshot is loaded
+    const int64_t seq = m_in_transaction ? m_committed_change : sqlite_db_->lastChange();
+    const std::string tmp_path = path + ".tmp";
+    INFO("saving snapshot [path={}] [images={}] [change={}]\n", path, m_info.size(), seq);
+
+    snapshot_writer out(tmp_path);
+    out.write(snapshot_magic);
+    out.write<uint32_t>(snapshot_version);
+    out.write<uint32_t>(static_cast<uint32_t>(m_shards.size()));
+    out.write<int64_t>(seq);
+    out.write<uint64_t>(m_info.size());
+
+    for (size_t id = 0; id < m_info.size(); id++) {
+        out.writeString(m_info[id].post_id);
+        out.writeString(m_info[id].md5);
+        out.write(m_info[id].haar);
+    }
+
+    for (const index_shard& shard : m_shards) {
+        shard.images.save(out);
+        shard.buckets->save(out);
+    }
+
+    out.close();
+
+    // replace the old snapshot only once the new one is complete
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw snapshot_error("couldn't rename " + tmp_path + " to " + path);
+    }
+
+    sqlite_db_->trimChanges(seq);
+}
+
+void IQDB::loadSnapshot(const std::string& path) {
+    INFO("loading snapshot [path={}]\n", path);
+    clearInMemory();
+
+    try {
+        snapshot_reader in(path);
+
+        char magic[8];
+        std::memcpy(magic, in.readArray<char>(sizeof(magic)), sizeof(magic));
+        const uint32_t version = in.read<uint32_t>();
+        const uint32_t n_shards = in.read<uint32_t>();
+        const int64_t seq = in.read<int64_t>();
+        const uint64_t n_images = in.read<uint64_t>();
+
+        if (std::memcmp(magic, snapshot_magic, sizeof(magic)) != 0 || version != snapshot_version) {
+            throw snapshot_error("not a snapshot, or a snapshot from another version of iqdb");
+        } else if (n_shards != m_shards.size()) {
+            throw snapshot_error(fmt::format("snapshot has {} shards, not {}", n_shards, m_shards.size()));
+        } else if (seq > sqlite_db_->lastChange()) {
+            throw snapshot_error("snapshot is newer than the database");
+        }
+
+        for (uint64_t id = 0; id < n_images; id++) {
+            image_info& info = m_info.append();
+            info.post_id = in.readString();
+            info.md5 = in.readString();
+            info.haar = in.read<HaarSignature>();
+
+            // the coefficients index the buckets, so a corrupt one can't be used
+            if (!info.haar.is_valid()) {
+                throw snapshot_error(fmt::format("post {} has an invalid signature", info.post_id));
+            }
+        }
+
+        for (size_t s = 0; s < m_shards.size(); s++) {
+            index_shard& shard = m_shards[s];
+            shard.images.load(in);
+
+            // every image is looked up in its shard's table
+            if (shard.images.size() != (n_images + m_shards.size() - 1 - s) / m_shards.size()) {
+                throw snapshot_error(fmt::format("shard {} has {} images, not its share of {}", s, shard.images.size(), n_images));
+            }
+
+            shard.buckets->load(in, static_cast<imageId>(shard.images.size()));
+        }
+
+        for (imageId id = 0; id < n_images; id++) {
+            if (!isDeleted(id)) {
+                m_ids[m_info[id].post_id] = id;
+                addToHashIndexes(id);
+            }
+        }
+        img_count = m_ids.size();
 
-    sqlite_db_->eachImage([&](const iqdb::Image& image) {
-        addImageInMemory(image.post_id, image.md5, image.haar());
+        // bring the index up to date with the changes made since the snapshot
+        const std::vector<postId> changes = sqlite_db_->changesSince(seq);
+        if (std::find(changes.begin(), changes.end(), "") != changes.end()) {
+            throw snapshot_error("the database was changed without a snapshot since this snapshot was saved");
+        }
+
+        for (const postId& post_id : changes) {
+            removeImageInMemory(post_id);
+
+            if (std::optional<Image> image = sqlite_db_->getImage(post_id)) {
+                addImageInMemory(image->post_id, image->md5, image->haar());
+            }
+        }
+
+        INFO("loaded {} images from snapshot, and replayed {} changes\n", getImgCount(), changes.size());
 
-        if (img_count % 250000 == 0) {
-            INFO("loaded image (post {})...\n", image.post_id);
+        // save the replayed changes, so they don't have to be replayed again
+        if (!changes.empty()) {
+            saveSnapshot(path);
+        } else {
+            publish();
         }
+    } catch (const snapshot_error&) {
+        clearInMemory();
+        publish();
+        throw;
+    }
+}
+
+bool IQDB::needsCompaction() {
+    return std::any_of(m_shards.begin(), m_shards.end(), [](const index_shard& shard) {
+        const bucket_set& buckets = *shard.buckets;
+        const bool big_tails = buckets.tailSize() > 0 && buckets.tailSize() >= buckets.compactedSize() / 8;
+        const bool many_deleted = shard.unpurged > 0 && shard.unpurged >= shard.images.size() / 64;
+
+        return big_tails || many_deleted;
+    });
+}
+
+void IQDB::compact() {
+    scoped_timer timer(metrics::compaction_duration);
+
+    // The compacted buckets are built next to the current ones, which queries
+    // keep using until the compacted ones are published.
+    std::vector<bucket_set> compacted(m_shards.size());
+    m_pool->parallel_for(m_shards.size(), [&](size_t s) {
+        const index_shard& shard = m_shards[s];
+        compacted[s] = shard.buckets->compacted(shard.unpurged > 0 ? &shard.images : nullptr);
     });
 
-    INFO("loaded {} images from {}\n", getImgCount(), filename);
+    size_t bytes = 0;
+    for (size_t s = 0; s < m_shards.size(); s++) {
+        m_shards[s].buckets = std::make_shared<bucket_set>(std::move(compacted[s]));
+        m_shards[s].unpurged = 0;
+        bytes += m_shards[s].buckets->memoryUsage() + m_shards[s].images.memoryUsage();
+    }
+
+    publish();
+    DEBUG("compacted buckets [bytes={}]\n", bytes);
 }
 
-bool IQDB::isDeleted(postId iqdb_id) {
-    return !m_info.at(iqdb_id).avgl.v[0];
+bool IQDB::isDeleted(imageId id) {
+    return shardOf(id).images.isDeleted(shardIndex(id));
 }
 
 std::optional<Image> IQDB::getImage(postId post_id) {
     return sqlite_db_->getImage(post_id);
 }
 
-std::vector<Image> IQDB::getByMD5(const std::string& md5) {
-    return sqlite_db_->getByMD5(md5);
+std::vector<image_info> IQDB::getByMD5(const std::string& md5) {
+    const std::shared_ptr<const index_snapshot> index = snapshot();
+
+    // The table can have images added after the snapshot, and other md5s with
+    // the same tag. The images are returned in the order they were added.
+    std::vector<imageId> ids;
+    index->md5s->find(md5_key(md5), [&](imageId id) {
+        if (id < index->info.size() && !index->isDeleted(id) && index->info[id].md5 == md5) {
+            ids.push_back(id);
+        }
+    });
+    std::sort(ids.begin(), ids.end());
+
+    std::vector<image_info> images;
+    for (imageId id : ids) {
+        images.push_back(index->info[id]);
+    }
+
+    return images;
 }
 
-sim_vector IQDB::queryFromBlob(const std::string blob, int numres) {
+sim_vector IQDB::queryFromBlob(std::string_view blob, int numres, std::optional<Score> min_score) {
     HaarSignature signature = HaarSignature::from_file_content(blob);
-    return queryFromSignature(signature, numres);
+    return queryFromSignature(signature, numres, min_score);
 }
 
-sim_vector IQDB::queryFromSignature(const HaarSignature &signature, size_t numres) {
-    Score scale = 0;
-    std::map<postId, Score> scores;
+sim_vector IQDB::queryExact(const HaarSignature &signature, size_t numres) {
+    const std::shared_ptr<const index_snapshot> index = snapshot();
 
-    DEBUG("querying signature={}\n", signature.to_string());
+    // the images' signatures were quantized when they were added
+    const HaarSignature haar = signature.quantized();
 
-    // luminance score (DC coefficient)
-    for (auto const& elem : m_info) {
-        const image_info& image_info = elem.second;
-        Score s = 0;
+    std::vector<imageId> ids;
+    index->signatures->find(haar.digest(), [&](imageId id) {
+        if (id < index->info.size() && !index->isDeleted(id) && index->info[id].haar == haar) {
+            ids.push_back(id);
+        }
+    });
+    std::sort(ids.begin(), ids.end());
+    ids.resize(std::min(ids.size(), numres));
 
-        for (int c = 0; c < signature.num_colors(); c++) {
-            s += weights[0][c] * std::abs(image_info.avgl.v[c] - static_cast<Score>(signature.avglf[c]));
+    sim_vector V;
+    for (imageId id : ids) {
+        const image_info& info = index->info[id];
+        V.emplace_back(info.post_id, 100, info.md5, info.haar);
+    }
+
+    metrics::queries.add();
+    return V;
+}
+
+sim_vector IQDB::queryFromSignature(const HaarSignature &signature, size_t numres, std::optional<Score> min_score, bucket_mask* buckets) {
+    // The epoch is read before the snapshot, since a write bumps it after
+    // publishing. The results are then never cached under a newer epoch than
+    // the index they were computed from.
+    const uint64_t epoch = m_epoch;
+    if (m_query_cache) {
+        if (std::optional<query_cache::results> cached = m_query_cache->find(signature, numres, min_score, epoch)) {
+            if (buckets) {
+                *buckets = cached->buckets;
+            }
+
+            metrics::queries.add();
+            return std::move(cached->matches);
+        }
+    }
+
+    // The snapshot keeps the index as it is now alive until the query is done,
+    // however it is changed in the meantime.
+    const std::shared_ptr<const index_snapshot> index = snapshot();
+    const size_t n_shards = index->shards.size();
+    DEBUG("querying signature={} [simd={}] [shards={}]\n", signature.to_string(), get_simd_kernels().name, n_shards);
+
+    // Score each shard in parallel. Each shard collects its own top `numres`
+    // results, which are merged below.
+    std::vector<std::vector<scored_image>> shard_results(n_shards);
+    std::vector<size_t> scanned(n_shards);
+    const bucket_mask matched = bucketsOf(*index, signature);
+    const Score scale = scaleOf(signature, matched);
+    if (buckets) {
+        *buckets = matched;
+    }
+
+    // A score is the raw score times `100 * scale`, and the scale is negative,
+    // so a minimum score is a maximum raw score. The threshold is loosened a
+    // little so that rounding can't drop a match that `mergeResults` would keep.
+    std::optional<Score> threshold;
+    if (min_score && scale != 0) {
+        threshold = *min_score / (100 * scale);
+        *threshold += std::abs(*threshold) * 1e-4f;
+    }
+
+    m_pool->parallel_for(n_shards, [&](size_t s) {
+        const index_shard& shard = index->shards[s];
+        std::optional<std::vector<scored_image>> results;
+
+        if (threshold) {
+            results = shard.queryPruned(signature, numres, *threshold, [&](imageId i) -> const HaarSignature& { return index->info[i * n_shards + s].haar; }, &scanned[s]);
         }
 
-        scores.emplace(elem.first, s);
+        shard_results[s] = results ? std::move(*results) : shard.query(signature, numres, &scanned[s]);
+    });
+
+    metrics::queries.add();
+    metrics::query_bucket_entries.observe(static_cast<double>(std::accumulate(scanned.begin(), scanned.end(), size_t(0))));
+
+    scoped_timer timer(metrics::stage_merge);
+    sim_vector V = mergeResults(*index, shard_results, numres, scale, min_score);
+
+    if (m_query_cache) {
+        m_query_cache->insert(signature, numres, min_score, epoch, { V, matched });
     }
 
+    return V;
+}
+
+std::vector<sim_vector> IQDB::queryBatch(const std::vector<HaarSignature> &signatures, size_t numres, std::optional<Score> min_score, std::vector<bucket_mask>* buckets) {
+    const std::shared_ptr<const index_snapshot> index = snapshot();
+    const size_t n_shards = index->shards.size();
+    DEBUG("querying batch of {} signatures [shards={}]\n", signatures.size(), n_shards);
+
+    // batch_results[s][q] is the top results of query `q` in shard `s`.
+    std::vector<std::vector<std::vector<scored_image>>> batch_results(n_shards);
+    std::vector<std::vector<size_t>> scanned(n_shards, std::vector<size_t>(signatures.size()));
+    m_pool->parallel_for(n_shards, [&](size_t s) {
+        batch_results[s] = index->shards[s].queryBatch(signatures, numres, scanned[s].data());
+    });
+
+    metrics::queries.add(signatures.size());
+    scoped_timer timer(metrics::stage_merge);
+
+    std::vector<sim_vector> V;
+    if (buckets) {
+        buckets->clear();
+    }
+
+    for (size_t q = 0; q < signatures.size(); q++) {
+        std::vector<std::vector<scored_image>> shard_results(n_shards);
+        size_t entries = 0;
+        for (size_t s = 0; s < n_shards; s++) {
+            shard_results[s] = std::move(batch_results[s][q]);
+            entries += scanned[s][q];
+        }
+
+        metrics::query_bucket_entries.observe(static_cast<double>(entries));
+
+        const bucket_mask matched = bucketsOf(*index, signatures[q]);
+        if (buckets) {
+            buckets->push_back(matched);
+        }
+
+        V.push_back(mergeResults(*index, shard_results, numres, scaleOf(signatures[q], matched), min_score));
+    }
+
+    return V;
+}
+
+bucket_mask IQDB::bucketsOf(const index_snapshot &index, const HaarSignature &signature) {
+    // A bucket counts if it isn't empty in any of the shards.
+    bucket_mask buckets;
     for (int c = 0; c < signature.num_colors(); c++) {
-        for (int b = 0; b < NUM_COEFS; b++) { // for every coef on a sig
+        for (int b = 0; b < NUM_COEFS; b++) {
             const int coef = signature.sig[c][b];
-            bucket_t& bucket = imgbuckets.at(c, coef);
+            const bool empty = std::all_of(index.shards.begin(), index.shards.end(), [&](const index_shard& shard) {
+                return shard.buckets->empty(c, coef, static_cast<imageId>(shard.images.size()));
+            });
 
-            if (bucket.empty()) {
-                continue;
-            }
-
-            /*
-            std::string bs;
-            for (const postId& i : bucket) {
-                bs += i + " ";
-            }
-            INFO("bucket {}\n", bs);
-            */
+            buckets[c * NUM_COEFS + b] = !empty;
+        }
+    }
 
-            const int w = imgBin.bin[abs(coef)];
-            Score weight = weights[w][c];
-            scale -= weight;
+    return buckets;
+}
 
-            for (postId index : bucket) {
-                scores[index] -= weight;
+Score IQDB::scaleOf(const HaarSignature &signature, const bucket_mask &buckets) {
+    // The scale is the total weight of the buckets matched by the query, so that
+    // a perfect match gets a score of 100.
+    Score scale = 0;
+    for (int c = 0; c < signature.num_colors(); c++) {
+        for (int b = 0; b < NUM_COEFS; b++) {
+            if (buckets[c * NUM_COEFS + b]) {
+                scale -= weights[imgBin.bin[abs(signature.sig[c][b])]][c];
             }
         }
     }
@@ -168,66 +1529,184 @@ sim_vector IQDB::queryFromSignature(const HaarSignature &signature, size_t numre
         scale = static_cast<Score>(1.0) / scale;
     }
 
-    INFO("scale is {}\n", scale);
+    DEBUG("scale is {}\n", scale);
+    return scale;
+}
+
+sim_vector IQDB::mergeResults(const index_snapshot &index, const std::vector<std::vector<scored_image>> &shard_results, size_t numres, Score scale, std::optional<Score> min_score) {
+    const size_t n_shards = index.shards.size();
 
-    // print out elems
-    for (const std::pair<const postId, Score>& elem : scores) {
-        //INFO("{} => {}\n", elem.first, elem.second);
+    // Merge the per-shard results, converting shard indexes back to image IDs.
+    std::vector<scored_image> results;
+    for (size_t s = 0; s < n_shards; s++) {
+        for (const auto& [score, shard_index] : shard_results[s]) {
+            results.emplace_back(score, static_cast<imageId>(shard_index * n_shards + s));
+        }
     }
 
-    // results priority queue; largest at top
-    std::priority_queue<sim_value> pqResults;
-    for (const std::pair<const postId, Score>& elem : scores) {
-        //INFO("emplace {} {}\n", elem.first, elem.second);
-        if (!isDeleted(elem.first)) {
-            pqResults.emplace(elem.first, elem.second);
+    // sorts the results from best to worst.
+    const size_t n_results = std::min(numres, results.size());
+    std::partial_sort(results.begin(), results.begin() + n_results, results.end());
+    results.resize(n_results);
+
+    sim_vector V; // output results
+    V.reserve(results.size());
+    for (const auto& [score, id] : results) {
+        // the results are sorted, so the rest score even lower
+        if (min_score && score * 100 * scale < *min_score) {
+            break;
         }
 
-        // pops to lowest result off
-        if (pqResults.size() > numres) {
-            pqResults.pop();
+        const image_info& info = index.info[id];
+        V.emplace_back(info.post_id, score * 100 * scale, info.md5, info.haar);
+    }
+
+    return V;
+}
+
+void IQDB::transaction(const std::function<void()>& func) {
+    if (m_in_transaction) {
+        const size_t n_pending = m_pending.size();
+        try {
+            sqlite_db_->savepoint(func);
+        } catch (...) {
+            discardPendingChanges(n_pending);
+            throw;
         }
+
+        return;
     }
 
-    sim_vector V; // output results
-    while (!pqResults.empty()) {
-        sim_value value = pqResults.top();
-        value.score = value.score * 100 * scale;
+    m_in_transaction = true;
+    try {
+        sqlite_db_->transaction([&] {
+            m_committed_change = sqlite_db_->lastChange();
+            func();
+        });
+    } catch (...) {
+        m_in_transaction = false;
+        discardPendingChanges(0);
+        throw;
+    }
 
-        //DEBUG("including {} => {}\n", value.id, value.score);
+    m_in_transaction = false;
+    applyPendingChanges();
+}
 
-        V.push_back(value);
-        pqResults.pop();
+void IQDB::addPendingChange(postId post_id, std::optional<image_info> image) {
+    m_last_pending[post_id] = m_pending.size();
+    m_pending.push_back({ std::move(post_id), std::move(image) });
+}
+
+void IQDB::discardPendingChanges(size_t n) {
+    if (n == m_pending.size()) {
+        return;
     }
 
-    std::reverse(V.begin(), V.end());
-    return V;
+    m_pending.resize(n);
+    m_last_pending.clear();
+    for (size_t i = 0; i < n; i++) {
+        m_last_pending[m_pending[i].post_id] = i;
+    }
+}
+
+void IQDB::applyPendingChanges() {
+    // Only the last change to each post matters. The posts changed are removed
+    // first, and the images they're left with are then added all at once.
+    std::vector<image_info> added;
+    size_t n_removed = 0;
+    for (size_t i = 0; i < m_pending.size(); i++) {
+        pending_change& change = m_pending[i];
+        if (m_last_pending[change.post_id] != i) {
+            continue;
+        }
+
+        const bool removed = removeImageInMemory(change.post_id);
+        if (change.image) {
+            added.push_back(std::move(*change.image));
+        } else if (removed) {
+            n_removed++;
+        }
+    }
+
+    m_pending.clear();
+    m_last_pending.clear();
+
+    if (!added.empty()) {
+        metrics::images_added.add(added.size());
+        addImagesInMemory(std::move(added));
+        publish();
+    }
+
+    metrics::images_removed.add(n_removed);
+}
+
+bool IQDB::hasPost(const postId& post_id) const {
+    auto it = m_last_pending.find(post_id);
+    if (it != m_last_pending.end()) {
+        return m_pending[it->second].image.has_value();
+    }
+
+    return m_ids.find(post_id) != m_ids.end();
 }
 
 void IQDB::removeImage(postId post_id) {
-    std::optional<Image> image = sqlite_db_->getImage(post_id);
-    if (image == std::nullopt) {
-        WARN("couldn't remove post #{}; post not in sqlite database\n", post_id);
+    if (!hasPost(post_id)) {
+        WARN("couldn't remove post #{}; post not in memory\n", post_id);
         return;
     }
 
-    imgbuckets.remove(image->haar(), image->post_id);
+    transaction([&] {
+        sqlite_db_->removeImage(post_id);
+        addPendingChange(post_id, std::nullopt);
+    });
+
+    DEBUG("removed post #{} from memory and database\n", post_id);
+}
+
+bool IQDB::removeImageInMemory(postId post_id) {
+    auto it = m_ids.find(post_id);
+    if (it == m_ids.end()) {
+        return false;
+    }
+
+    // The image is only marked as deleted here. Its ID stays in the buckets
+    // until the next compaction, and is skipped when the results are selected.
+    // The deleted bits are shared by every snapshot, so this is seen by queries
+    // right away.
+    const imageId id = it->second;
+    index_shard& shard = shardOf(id);
+    shard.images.setDeleted(shardIndex(id));
+    shard.unpurged++;
 
-    // TODO, could we just remove it from the map instead?
-    m_info.erase(image->post_id);
-    //m_info.at(image->post_id).avgl.v[0] = 0;
-    sqlite_db_->removeImage(post_id);
+    m_md5s->erase(md5_key(m_info[id].md5), id);
+    m_signatures->erase(m_info[id].haar.digest(), id);
+
+    m_ids.erase(it);
     --img_count;
 
-    DEBUG("removed post #{} from memory and database\n", post_id);
+    // the cached results may include the image
+    m_epoch++;
+
+    return true;
 }
 
 uint64_t IQDB::getImgCount() {
     return img_count;
 }
 
-IQDB::IQDB(std::string filename) : sqlite_db_(nullptr) {
+IQDB::IQDB(std::string filename, size_t shards, std::string snapshot_file, size_t query_cache_size) : m_snapshot_file(snapshot_file), sqlite_db_(nullptr) {
+    // The calling thread scores one shard itself, so N shards need N-1 workers.
+    m_shards.resize(std::max<size_t>(shards, 1));
+    m_pool = std::make_unique<thread_pool>(m_shards.size() - 1);
+
+    if (query_cache_size > 0) {
+        m_query_cache = std::make_unique<query_cache>(query_cache_size);
+    }
+
     loadDatabase(filename);
 }
 
+IQDB::~IQDB() = default;
+
 }
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <utility>
+
+#include <iqdb/ingest_queue.h>
+#include <iqdb/metrics.h>
+
+namespace iqdb {
+
+ingest_queue::ingest_queue(write_queue& writer, add_func add, size_t n_workers, size_t capacity, size_t max_finished) :
+    writer_(writer), add_(std::move(add)), capacity_(std::max<size_t>(capacity, 1)), max_finished_(max_finished) {
+    for (size_t i = 0; i < std::max<size_t>(n_workers, 1); i++) {
+        threads_.emplace_back([this] { worker(); });
+    }
+}
+
+ingest_queue::~ingest_queue() {
+    {
+        std::unique_lock lock(mutex_);
+        stopping_ = true;
+    }
+
+    cv_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+std::optional<uint64_t> ingest_queue::submit(postId post_id, std::string md5, std::string file) {
+    std::unique_lock lock(mutex_);
+    if (tasks_.size() >= capacity_ || stopping_) {
+        metrics::ingest_rejected.add();
+        return std::nullopt;
+    }
+
+    const uint64_t id = next_id_++;
+    const auto now = std::chrono::steady_clock::now();
+    jobs_[id] = { job_state::queued, std::move(post_id), std::move(md5), {}, "", now };
+    tasks_.push_back({ id, std::move(file), now });
+    metrics::ingest_queue_depth.add();
+
+    lock.unlock();
+    cv_.notify_one();
+    return id;
+}
+
+std::optional<ingest_queue::job_status> ingest_queue::status(uint64_t id) const {
+    std::unique_lock lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+        return std::nullopt;
+    }
+
+    return it->second;
+}
+
+void ingest_queue::worker() {
+    while (true) {
+        task t;
+
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+
+            // Finish the queued jobs before stopping, as they were accepted.
+            if (tasks_.empty()) {
+                return;
+            }
+
+            t = std::move(tasks_.front());
+            tasks_.pop_front();
+            jobs_.at(t.id).state = job_state::running;
+            metrics::ingest_queue_depth.sub();
+        }
+
+        metrics::ingest_wait.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - t.queued).count());
+
+        std::optional<HaarSignature> signature;
+        std::string error;
+        try {
+            // Quantized as it will be stored, so the job has the same hash as the image.
+            signature = HaarSignature::from_file_content(t.file).quantized();
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+
+        // Free the file before waiting for the writer.
+        t.file = std::string();
+
+        bool queue_flush = false;
+        {
+            std::unique_lock lock(mutex_);
+            if (!signature) {
+                finish(t.id, job_state::failed, error);
+                continue;
+            }
+
+            jobs_.at(t.id).signature = *signature;
+            ready_.push_back(t.id);
+
+            // A flush that's still waiting for the writer will add this one too.
+            queue_flush = !flush_queued_;
+            flush_queued_ = true;
+        }
+
+        if (!queue_flush) {
+            continue;
+        }
+
+        // The jobs are only done once the writer has committed them, so this
+        // worker waits for it and then finishes the jobs in the batch.
+        auto batch = std::make_shared<std::vector<uint64_t>>();
+        std::exception_ptr failure;
+        try {
+            writer_.submit([this, batch] { flush(*batch); }).get();
+        } catch (...) {
+            failure = std::current_exception();
+        }
+
+        std::string message;
+        if (failure) {
+            try {
+                std::rethrow_exception(failure);
+            } catch (const std::exception& e) {
+                message = e.what();
+            } catch (...) {
+                message = "unknown error";
+            }
+        }
+
+        std::unique_lock lock(mutex_);
+
+        // If the writer's group failed before the flush ran, the jobs are still
+        // waiting for it, and no other worker would queue another flush.
+        if (failure && batch->empty()) {
+            batch->swap(ready_);
+            flush_queued_ = false;
+        }
+
+        for (uint64_t id : *batch) {
+            finish(id, failure ? job_state::failed : job_state::done, message);
+        }
+    }
+}
+
+void ingest_queue::flush(std::vector<uint64_t>& ids) {
+    std::vector<image_info> images;
+
+    {
+        std::unique_lock lock(mutex_);
+        ids.swap(ready_);
+        flush_queued_ = false;
+
+        for (uint64_t id : ids) {
+            const job_status& job = jobs_.at(id);
+            images.push_back({ job.post_id, job.md5, job.signature });
+        }
+    }
+
+    add_(std::move(images));
+}
+
+void ingest_queue::finish(uint64_t id, job_state state, std::string error) {
+    job_status& job = jobs_.at(id);
+    job.state = state;
+    job.error = std::move(error);
+
+    metrics::ingest_job_duration.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - job.queued).count());
+
+    finished_.push_back(id);
+    if (finished_.size() > max_finished_) {
+        jobs_.erase(finished_.front());
+        finished_.pop_front();
+    }
+}
+
+}
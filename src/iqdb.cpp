@@ -18,16 +18,50 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 \**************************************************************************/
 
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <map>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include <iqdb/bulk.h>
 #include <iqdb/debug.h>
 #include <iqdb/server.h>
 #include <iqdb/sqlite_db.h>
 
 using namespace iqdb;
 
+// Parse `value` as a non-negative number, for the option or argument called
+// `name`. Anything else, or a number over `max`, is a param_error.
+static size_t number_arg(const std::string& name, const std::string& value, size_t max = SIZE_MAX) {
+  unsigned long long number = 0;
+  size_t end = 0;
+
+  // stoull would skip leading spaces and negate a leading `-`.
+  if (!value.empty() && isdigit(static_cast<unsigned char>(value[0]))) {
+    try {
+      number = std::stoull(value, &end);
+    } catch (const std::out_of_range&) {
+      // Or the ERANGE would be reported as the last system error.
+      errno = 0;
+      throw param_error(name + " can't be more than " + std::to_string(max));
+    }
+  }
+
+  if (end == 0 || end != value.size())
+    throw param_error(name + " must be a number, not `" + value + "`");
+
+  if (number > max)
+    throw param_error(name + " can't be more than " + std::to_string(max));
+
+  return number;
+}
+
 int main(int argc, char **argv) {
   try {
     // open_swap();
@@ -35,18 +69,110 @@ int main(int argc, char **argv) {
       help();
 
     if (!strncmp(argv[1], "-d=", 3)) {
-      debug_level = std::stoi(argv[1] + 3, NULL, 0);
+      debug_level = number_arg("-d", argv[1] + 3, INT_MAX);
       INFO("Debug level set to {}\n", debug_level);
       argv++;
       argc--;
     }
 
-    if (!strcasecmp(argv[1], "http")) {
-      const std::string host = argc >= 2 ? argv[2] : "localhost";
-      const int port = argc >= 3 ? std::stoi(argv[3]) : 8000;
-      const std::string filename = argc >= 4 ? argv[4] : "iqdb.db";
+    // Split the remaining arguments into positional arguments and `--name=value` options.
+    std::vector<std::string> args;
+    std::map<std::string, std::string> options;
+    for (int i = 2; i < argc; i++) {
+      const std::string arg = argv[i];
+      const size_t eq = arg.find('=');
+
+      if (arg.rfind("--", 0) == 0 && eq != std::string::npos) {
+        options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+      } else {
+        args.push_back(arg);
+      }
+    }
+
+    if (!strcasecmp(argv[1], "http") || !strcasecmp(argv[1], "coordinator")) {
+      const std::string host = args.size() >= 1 ? args[0] : "localhost";
+      const int port = args.size() >= 2 ? number_arg("the port", args[1], 65535) : 8000;
+
+      http_options http;
+      if (options.count("shards")) {
+        http.shards = number_arg("--shards", options["shards"]);
+      }
+
+      if (options.count("snapshot")) {
+        http.snapshot = options["snapshot"];
+      }
+
+      if (options.count("threads")) {
+        http.threads = number_arg("--threads", options["threads"]);
+      }
+
+      if (options.count("keep-alive-max")) {
+        http.keep_alive_max = number_arg("--keep-alive-max", options["keep-alive-max"]);
+      }
+
+      if (options.count("keep-alive-timeout")) {
+        http.keep_alive_timeout = number_arg("--keep-alive-timeout", options["keep-alive-timeout"], INT_MAX);
+      }
+
+      if (options.count("max-payload")) {
+        http.max_payload = number_arg("--max-payload", options["max-payload"]);
+      }
+
+      if (options.count("ingest-threads")) {
+        http.ingest_threads = number_arg("--ingest-threads", options["ingest-threads"]);
+      }
+
+      if (options.count("ingest-queue")) {
+        http.ingest_queue = number_arg("--ingest-queue", options["ingest-queue"]);
+      }
+
+      if (options.count("query-cache")) {
+        http.query_cache = number_arg("--query-cache", options["query-cache"]);
+      }
+
+      if (!strcasecmp(argv[1], "coordinator")) {
+        std::vector<std::string> shards;
+        std::stringstream urls(options["shard-urls"]);
+        for (std::string url; std::getline(urls, url, ',');) {
+          if (!url.empty())
+            shards.push_back(url);
+        }
+
+        if (shards.empty())
+          throw param_error("`iqdb coordinator` requires --shard-urls");
+
+        coordinator_server(host, port, shards, http);
+      } else {
+        const std::string filename = args.size() >= 3 ? args[2] : "iqdb.db";
+        http_server(host, port, filename, http);
+      }
+    } else if (!strcasecmp(argv[1], "import")) {
+      if (args.empty())
+        help();
+
+      const std::string input = args[0];
+      const std::string filename = args.size() >= 2 ? args[1] : "iqdb.db";
+
+      import_options import;
+      if (options.count("format")) {
+        if (options["format"] == "ndjson") {
+          import.format = bulk_format::ndjson;
+        } else if (options["format"] == "binary") {
+          import.format = bulk_format::binary;
+        } else {
+          throw param_error("--format must be `ndjson` or `binary`");
+        }
+      }
+
+      if (options.count("shards")) {
+        import.shards = number_arg("--shards", options["shards"]);
+      }
+
+      if (options.count("snapshot")) {
+        import.snapshot = options["snapshot"];
+      }
 
-      http_server(host, port, filename);
+      import_file(input, filename, import);
     } else {
       help();
     }
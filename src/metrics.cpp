@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <string_view>
+
+#include <fmt/format.h>
+
+#include <iqdb/metrics.h>
+
+namespace iqdb {
+
+// Every metric, in the order they were defined.
+static std::vector<const metric*>& registry() {
+    static std::vector<const metric*> metrics;
+    return metrics;
+}
+
+metric::metric(const char* name_, const char* help_, const char* type_, std::string labels_) :
+    name(name_), help(help_), type(type_), labels(std::move(labels_)) {
+    registry().push_back(this);
+}
+
+// Format the labels of a sample, with `extra` added to the metric's own labels.
+static std::string label_set(const std::string& labels, const std::string& extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return "";
+    }
+
+    return "{" + labels + (!labels.empty() && !extra.empty() ? "," : "") + extra + "}";
+}
+
+void counter::write(std::string& out) const {
+    out += fmt::format("{}{} {}\n", name, label_set(labels), value());
+}
+
+void gauge::write(std::string& out) const {
+    out += fmt::format("{}{} {}\n", name, label_set(labels), value());
+}
+
+histogram::histogram(const char* name, const char* help, std::string labels, std::vector<double> bounds) :
+    metric(name, help, "histogram", std::move(labels)), bounds_(std::move(bounds)),
+    counts_(std::make_unique<std::atomic<uint64_t>[]>(bounds_.size() + 1)) {
+}
+
+std::vector<double> histogram::exponential(double start, double factor, size_t n) {
+    std::vector<double> bounds;
+    for (double bound = start; bounds.size() < n; bound *= factor) {
+        bounds.push_back(bound);
+    }
+
+    return bounds;
+}
+
+std::vector<double> histogram::seconds() {
+    std::vector<double> bounds;
+    for (double decade = 1e-5; decade < 10; decade *= 10) {
+        for (double step : { 1.0, 2.5, 5.0 }) {
+            bounds.push_back(decade * step);
+        }
+    }
+    bounds.push_back(10);
+
+    return bounds;
+}
+
+void histogram::observe(double value) {
+    // A bucket counts the values less than or equal to its bound.
+    const size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+    }
+}
+
+void histogram::write(std::string& out) const {
+    // The buckets are cumulative, and the count is the last bucket, so the
+    // buckets always add up even if values are observed while writing them.
+    uint64_t count = 0;
+    for (size_t i = 0; i <= bounds_.size(); i++) {
+        count += counts_[i].load(std::memory_order_relaxed);
+        const std::string le = i < bounds_.size() ? fmt::format("le=\"{}\"", bounds_[i]) : "le=\"+Inf\"";
+        out += fmt::format("{}_bucket{} {}\n", name, label_set(labels, le), count);
+    }
+
+    out += fmt::format("{}_sum{} {}\n", name, label_set(labels), sum_.load(std::memory_order_relaxed));
+    out += fmt::format("{}_count{} {}\n", name, label_set(labels), count);
+}
+
+std::string metrics_text() {
+    std::string out;
+    const char* family = nullptr;
+
+    for (const metric* m : registry()) {
+        if (!family || std::string_view(family) != m->name) {
+            out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", m->name, m->help, m->name, m->type);
+            family = m->name;
+        }
+
+        m->write(out);
+    }
+
+    return out;
+}
+
+namespace metrics {
+
+static const char request_help[] = "How long requests to the HTTP server take, in seconds.";
+histogram request_query("iqdb_request_duration_seconds", request_help, "endpoint=\"query\"", histogram::seconds());
+histogram request_query_batch("iqdb_request_duration_seconds", request_help, "endpoint=\"query_batch\"", histogram::seconds());
+histogram request_add_image("iqdb_request_duration_seconds", request_help, "endpoint=\"add_image\"", histogram::seconds());
+histogram request_add_images_bulk("iqdb_request_duration_seconds", request_help, "endpoint=\"add_images_bulk\"", histogram::seconds());
+histogram request_remove_image("iqdb_request_duration_seconds", request_help, "endpoint=\"remove_image\"", histogram::seconds());
+
+static const char stage_help[] = "How long each stage of adding or querying an image takes, in seconds. Query stages are observed once per shard.";
+histogram stage_decode("iqdb_stage_duration_seconds", stage_help, "stage=\"decode\"", histogram::seconds());
+histogram stage_signature("iqdb_stage_duration_seconds", stage_help, "stage=\"signature\"", histogram::seconds());
+histogram stage_lumin("iqdb_stage_duration_seconds", stage_help, "stage=\"lumin\"", histogram::seconds());
+histogram stage_buckets("iqdb_stage_duration_seconds", stage_help, "stage=\"buckets\"", histogram::seconds());
+histogram stage_select("iqdb_stage_duration_seconds", stage_help, "stage=\"select\"", histogram::seconds());
+histogram stage_merge("iqdb_stage_duration_seconds", stage_help, "stage=\"merge\"", histogram::seconds());
+histogram stage_json("iqdb_stage_duration_seconds", stage_help, "stage=\"json\"", histogram::seconds());
+
+histogram query_bucket_entries("iqdb_query_bucket_entries", "How many bucket entries are scanned by each query.", "", histogram::exponential(1000, 4, 10));
+
+histogram write_queue_wait("iqdb_write_queue_wait_seconds", "How long writes wait for the writer thread, in seconds.", "", histogram::seconds());
+histogram write_group_duration("iqdb_write_group_duration_seconds", "How long running and committing a group of writes takes, in seconds.", "", histogram::seconds());
+histogram write_group_size("iqdb_write_group_size", "How many writes are committed together in each group.", "", histogram::exponential(1, 2, 11));
+histogram thread_pool_wait("iqdb_thread_pool_wait_seconds", "How long tasks wait for a thread of the thread pool, in seconds.", "", histogram::seconds());
+histogram compaction_duration("iqdb_compaction_duration_seconds", "How long compacting the buckets takes, in seconds.", "", histogram::seconds());
+histogram ingest_wait("iqdb_ingest_wait_seconds", "How long async uploads wait for a signature worker, in seconds.", "", histogram::seconds());
+histogram ingest_job_duration("iqdb_ingest_job_duration_seconds", "How long async uploads take from being queued to being added, in seconds.", "", histogram::seconds());
+
+counter queries("iqdb_queries_total", "How many signatures have been queried.");
+counter images_added("iqdb_images_added_total", "How many images have been added.");
+counter images_removed("iqdb_images_removed_total", "How many images have been removed.");
+counter ingest_rejected("iqdb_ingest_rejected_total", "How many async uploads were rejected because the ingest queue was full.");
+counter query_cache_hits("iqdb_query_cache_hits_total", "How many queries were answered from the query cache.");
+counter query_cache_misses("iqdb_query_cache_misses_total", "How many queries were not in the query cache, or only had stale results in it.");
+
+gauge write_queue_depth("iqdb_write_queue_depth", "How many writes are waiting for the writer thread.");
+gauge thread_pool_queue_depth("iqdb_thread_pool_queue_depth", "How many tasks are waiting for a thread of the thread pool.");
+gauge ingest_queue_depth("iqdb_ingest_queue_depth", "How many async uploads are waiting for a signature worker.");
+gauge images("iqdb_images", "How many images are in the database.");
+
+}
+
+}
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <iqdb/metrics.h>
+#include <iqdb/query_cache.h>
+
+namespace iqdb {
+
+query_cache::query_cache(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {
+    entries_.reserve(capacity_);
+}
+
+uint64_t query_cache::keyOf(const HaarSignature& signature, size_t numres, std::optional<Score> min_score) {
+    uint32_t score_bits = 0;
+    if (min_score) {
+        std::memcpy(&score_bits, &*min_score, sizeof(score_bits));
+    }
+
+    // Mix the parameters into the digest, so the queries for the same image
+    // with different limits don't all land on the same key.
+    uint64_t params = (static_cast<uint64_t>(numres) << 33) ^ (static_cast<uint64_t>(min_score.has_value()) << 32) ^ score_bits;
+    params *= 0xff51afd7ed558ccdULL;
+    params ^= params >> 32;
+    return signature.digest() ^ params;
+}
+
+std::optional<query_cache::results> query_cache::find(const HaarSignature& signature, size_t numres, std::optional<Score> min_score, uint64_t epoch) {
+    std::unique_lock lock(mutex_);
+    auto it = slots_.find(keyOf(signature, numres, min_score));
+
+    if (it != slots_.end()) {
+        entry& e = entries_[it->second];
+
+        if (e.epoch == epoch && e.numres == numres && e.min_score == min_score && e.signature == signature) {
+            e.used = true;
+            metrics::query_cache_hits.add();
+            return e.value;
+        }
+    }
+
+    metrics::query_cache_misses.add();
+    return std::nullopt;
+}
+
+void query_cache::insert(const HaarSignature& signature, size_t numres, std::optional<Score> min_score, uint64_t epoch, results value) {
+    const uint64_t key = keyOf(signature, numres, min_score);
+    std::unique_lock lock(mutex_);
+
+    // A query with the same key replaces the entry in place, whether it's the
+    // same query with newer results or a different one.
+    auto it = slots_.find(key);
+    const size_t slot = it != slots_.end() ? it->second : victim(epoch);
+
+    if (slot == entries_.size()) {
+        entries_.push_back({ key, signature, numres, min_score, epoch, std::move(value), false });
+    } else {
+        entry& e = entries_[slot];
+        if (e.key != key) {
+            slots_.erase(e.key);
+        }
+
+        e = { key, signature, numres, min_score, epoch, std::move(value), false };
+    }
+
+    slots_[key] = slot;
+}
+
+size_t query_cache::victim(uint64_t epoch) {
+    if (entries_.size() < capacity_) {
+        return entries_.size();
+    }
+
+    while (true) {
+        entry& e = entries_[hand_];
+        const size_t slot = hand_;
+        hand_ = (hand_ + 1) % capacity_;
+
+        if (!e.used || e.epoch != epoch) {
+            return slot;
+        }
+
+        e.used = false;
+    }
+}
+
+}
@@ -19,8 +19,22 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 \**************************************************************************/
 
+#include <climits>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
 #include <gd.h>
 #include <memory>
+#include <string>
+
+// jpeglib.h needs <cstdio> to be included first.
+extern "C" {
+#include <jpeglib.h>
+}
+
+#ifdef IQDB_HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
 
 #include <iqdb/debug.h>
 #include <iqdb/imgdb.h>
@@ -28,41 +42,294 @@
 
 namespace iqdb {
 
-enum image_types { IMG_UNKNOWN, IMG_JPEG };
+// The magic bytes at the start of each supported format.
+static bool has_magic(const unsigned char *data, size_t len, size_t offset, const char *magic) {
+    const size_t n = std::strlen(magic);
+    return len >= offset + n && std::memcmp(data + offset, magic, n) == 0;
+}
+
+static bool is_jpeg(const unsigned char *data, size_t len) {
+    return len >= 2 && data[0] == 0xff && data[1] == 0xd8;
+}
+
+static bool is_png(const unsigned char *data, size_t len) {
+    return has_magic(data, len, 0, "\x89PNG\r\n\x1a\n");
+}
+
+static bool is_gif(const unsigned char *data, size_t len) {
+    return has_magic(data, len, 0, "GIF87a") || has_magic(data, len, 0, "GIF89a");
+}
+
+static bool is_webp(const unsigned char *data, size_t len) {
+    return has_magic(data, len, 0, "RIFF") && has_magic(data, len, 8, "WEBP");
+}
+
+#ifdef IQDB_GD_HAVE_AVIF
+// An AVIF file starts with an `ftyp` box listing `avif` (or `avis`, for an
+// image sequence) as its major brand or one of its compatible brands.
+// https://aomediacodec.github.io/av1-avif/#brands-overview
+static bool is_avif(const unsigned char *data, size_t len) {
+    if (!has_magic(data, len, 4, "ftyp")) {
+        return false;
+    }
 
-image_types get_image_info(const unsigned char *data, size_t length) {
-    if (length >= 2 && data[0] == 0xff && data[1] == 0xd8) {
-        return IMG_JPEG;
-    } else {
-        return IMG_UNKNOWN;
+    const size_t box_size = std::min<size_t>(len, (size_t(data[0]) << 24) | (size_t(data[1]) << 16) | (size_t(data[2]) << 8) | data[3]);
+    for (size_t brand = 8; brand + 4 <= box_size; brand += 4) {
+        // skip the minor version, which follows the major brand
+        if (brand != 12 && (has_magic(data, len, brand, "avif") || has_magic(data, len, brand, "avis"))) {
+            return true;
+        }
     }
+
+    return false;
 }
+#endif
 
-RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y) {
-    auto type = get_image_info(data, len);
+// The largest power of two, up to 8, that an image can be scaled down by and
+// still be at least `min_x` by `min_y`.
+static unsigned int scale_denominator(unsigned int width, unsigned int height, unsigned int min_x, unsigned int min_y) {
+    unsigned int denom = 1;
+    while (denom < 8 && width >= 2 * denom * min_x && height >= 2 * denom * min_y) {
+        denom *= 2;
+    }
+
+    return denom;
+}
+
+// libjpeg reports fatal errors by calling `error_exit`, which must not return.
+// https://github.com/libjpeg-turbo/libjpeg-turbo/blob/main/libjpeg.txt (see "Error handling")
+struct jpeg_error {
+    jpeg_error_mgr mgr;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    jpeg_error* error = reinterpret_cast<jpeg_error*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, error->message);
+    std::longjmp(error->jump, 1);
+}
 
-    if (type != IMG_JPEG) {
-        throw image_error("unsupported image format (only JPG is supported)");
+// Ignore warnings, e.g. for truncated files, which decode fine.
+static void jpeg_output_message(j_common_ptr cinfo) {
+}
+
+// Decode a JPEG, scaled down by libjpeg while decoding by the largest power of
+// two (up to 1/8) that keeps the image at least `min_x` by `min_y`. Scaling in
+// the DCT domain skips most of the work of decoding a large image, and the full
+// size image is never allocated.
+//
+// Returns nullptr if the image can't be decoded, with the reason in `message`.
+// `message` is empty if the image just uses a color space that isn't supported
+// here (CMYK), and should be decoded by libgd instead.
+//
+// This function can't create any C++ objects: `longjmp` skips their destructors.
+static gdImagePtr decode_jpeg_scaled(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, char *message) {
+    jpeg_decompress_struct cinfo;
+    jpeg_error error;
+    gdImagePtr volatile img = nullptr;
+
+    message[0] = '\0';
+    cinfo.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = jpeg_error_exit;
+    error.mgr.output_message = jpeg_output_message;
+
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        if (img) {
+            gdImageDestroy(img);
+        }
+
+        std::snprintf(message, JMSG_LENGTH_MAX, "%s", error.message);
+        return nullptr;
     }
 
-    RawImage thu(gdImageCreateTrueColor(thu_x, thu_y), &gdImageDestroy);
-    if (!thu) {
-        throw image_error("failed to run gdImageCreateTrueColor: out of memory");
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), static_cast<unsigned long>(len));
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&cinfo);
+        return nullptr;
+    }
+
+    // The same output libgd asks for, so the pixels match those libgd would decode.
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale_denominator(cinfo.image_width, cinfo.image_height, min_x, min_y);
+
+    jpeg_start_decompress(&cinfo);
+
+    img = gdImageCreateTrueColor(static_cast<int>(cinfo.output_width), static_cast<int>(cinfo.output_height));
+    if (!img) {
+        jpeg_destroy_decompress(&cinfo);
+        std::snprintf(message, JMSG_LENGTH_MAX, "%s", "failed to run gdImageCreateTrueColor: out of memory");
+        return nullptr;
+    }
+
+    // The row is freed by jpeg_destroy_decompress.
+    JSAMPARRAY row = (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, cinfo.output_width * 3, 1);
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        int *out = img->tpixels[cinfo.output_scanline];
+        jpeg_read_scanlines(&cinfo, row, 1);
+
+        const JSAMPLE *in = row[0];
+        for (unsigned int x = 0; x < cinfo.output_width; x++, in += 3) {
+            out[x] = gdTrueColor(in[0], in[1], in[2]);
+        }
+    }
+
+    DEBUG("decoded {}x{} JPEG at 1/{} scale to {}x{}\n", cinfo.image_width, cinfo.image_height, cinfo.scale_denom, cinfo.output_width, cinfo.output_height);
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return img;
+}
+
+// Decode an image with libgd, at its full size.
+template <gdImagePtr (*create)(int, void *)>
+static RawImage decode_gd(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y) {
+    if (len > INT_MAX) {
+        throw image_error("image is too large");
+    }
+
+    RawImage img(create(static_cast<int>(len), const_cast<unsigned char *>(data)), &gdImageDestroy);
+    if (!img) {
+        throw image_error("libgd could not read the image");
+    }
+
+    return img;
+}
+
+static RawImage decode_jpeg(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y) {
+    char message[JMSG_LENGTH_MAX];
+    RawImage img(decode_jpeg_scaled(data, len, min_x, min_y, message), &gdImageDestroy);
+
+    if (!img && message[0] != '\0') {
+        throw image_error(message);
+    } else if (!img) {
+        return decode_gd<gdImageCreateFromJpegPtr>(data, len, min_x, min_y);
+    }
+
+    return img;
+}
+
+#ifdef IQDB_HAVE_LIBWEBP
+// Decode a WebP, scaled down by libwebp while decoding by the same power of
+// two a JPEG would be. The full size image is never allocated.
+// https://developers.google.com/speed/webp/docs/api#advanced_decoding_api
+static RawImage decode_webp(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y) {
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config) || WebPGetFeatures(data, len, &config.input) != VP8_STATUS_OK) {
+        throw image_error("could not read image");
+    } else if (config.input.has_animation) {
+        throw image_error("animated WebP images are not supported");
+    }
+
+    const unsigned int width = static_cast<unsigned int>(config.input.width);
+    const unsigned int height = static_cast<unsigned int>(config.input.height);
+    const unsigned int denom = scale_denominator(width, height, min_x, min_y);
+
+    config.output.colorspace = MODE_RGB;
+    if (denom > 1) {
+        config.options.use_scaling = 1;
+        config.options.scaled_width = static_cast<int>((width + denom - 1) / denom);
+        config.options.scaled_height = static_cast<int>((height + denom - 1) / denom);
     }
 
-    RawImage img(gdImageCreateFromJpegPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+    const VP8StatusCode status = WebPDecode(data, len, &config);
+    std::unique_ptr<WebPDecBuffer, decltype(&WebPFreeDecBuffer)> output(&config.output, &WebPFreeDecBuffer);
+    if (status != VP8_STATUS_OK) {
+        throw image_error(fmt::format("libwebp error {}", static_cast<int>(status)));
+    }
+
+    RawImage img(gdImageCreateTrueColor(output->width, output->height), &gdImageDestroy);
     if (!img) {
-        throw image_error("failed to run gdImageCreateFromJpegPtr: could not read image");
+        throw image_error("failed to run gdImageCreateTrueColor: out of memory");
+    }
+
+    for (int y = 0; y < output->height; y++) {
+        const uint8_t *in = output->u.RGBA.rgba + static_cast<size_t>(y) * static_cast<size_t>(output->u.RGBA.stride);
+        int *out = img->tpixels[y];
+
+        for (int x = 0; x < output->width; x++, in += 3) {
+            out[x] = gdTrueColor(in[0], in[1], in[2]);
+        }
+    }
+
+    DEBUG("decoded {}x{} WebP at 1/{} scale to {}x{}\n", width, height, denom, output->width, output->height);
+    return img;
+}
+#endif
+
+// A decoder for one image format. `decode` may return a smaller image than the
+// original, when the format can be decoded faster at a reduced size, but never
+// smaller than `min_x` by `min_y`. It throws an image_error saying why if it fails.
+struct image_decoder {
+    const char *name;
+    bool (*detect)(const unsigned char *data, size_t len);
+    RawImage (*decode)(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y);
+};
+
+// The supported formats, detected by their magic bytes. To support another
+// format, add a decoder for it here.
+static const image_decoder decoders[] = {
+    { "JPEG", is_jpeg, decode_jpeg },
+    { "PNG",  is_png,  decode_gd<gdImageCreateFromPngPtr> },
+
+    // libgd only decodes the first frame of an animated GIF.
+    { "GIF",  is_gif,  decode_gd<gdImageCreateFromGifPtr> },
+
+#ifdef IQDB_HAVE_LIBWEBP
+    { "WebP", is_webp, decode_webp },
+#else
+    { "WebP", is_webp, decode_gd<gdImageCreateFromWebpPtr> },
+#endif
+
+#ifdef IQDB_GD_HAVE_AVIF
+    { "AVIF", is_avif, decode_gd<gdImageCreateFromAvifPtr> },
+#endif
+};
+
+RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y) {
+    const image_decoder *decoder = nullptr;
+    for (const image_decoder &d : decoders) {
+        if (d.detect(data, len)) {
+            decoder = &d;
+            break;
+        }
+    }
+
+    if (!decoder) {
+        std::string names;
+        for (const image_decoder &d : decoders) {
+            names += names.empty() ? d.name : std::string(", ") + d.name;
+        }
+
+        throw image_error("unsupported image format (supported formats are " + names + ")");
+    }
+
+    RawImage img(nullptr, &gdImageDestroy);
+    try {
+        img = decoder->decode(data, len, thu_x, thu_y);
+    } catch (const image_error& e) {
+        throw image_error(fmt::format("failed to decode {}: {}", decoder->name, e.what()));
     }
 
     if ((unsigned int)img->sx == thu_x && (unsigned int)img->sy == thu_y && gdImageTrueColor(img)) {
         return img;
     }
 
+    RawImage thu(gdImageCreateTrueColor(thu_x, thu_y), &gdImageDestroy);
+    if (!thu) {
+        throw image_error("failed to run gdImageCreateTrueColor: out of memory");
+    }
+
     auto now = std::chrono::system_clock::now();
     gdImageCopyResampled(thu.get(), img.get(), 0, 0, 0, 0, thu_x, thu_y, img->sx, img->sy);
     auto done = std::chrono::system_clock::now();
-    DEBUG("resized {}x{} to {}x{} in {}\n", img->sx, img->sy, thu_x, thu_y,
+    DEBUG("resized {} {}x{} to {}x{} in {}\n", decoder->name, img->sx, img->sy, thu_x, thu_y,
         std::chrono::duration_cast<std::chrono::milliseconds>(done - now));
 
     return thu;
@@ -18,19 +18,32 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 \**************************************************************************/
 
+#include <algorithm>
+#include <condition_variable>
 #include <csignal>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <numeric>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+#include <iqdb/bulk.h>
 #include <iqdb/debug.h>
 #include <iqdb/haar_signature.h>
 #include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
+#include <iqdb/ingest_queue.h>
+#include <iqdb/metrics.h>
+#include <iqdb/server.h>
+#include <iqdb/thread_pool.h>
 #include <iqdb/types.h>
+#include <iqdb/write_queue.h>
 
 #include <httplib.h>
 #include <nlohmann/json.hpp>
@@ -52,9 +65,7 @@ static void signal_handler(int signal, siginfo_t *info, void *ucontext) {
         exit(1);
     }
 
-    if (server.is_running()) {
-        server.stop();
-    }
+    stop_http_server();
 }
 
 void install_signal_handlers() {
@@ -69,21 +80,271 @@ void install_signal_handlers() {
     sigaction(SIGSEGV, &action, NULL);
 }
 
-void http_server(const std::string host, const int port, const std::string database_filename) {
+// The content of the first uploaded file named `name`. Unlike
+// `get_file_value`, this doesn't copy the upload.
+static std::string_view file_content(const httplib::Request& request, const std::string& name) {
+    auto it = request.files.find(name);
+    return it == request.files.end() ? std::string_view() : std::string_view(it->second.content);
+}
+
+// The `min_score` param of a query, if given.
+static std::optional<Score> min_score_param(const httplib::Request& request) {
+    if (!request.has_param("min_score")) {
+        return std::nullopt;
+    }
+
+    return std::stof(request.get_param_value("min_score"));
+}
+
+// The `limit` param of a query: how many results to return, 10 by default.
+static size_t limit_param(const httplib::Request& request) {
+    if (!request.has_param("limit")) {
+        return 10;
+    }
+
+    const std::string& value = request.get_param_value("limit");
+    long long limit = -1;
+    size_t end = 0;
+    try {
+        limit = std::stoll(value, &end);
+    } catch (const std::logic_error&) {
+    }
+
+    if (limit < 0 || end != value.size()) {
+        throw param_error("`limit` must be a number of results, not " + value);
+    }
+
+    return static_cast<size_t>(limit);
+}
+
+// Whether a Content-Type or Accept header asks for MessagePack.
+static bool is_msgpack(const std::string& type) {
+    return type.find("application/msgpack") != std::string::npos || type.find("application/x-msgpack") != std::string::npos;
+}
+
+// Whether the client wants a MessagePack response, by sending `Accept: application/msgpack`.
+static bool wants_msgpack(const httplib::Request& request) {
+    return is_msgpack(request.get_header_value("Accept"));
+}
+
+// The MessagePack body of a request, if it was sent with `Content-Type: application/msgpack`.
+static std::optional<json> msgpack_body(const httplib::Request& request) {
+    if (!is_msgpack(request.get_header_value("Content-Type"))) {
+        return std::nullopt;
+    }
+
+    return json::from_msgpack(request.body);
+}
+
+// A signature in a MessagePack body, as the raw bytes of `HaarSignature::to_bytes()`.
+static HaarSignature signature_from_msgpack(const json& value) {
+    const json::binary_t& bytes = value.get_binary();
+    return HaarSignature::from_bytes(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+}
+
+// The signature to query for: a MessagePack body's, the `hash` param's, or the uploaded file's.
+static HaarSignature query_signature(const httplib::Request& request) {
+    if (const std::optional<json> body = msgpack_body(request)) {
+        return signature_from_msgpack(body->at("signature"));
+    } else if (request.has_param("hash")) {
+        return HaarSignature::from_hash(request.get_param_value("hash"));
+    } else if (request.has_file("file")) {
+        return HaarSignature::from_file_content(file_content(request, "file"));
+    }
+
+    throw param_error("`POST /query` requires a `file` or `hash` param");
+}
+
+// The signatures of a batch query, in the order their results are returned:
+// the body's, then the `hash` params', then the uploaded files'.
+static std::vector<HaarSignature> batch_signatures(const httplib::Request& request) {
+    std::vector<HaarSignature> signatures;
+
+    if (request.get_header_value("Content-Type").rfind("application/json", 0) == 0) {
+        for (const json& hash : json::parse(request.body).at("hashes")) {
+            signatures.push_back(HaarSignature::from_hash(hash.get<std::string>()));
+        }
+    } else if (const std::optional<json> body = msgpack_body(request)) {
+        for (const json& signature : body->at("signatures")) {
+            signatures.push_back(signature_from_msgpack(signature));
+        }
+    }
+
+    for (size_t i = 0; i < request.get_param_value_count("hash"); i++) {
+        signatures.push_back(HaarSignature::from_hash(request.get_param_value("hash", i)));
+    }
+
+    const auto files = request.files.equal_range("file");
+    for (auto it = files.first; it != files.second; ++it) {
+        signatures.push_back(HaarSignature::from_file_content(it->second.content));
+    }
+
+    if (signatures.empty()) {
+        throw param_error("`POST /query/batch` requires at least one `file` or `hash` param");
+    }
+
+    return signatures;
+}
+
+// Send `data` as the response: as MessagePack if the client asked for it, or
+// else as JSON. The JSON is compact, unless the request has ?pretty=true.
+static void send_response(const httplib::Request& request, httplib::Response& response, const json& data) {
+    if (wants_msgpack(request)) {
+        const std::vector<uint8_t> bytes = json::to_msgpack(data);
+        response.set_content(std::string(bytes.begin(), bytes.end()), "application/msgpack");
+    } else {
+        const int indent = request.get_param_value("pretty") == "true" ? 4 : -1;
+        response.set_content(data.dump(indent), "application/json");
+    }
+}
+
+// Send the error of a bulk add that failed part way through. The batches
+// added before the error stay added, so the response says how many there were.
+static void send_bulk_error(const httplib::Request& request, httplib::Response& response, const std::exception& e, size_t committed) {
+    json data = {
+        { "exception", demangle_name(typeid(e).name()) },
+        { "message", e.what() },
+        { "images", committed }
+    };
+
+    send_response(request, response, data);
+    response.status = 500;
+}
+
+// Build the response for the matches of a query. MessagePack responses carry
+// the raw bytes of each signature instead of its hash.
+static json matches_to_json(const sim_vector& matches, bool msgpack) {
+    json data = json::array();
+
+    for (const sim_value& match : matches) {
+        json item = {
+            { "post_id", match.id },
+            { "md5", match.md5 },
+            { "score", match.score }
+        };
+
+        if (msgpack) {
+            const std::string bytes = match.haar.to_bytes();
+            item["signature"] = json::binary(std::vector<uint8_t>(bytes.begin(), bytes.end()));
+        } else {
+            item["hash"] = match.haar.to_string();
+        }
+
+        data += std::move(item);
+    }
+
+    return data;
+}
+
+// The name of a job state in the responses of `GET /jobs/:id`.
+static const char* job_state_name(ingest_queue::job_state state) {
+    switch (state) {
+        case ingest_queue::job_state::queued: return "queued";
+        case ingest_queue::job_state::running: return "running";
+        case ingest_queue::job_state::done: return "done";
+        case ingest_queue::job_state::failed: return "failed";
+    }
+
+    return "unknown";
+}
+
+// Set up the logging, error responses and connection handling of `server`.
+static void configure_server(const http_options& options) {
+    server.set_logger([](const auto &req, const auto &res) {
+        INFO("{} \"{} {} {}\" {} {}\n", req.remote_addr, req.method, req.path, req.version, res.status, res.body.size());
+    });
+
+    server.set_exception_handler([](const auto &req, auto &res, std::exception_ptr ep) {
+
+        json data;
+        try {
+            std::rethrow_exception(ep);
+        } catch (std::exception& e) {
+            const auto name = demangle_name(typeid(e).name());
+            const auto message = e.what();
+            data = {
+                {"exception", name},
+                {"message", message},
+                {"backtrace", last_exception_backtrace}
+            };
+
+            DEBUG("exception: {} ({})\n{}\n", name, message, last_exception_backtrace);
+        } catch (...) {
+            data = {
+                {"message", "uncaught rethrow"}
+            };
+        }
+
+        send_response(req, res, data);
+        res.status = 500;
+    });
+
+    if (options.threads > 0) {
+        server.new_task_queue = [threads = options.threads] { return new httplib::ThreadPool(threads); };
+    }
+
+    server.set_keep_alive_max_count(options.keep_alive_max);
+    server.set_keep_alive_timeout(options.keep_alive_timeout);
+    if (options.max_payload > 0) {
+        server.set_payload_max_length(options.max_payload);
+    }
+}
+
+void http_server(const std::string host, const int port, const std::string database_filename, const http_options& options) {
     INFO("starting server...\n");
 
-    std::shared_mutex mutex_;
-    auto memory_db = std::make_unique<IQDB>(database_filename);
+    auto memory_db = std::make_unique<IQDB>(database_filename, options.shards, options.snapshot, options.query_cache);
     INFO("created DB from {}\n", database_filename.c_str());
 
+    // All writes go through a single writer thread, as IQDB needs. Queries
+    // don't wait on the writer, since they run against a snapshot of the index.
+    // The writes that queue up while the writer is busy are committed to the DB
+    // together, in one transaction. Each write runs in a savepoint of it, so a
+    // write that fails is undone without undoing the others.
+    write_queue writer(
+        [&](const std::function<void()>& jobs) { memory_db->transaction(jobs); },
+        [&](const std::function<void()>& job) { memory_db->transaction(job); });
+
+    // Images uploaded with ?async=true are added in the background, a batch
+    // at a time, by the same writer.
+    const size_t ingest_threads = options.ingest_threads > 0 ? options.ingest_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    auto ingest = std::make_unique<ingest_queue>(writer, [&](std::vector<image_info> images) { memory_db->addImages(std::move(images)); }, ingest_threads, options.ingest_queue);
+
+    // Periodically merge the uncompressed bucket entries of new images into
+    // the compressed posting lists, so they don't use too much memory, and
+    // drop the IDs of deleted images from them. The snapshot is saved after
+    // each compaction, which trims the change log it replays on startup.
+    std::mutex compactor_mutex;
+    std::condition_variable compactor_cv;
+    bool stopping = false;
+
+    std::thread compactor([&] {
+        std::unique_lock compactor_lock(compactor_mutex);
+
+        while (!compactor_cv.wait_for(compactor_lock, std::chrono::seconds(10), [&] { return stopping; })) {
+            writer.run([&] {
+                if (memory_db->needsCompaction()) {
+                    memory_db->compact();
+
+                    // a failed save keeps the old snapshot, which the change log still covers
+                    if (!options.snapshot.empty()) {
+                        try {
+                            memory_db->saveSnapshot(options.snapshot);
+                        } catch (const std::exception& e) {
+                            WARN("couldn't save snapshot: {}\n", e.what());
+                        }
+                    }
+                }
+            });
+        }
+    });
+
     install_signal_handlers();
 
     // GET /images/:id
     //    get the info about an image based on an image ID
     //
     server.Get("/images/:post_id", [&](const httplib::Request& request, httplib::Response& response) {
-        std::unique_lock lock(mutex_);
-
         const postId post_id = request.path_params.at("post_id");
         INFO("getting post_id {}\n", post_id.c_str());
         std::optional<Image> image = memory_db->getImage(post_id);
@@ -100,89 +361,211 @@ void http_server(const std::string host, const int port, const std::string datab
             };
         }
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
     });
 
     server.Get("/md5/:md5", [&](const httplib::Request& request, httplib::Response& response) {
-        std::unique_lock lock(mutex_);
-
         const std::string& md5 = request.path_params.at("md5");
         INFO("getting posts based on MD5 [md5={}]\n", md5);
-        std::vector<Image> images = memory_db->getByMD5(md5);
+        std::vector<image_info> images = memory_db->getByMD5(md5);
 
         json data;
 
-        for (const Image& image : images) {
+        for (const image_info& image : images) {
             data += {
                 { "post_id", image.post_id },
                 { "md5", image.md5 },
-                { "hash", image.haar().to_string() }
+                { "hash", image.haar.to_string() }
             };
         }
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
     });
 
     // POST /images/:post_id
     //      post a new image, creating a hash for it
     // must include a file named "file" as part of the POST request
+    // with ?async=true, the image is queued to be added in the background, and
+    // the response is a 202 with the ID of the job, to check with GET /jobs/:id.
+    // if the queue is full, the response is a 503
     //    
     server.Post("/images/:post_id/:md5", [&](const httplib::Request& request, httplib::Response& response) {
-        std::unique_lock lock(mutex_);
-
         if (!request.has_file("file")) {
             throw iqdb::param_error("`POST /images/:id` requires a `file` param");
         }
 
+        scoped_timer timer(metrics::request_add_image);
         auto now = std::chrono::system_clock::now();
         const postId post_id = request.path_params.at("post_id");
         const std::string& md5 = request.path_params.at("md5");
         INFO("posting image [post_id='{}'] [md5='{}']\n", post_id, md5);
-        const auto &file = request.get_file_value("file");
-        const HaarSignature signature = HaarSignature::from_file_content(file.content);
-        memory_db->addImage(post_id, md5, signature);
+
+        if (request.get_param_value("async") == "true") {
+            json data;
+
+            if (const std::optional<uint64_t> id = ingest->submit(post_id, md5, std::string(file_content(request, "file")))) {
+                data = {
+                    { "job_id", *id },
+                    { "post_id", post_id },
+                    { "md5", md5 }
+                };
+                response.status = 202;
+                response.set_header("Location", "/jobs/" + std::to_string(*id));
+            } else {
+                data = {
+                    { "error", "the ingest queue is full" }
+                };
+                response.status = 503;
+                response.set_header("Retry-After", "1");
+            }
+
+            send_response(request, response, data);
+            return;
+        }
+        // the response has the hash of the signature as it's stored, so it's
+        // the same as the one GET /images/:id returns
+        const HaarSignature signature = HaarSignature::from_file_content(file_content(request, "file")).quantized();
         auto done = std::chrono::system_clock::now();
         INFO("took {} to create hash\n", std::chrono::duration_cast<std::chrono::milliseconds>(done - now));
 
+        writer.run([&] {
+            memory_db->addImage(post_id, md5, signature);
+        });
+
         json data = {
             { "post_id", post_id },
             { "md5", md5 },
             { "hash", signature.to_string() }
         };
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
+    });
+
+    // POST /images/bulk
+    //      add many images with precomputed signatures, without decoding them
+    // the body is a stream of signatures, as NDJSON, or in the binary format if
+    // the Content-Type is application/octet-stream (see bulk.h)
+    //
+    server.Post("/images/bulk", [&](const httplib::Request& request, httplib::Response& response, const httplib::ContentReader& content_reader) {
+        scoped_timer timer(metrics::request_add_images_bulk);
+        const bulk_format format = request.get_header_value("Content-Type") == "application/octet-stream" ? bulk_format::binary : bulk_format::ndjson;
+        INFO("bulk adding images [format={}]\n", format == bulk_format::ndjson ? "ndjson" : "binary");
+
+        // the images are added in batches while the body is still being received
+        std::vector<image_info> batch;
+        size_t committed = 0;
+        auto flush = [&] {
+            writer.run([&] {
+                memory_db->addImages(std::move(batch));
+
+                // don't wait for the compactor, as a bulk add grows the buckets quickly
+                if (memory_db->needsCompaction()) {
+                    memory_db->compact();
+                }
+            });
+            committed += batch.size();
+            batch.clear();
+        };
+
+        bulk_parser parser(format, [&](image_info&& image) {
+            batch.push_back(std::move(image));
+            if (batch.size() == bulk_batch_size) {
+                flush();
+            }
+        });
+
+        try {
+            content_reader([&](const char* data, size_t length) {
+                parser.feed(data, length);
+                return true;
+            });
+
+            parser.finish();
+            flush();
+        } catch (const std::exception& e) {
+            send_bulk_error(request, response, e, committed);
+            return;
+        }
+
+        json data = {
+            { "images", committed }
+        };
+
+        send_response(request, response, data);
+    });
+
+    // GET /jobs/:id
+    //      get the status of an image added with ?async=true: `queued`,
+    //      `running`, `done` or `failed`. done jobs include the hash of the
+    //      image, and failed ones the error. only the last 10000 finished jobs
+    //      are kept
+    server.Get("/jobs/:id", [&](const httplib::Request& request, httplib::Response& response) {
+        const uint64_t id = std::stoull(request.path_params.at("id"));
+        json data;
+
+        if (const std::optional<ingest_queue::job_status> job = ingest->status(id)) {
+            data = {
+                { "job_id", id },
+                { "status", job_state_name(job->state) },
+                { "post_id", job->post_id },
+                { "md5", job->md5 }
+            };
+
+            if (job->state == ingest_queue::job_state::done) {
+                data["hash"] = job->signature.to_string();
+            } else if (job->state == ingest_queue::job_state::failed) {
+                data["error"] = job->error;
+            }
+        } else {
+            data = {
+                { "error", "no such job" }
+            };
+            response.status = 404;
+        }
+
+        send_response(request, response, data);
     });
 
     // DELETE /images/:id
     //      delete an image from the DB
     server.Delete("/images", [&](const httplib::Request& request, httplib::Response& response) {
-        std::unique_lock lock(mutex_);
-
+        scoped_timer timer(metrics::request_remove_image);
         json data;
         if (request.has_param("post_id")) {
             const postId& post_id = request.get_param_value("post_id");
             INFO("removing post from DB [post_id={}]\n", post_id);
 
-            std::optional<Image> image = memory_db->getImage(post_id);
-            if (image == std::nullopt) {
-                data = { { "message", "not found" } };
-                response.status = 404;
-            } else {
-                memory_db->removeImage(post_id);
+            writer.run([&] {
+                std::optional<Image> image = memory_db->getImage(post_id);
+                if (image == std::nullopt) {
+                    data = { { "message", "not found" } };
+                    response.status = 404;
+                } else {
+                    memory_db->removeImage(post_id);
 
-                data = {
-                    { "post_id", post_id },
-                    { "md5", image->md5 }
-                };
-            }
+                    data = {
+                        { "post_id", post_id },
+                        { "md5", image->md5 }
+                    };
+                }
+            });
         } else if (request.has_param("md5")) {
             const std::string& md5 = request.get_param_value("md5");
             INFO("removing post by md5 from DB [md5={}]\n", md5);
 
-            std::vector<Image> images = memory_db->getByMD5(md5);
-            for (const Image& image : images) {
-                memory_db->removeImage(image.post_id);
-            }
+            json post_ids = json::array();
+            writer.run([&] {
+                std::vector<image_info> images = memory_db->getByMD5(md5);
+                for (const image_info& image : images) {
+                    memory_db->removeImage(image.post_id);
+                    post_ids.push_back(image.post_id);
+                }
+            });
+
+            data = {
+                { "md5", md5 },
+                { "post_ids", post_ids }
+            };
         } else {
             data = {
                 {"error", "either post_id or md5 must be given in the query parameters"}
@@ -190,109 +573,642 @@ void http_server(const std::string host, const int port, const std::string datab
             response.status = 400;
         }
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
     });
 
     // POST /query
-    //    include either :hash or :file
+    //    include either :hash or :file, or a MessagePack body of the form
+    //    `{ "signature": <bin> }` holding the raw bytes of a signature
     //    can include ?limit to limit how many results are returned
+    //    can include ?min_score to only return matches scoring at least that much
+    //    can include ?exact=true to first look for exact duplicates, by :md5
+    //    if given or else by signature, and only do a full query if there are none
+    //    can include ?buckets=true, as the coordinator does, to get an object
+    //    with the `matches`, the non-empty `buckets` they were scaled by, and
+    //    whether they're `exact` duplicates
     server.Post("/query", [&](const httplib::Request& request, httplib::Response& response) {
-        std::shared_lock lock(mutex_);
-
-        int limit = 10;
+        scoped_timer timer(metrics::request_query);
+        const size_t limit = limit_param(request);
+        const std::optional<Score> min_score = min_score_param(request);
+        const bool exact = request.get_param_value("exact") == "true";
         sim_vector matches;
-        json data = json::array();
+        bucket_mask buckets;
+        bool exact_matches = true;
 
-        if (request.has_param("limit")) {
-            limit = stoi(request.get_param_value("limit"));
+        // An image with the same md5 is the same file, so the upload doesn't
+        // need to be decoded.
+        if (exact && request.has_param("md5")) {
+            for (const image_info& image : memory_db->getByMD5(request.get_param_value("md5"))) {
+                if (matches.size() < limit) {
+                    matches.emplace_back(image.post_id, 100, image.md5, image.haar);
+                }
+            }
         }
 
-        if (request.has_param("hash")) {
-            const std::string& hash = request.get_param_value("hash");
-            HaarSignature haar = HaarSignature::from_hash(hash);
-            matches = memory_db->queryFromSignature(haar, limit);
-        } else if (request.has_file("file")) {
-            const auto &file = request.get_file_value("file");
-            matches = memory_db->queryFromBlob(file.content, limit);
-        } else {
-            throw param_error("`POST /query` requires a `file` or `hash` param");
-        }
+        if (matches.empty()) {
+            const HaarSignature haar = query_signature(request);
 
-        for (const sim_value& match : matches) {
-            std::optional<Image> image = memory_db->getImage(match.id);
-            if (image == std::nullopt) {
-                WARN("failed to find image {} from memory_db\n", match.id);
-                continue;
+            if (exact) {
+                matches = memory_db->queryExact(haar, limit);
             }
 
-            const HaarSignature& haar = image->haar();
+            if (matches.empty()) {
+                exact_matches = false;
+                matches = memory_db->queryFromSignature(haar, limit, min_score, &buckets);
+            }
+        }
 
-            //DEBUG("adding {} {} {}\n", match.id, image->md5, match.score);
+        scoped_timer json_timer(metrics::stage_json);
+        json data = matches_to_json(matches, wants_msgpack(request));
 
-            data += {
-                { "post_id", match.id },
-                { "md5", image->md5 },
-                { "score", match.score },
-                { "hash", haar.to_string() }
+        if (request.get_param_value("buckets") == "true") {
+            data = {
+                { "matches", std::move(data) },
+                { "buckets", buckets.to_string() },
+                { "exact", exact_matches }
             };
         }
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
+    });
+
+    // POST /query/batch
+    //    include any number of :hash params and :file files, or a JSON body
+    //    of the form `{ "hashes": [...] }`, or a MessagePack body of the form
+    //    `{ "signatures": [<bin>...] }`. returns one array of matches per
+    //    hash, in order, followed by one per file
+    //    can include ?limit to limit how many results are returned per query
+    //    can include ?min_score to only return matches scoring at least that much
+    //    can include ?buckets=true to get an object with the `matches` and the
+    //    non-empty `buckets` of each query, as for `POST /query`
+    server.Post("/query/batch", [&](const httplib::Request& request, httplib::Response& response) {
+        scoped_timer timer(metrics::request_query_batch);
+        const size_t limit = limit_param(request);
+
+        const std::vector<HaarSignature> signatures = batch_signatures(request);
+        std::vector<bucket_mask> buckets;
+        const std::vector<sim_vector> results = memory_db->queryBatch(signatures, limit, min_score_param(request), &buckets);
+        const bool with_buckets = request.get_param_value("buckets") == "true";
+
+        scoped_timer json_timer(metrics::stage_json);
+        json data = json::array();
+        for (size_t i = 0; i < results.size(); i++) {
+            json matches = matches_to_json(results[i], wants_msgpack(request));
+
+            if (with_buckets) {
+                data += {
+                    { "matches", std::move(matches) },
+                    { "buckets", buckets[i].to_string() }
+                };
+            } else {
+                data += std::move(matches);
+            }
+        }
+
+        send_response(request, response, data);
     });
 
     // GET /status
-    //    returns how many images are in the DB
+    //    returns how many images are in the DB, and how many queries were
+    //    answered from the query cache
     server.Get("/status", [&](const httplib::Request& request, httplib::Response& response) {
-        std::shared_lock lock(mutex_);
-
         const size_t count = memory_db->getImgCount();
         json data = {
             { "images", count },
+            { "query_cache", {
+                { "hits", metrics::query_cache_hits.value() },
+                { "misses", metrics::query_cache_misses.value() }
+            } },
             { "version", "honooru" }
         };
 
-        response.set_content(data.dump(4), "application/json");
+        send_response(request, response, data);
     });
 
-    server.set_logger([](const auto &req, const auto &res) {
-        INFO("{} \"{} {} {}\" {} {}\n", req.remote_addr, req.method, req.path, req.version, res.status, res.body.size());
+    // GET /metrics
+    //    returns the request, query stage and queue metrics in the Prometheus
+    //    text format
+    server.Get("/metrics", [&](const httplib::Request& request, httplib::Response& response) {
+        metrics::images.set(static_cast<int64_t>(memory_db->getImgCount()));
+        response.set_content(metrics_text(), "text/plain; version=0.0.4");
     });
 
-    server.set_exception_handler([](const auto &req, auto &res, std::exception_ptr ep) {
+    configure_server(options);
+
+    INFO("listening on {}:{}\n", host, port);
+    server.listen(host.c_str(), port);
+    INFO("stopping server...\n");
+
+    {
+        std::unique_lock compactor_lock(compactor_mutex);
+        stopping = true;
+    }
+
+    compactor_cv.notify_all();
+    compactor.join();
+
+    // finish adding the async uploads that were accepted
+    ingest.reset();
+
+    // save the latest changes, so they don't have to be replayed on the next start
+    if (!options.snapshot.empty()) {
+        writer.run([&] { memory_db->saveSnapshot(options.snapshot); });
+    }
+}
+
+// The shard of a coordinator that owns a post: the FNV-1a hash of its ID,
+// modulo the number of shards. Unlike std::hash, the hash is the same on every
+// machine, so all coordinators send a post to the same shard.
+static size_t owner_of(const postId& post_id, size_t n_shards) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char c : post_id) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return static_cast<size_t>(hash % n_shards);
+}
+
+// A shard of a coordinator: an `iqdb http` instance holding the images whose
+// post IDs hash to it. Each request takes an idle client, so the requests of
+// concurrent queries don't wait for each other, and keep-alive connections
+// are reused.
+class shard_backend {
+public:
+    explicit shard_backend(std::string url) : url_(std::move(url)) {}
+
+    // Send a request with `send(client)`, and return the status and JSON body
+    // of the response. Throws if the shard can't be reached.
+    template <typename F>
+    std::pair<int, json> request(F send) {
+        std::unique_ptr<httplib::Client> client;
+
+        {
+            std::unique_lock lock(mutex_);
+            if (!idle_.empty()) {
+                client = std::move(idle_.back());
+                idle_.pop_back();
+            }
+        }
+
+        if (!client) {
+            client = std::make_unique<httplib::Client>(url_);
+            client->set_keep_alive(true);
+            // long enough for a shard to add a batch of a bulk upload
+            client->set_read_timeout(300);
+        }
+
+        const httplib::Result result = send(*client);
+        if (!result) {
+            throw simple_error(fmt::format("couldn't reach shard {}: {}", url_, httplib::to_string(result.error())));
+        }
+
+        std::pair<int, json> response = { result->status, result->body.empty() ? json() : json::parse(result->body) };
+
+        std::unique_lock lock(mutex_);
+        idle_.push_back(std::move(client));
+        return response;
+    }
+
+    // As `request`, but also throws if the shard failed to handle the request.
+    template <typename F>
+    json checked(F send) {
+        auto [status, data] = request(send);
+        if (status >= 400) {
+            throw simple_error(fmt::format("shard {} returned {}: {}", url_, status, data.dump()));
+        }
+
+        return data;
+    }
+
+private:
+    const std::string url_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<httplib::Client>> idle_;
+};
+
+static shard_matches shard_matches_from_json(const json& data) {
+    shard_matches result;
+    result.buckets = bucket_mask(data.at("buckets").get<std::string>());
+    result.exact = data.value("exact", false);
+
+    for (const json& match : data.at("matches")) {
+        result.matches.emplace_back(
+            match.at("post_id").get<postId>(),
+            match.at("score").get<Score>(),
+            match.at("md5").get<std::string>(),
+            HaarSignature::from_hash(match.at("hash").get<std::string>()));
+    }
+
+    return result;
+}
+
+// Each shard scales its scores by the weight of the buckets that aren't empty
+// in it, which differs between shards, so the scores are rescaled by the
+// weight of the buckets that aren't empty in any shard.
+sim_vector merge_shard_matches(const HaarSignature& signature, std::vector<shard_matches>& shards, size_t limit, std::optional<Score> min_score) {
+    bucket_mask buckets;
+    for (const shard_matches& shard : shards) {
+        buckets |= shard.buckets;
+    }
+
+    const Score scale = IQDB::scaleOf(signature, buckets);
+    sim_vector matches;
+
+    for (shard_matches& shard : shards) {
+        // A shard without any of the buckets scores everything 0, as its
+        // images don't share a single coefficient with the query. There's no
+        // raw score left to rescale, so they stay at 0.
+        const Score shard_scale = IQDB::scaleOf(signature, shard.buckets);
+        const Score factor = shard_scale != 0 ? scale / shard_scale : 0;
+
+        for (sim_value& match : shard.matches) {
+            match.score *= factor;
+
+            // A shard's scale is never smaller than the global one, so it
+            // only returned too many matches, never too few.
+            if (!min_score || match.score >= *min_score) {
+                matches.push_back(std::move(match));
+            }
+        }
+    }
+
+    std::stable_sort(matches.begin(), matches.end(), [](const sim_value& a, const sim_value& b) { return b < a; });
+    matches.erase(matches.begin() + std::min(matches.size(), limit), matches.end());
+    return matches;
+}
+
+// start a coordinator: an HTTP server with the same API as `http_server`, that
+// spreads the images across several `iqdb http` shards by post ID, and sends
+// each query to all of them.
+void coordinator_server(const std::string host, const int port, const std::vector<std::string>& shard_urls, const http_options& options) {
+    INFO("starting coordinator for {} shards...\n", shard_urls.size());
+
+    std::vector<std::unique_ptr<shard_backend>> shards;
+    for (const std::string& url : shard_urls) {
+        shards.push_back(std::make_unique<shard_backend>(url));
+    }
+
+    const size_t n_shards = shards.size();
+    thread_pool pool(std::max<size_t>(std::thread::hardware_concurrency(), n_shards));
+
+    // send a request to every shard at once
+    auto scatter = [&](const std::function<void(size_t)>& func) {
+        pool.parallel_for(n_shards, func);
+    };
+
+    // pass the response of a shard on to the client
+    auto forward = [&](const httplib::Request& request, httplib::Response& response, std::pair<int, json> result) {
+        response.status = result.first;
+        send_response(request, response, result.second);
+    };
+
+    install_signal_handlers();
+
+    // GET /images/:post_id
+    //    asked of the shard owning the post
+    server.Get("/images/:post_id", [&](const httplib::Request& request, httplib::Response& response) {
+        const postId post_id = request.path_params.at("post_id");
+        const std::string path = "/images/" + post_id;
+
+        forward(request, response, shards[owner_of(post_id, n_shards)]->request([&](httplib::Client& client) { return client.Get(path); }));
+    });
+
+    // GET /md5/:md5
+    //    asked of every shard, as posts with the same md5 can be on any of them
+    server.Get("/md5/:md5", [&](const httplib::Request& request, httplib::Response& response) {
+        const std::string path = "/md5/" + request.path_params.at("md5");
+        std::vector<json> results(n_shards);
+
+        scatter([&](size_t s) {
+            results[s] = shards[s]->checked([&](httplib::Client& client) { return client.Get(path); });
+        });
 
         json data;
-        try {
-            std::rethrow_exception(ep);
-        } catch (std::exception& e) {
-            const auto name = demangle_name(typeid(e).name());
-            const auto message = e.what();
-            data = {
-                {"exception", name},
-                {"message", message},
-                {"backtrace", last_exception_backtrace}
+        for (const json& images : results) {
+            for (const json& image : images) {
+                data += image;
+            }
+        }
+
+        send_response(request, response, data);
+    });
+
+    // POST /images/:post_id/:md5
+    //    sent to the shard owning the post. the IDs of async jobs include the
+    //    shard, so `GET /jobs/:id` knows which one to ask
+    server.Post("/images/:post_id/:md5", [&](const httplib::Request& request, httplib::Response& response) {
+        if (!request.has_file("file")) {
+            throw iqdb::param_error("`POST /images/:id` requires a `file` param");
+        }
+
+        scoped_timer timer(metrics::request_add_image);
+        const postId post_id = request.path_params.at("post_id");
+        const size_t owner = owner_of(post_id, n_shards);
+        const std::string path = httplib::append_query_params("/images/" + post_id + "/" + request.path_params.at("md5"), request.params);
+        INFO("posting image to shard {} [post_id='{}']\n", owner, post_id);
+
+        httplib::MultipartFormDataItems items;
+        for (const auto& [name, file] : request.files) {
+            items.push_back({ name, file.content, file.filename, file.content_type });
+        }
+
+        std::pair<int, json> result = shards[owner]->request([&](httplib::Client& client) { return client.Post(path, items); });
+        if (result.first == 202) {
+            const uint64_t id = result.second.at("job_id").get<uint64_t>() * n_shards + owner;
+            result.second["job_id"] = id;
+            response.set_header("Location", "/jobs/" + std::to_string(id));
+        }
+
+        forward(request, response, std::move(result));
+    });
+
+    // POST /images/bulk
+    //    the images are split by the shard owning them, and sent on in batches
+    //    as NDJSON
+    server.Post("/images/bulk", [&](const httplib::Request& request, httplib::Response& response, const httplib::ContentReader& content_reader) {
+        scoped_timer timer(metrics::request_add_images_bulk);
+        const bulk_format format = request.get_header_value("Content-Type") == "application/octet-stream" ? bulk_format::binary : bulk_format::ndjson;
+
+        std::vector<std::string> batches(n_shards);
+        std::vector<size_t> counts(n_shards);
+        std::vector<size_t> committed(n_shards);
+        auto flush = [&](size_t s) {
+            shards[s]->checked([&](httplib::Client& client) { return client.Post("/images/bulk", batches[s], "application/x-ndjson"); });
+            committed[s] += counts[s];
+            batches[s].clear();
+            counts[s] = 0;
+        };
+        auto total_committed = [&] { return std::accumulate(committed.begin(), committed.end(), size_t(0)); };
+
+        bulk_parser parser(format, [&](image_info&& image) {
+            const size_t s = owner_of(image.post_id, n_shards);
+            json line = {
+                { "post_id", image.post_id },
+                { "md5", image.md5 },
+                { "hash", image.haar.to_string() }
             };
 
-            DEBUG("exception: {} ({})\n{}\n", name, message, last_exception_backtrace);
-        } catch (...) {
-            data = {
-                {"message", "uncaught rethrow"}
+            batches[s] += line.dump();
+            batches[s] += '\n';
+            if (++counts[s] == bulk_batch_size) {
+                flush(s);
+            }
+        });
+
+        try {
+            content_reader([&](const char* data, size_t length) {
+                parser.feed(data, length);
+                return true;
+            });
+
+            parser.finish();
+            scatter([&](size_t s) {
+                if (counts[s] > 0) {
+                    flush(s);
+                }
+            });
+        } catch (const std::exception& e) {
+            send_bulk_error(request, response, e, total_committed());
+            return;
+        }
+
+        json data = {
+            { "images", total_committed() }
+        };
+
+        send_response(request, response, data);
+    });
+
+    // GET /jobs/:id
+    //    asked of the shard that queued the job
+    server.Get("/jobs/:id", [&](const httplib::Request& request, httplib::Response& response) {
+        const uint64_t id = std::stoull(request.path_params.at("id"));
+        const std::string path = "/jobs/" + std::to_string(id / n_shards);
+
+        std::pair<int, json> result = shards[id % n_shards]->request([&](httplib::Client& client) { return client.Get(path); });
+        if (result.second.contains("job_id")) {
+            result.second["job_id"] = id;
+        }
+
+        forward(request, response, std::move(result));
+    });
+
+    // DELETE /images
+    //    ?post_id is sent to the shard owning the post, and ?md5 to every shard
+    server.Delete("/images", [&](const httplib::Request& request, httplib::Response& response) {
+        scoped_timer timer(metrics::request_remove_image);
+        const std::string path = httplib::append_query_params("/images", request.params);
+        auto send = [&](httplib::Client& client) { return client.Delete(path); };
+
+        if (request.has_param("post_id")) {
+            forward(request, response, shards[owner_of(request.get_param_value("post_id"), n_shards)]->request(send));
+        } else if (request.has_param("md5")) {
+            std::vector<json> results(n_shards);
+            scatter([&](size_t s) { results[s] = shards[s]->checked(send); });
+
+            json post_ids = json::array();
+            for (const json& result : results) {
+                for (const json& post_id : result.at("post_ids")) {
+                    post_ids.push_back(post_id);
+                }
+            }
+
+            send_response(request, response, { { "md5", request.get_param_value("md5") }, { "post_ids", post_ids } });
+        } else {
+            forward(request, response, shards[0]->request(send));
+        }
+    });
+
+    // POST /query
+    //    the signature is computed once here, and queried on every shard. with
+    //    ?exact=true and :md5, the shards are first asked for the images with
+    //    that md5, so the upload isn't decoded if there are any
+    server.Post("/query", [&](const httplib::Request& request, httplib::Response& response) {
+        scoped_timer timer(metrics::request_query);
+        const size_t limit = limit_param(request);
+        const std::optional<Score> min_score = min_score_param(request);
+        const bool exact = request.get_param_value("exact") == "true";
+        sim_vector matches;
+
+        if (exact && request.has_param("md5")) {
+            const std::string path = "/md5/" + request.get_param_value("md5");
+            std::vector<json> results(n_shards);
+
+            scatter([&](size_t s) {
+                results[s] = shards[s]->checked([&](httplib::Client& client) { return client.Get(path); });
+            });
+
+            for (const json& images : results) {
+                for (const json& image : images) {
+                    if (matches.size() < limit) {
+                        matches.emplace_back(image.at("post_id").get<postId>(), 100, image.at("md5").get<std::string>(), HaarSignature::from_hash(image.at("hash").get<std::string>()));
+                    }
+                }
+            }
+        }
+
+        if (matches.empty()) {
+            const HaarSignature haar = query_signature(request);
+            httplib::Params params = {
+                { "hash", haar.to_string() },
+                { "limit", std::to_string(limit) },
+                { "buckets", "true" }
             };
+
+            if (exact) {
+                params.emplace("exact", "true");
+            }
+
+            if (min_score) {
+                params.emplace("min_score", request.get_param_value("min_score"));
+            }
+
+            std::vector<shard_matches> results(n_shards);
+            scatter([&](size_t s) {
+                results[s] = shard_matches_from_json(shards[s]->checked([&](httplib::Client& client) { return client.Post("/query", params); }));
+            });
+
+            // like a single instance, only return the exact duplicates if any shard has some
+            if (std::any_of(results.begin(), results.end(), [](const shard_matches& shard) { return shard.exact && !shard.matches.empty(); })) {
+                for (shard_matches& shard : results) {
+                    for (sim_value& match : shard.matches) {
+                        if (shard.exact && matches.size() < limit) {
+                            matches.push_back(std::move(match));
+                        }
+                    }
+                }
+            } else {
+                scoped_timer merge_timer(metrics::stage_merge);
+                matches = merge_shard_matches(haar, results, limit, min_score);
+            }
         }
 
-        res.set_content(data.dump(4), "application/json");
-        res.status = 500;
+        scoped_timer json_timer(metrics::stage_json);
+        json data = matches_to_json(matches, wants_msgpack(request));
+        send_response(request, response, data);
+    });
+
+    // POST /query/batch
+    //    the whole batch is queried on every shard
+    server.Post("/query/batch", [&](const httplib::Request& request, httplib::Response& response) {
+        scoped_timer timer(metrics::request_query_batch);
+        const size_t limit = limit_param(request);
+        const std::optional<Score> min_score = min_score_param(request);
+
+        const std::vector<HaarSignature> signatures = batch_signatures(request);
+        json body = { { "hashes", json::array() } };
+        for (const HaarSignature& signature : signatures) {
+            body["hashes"] += signature.to_string();
+        }
+
+        httplib::Params params = {
+            { "limit", std::to_string(limit) },
+            { "buckets", "true" }
+        };
+
+        if (min_score) {
+            params.emplace("min_score", request.get_param_value("min_score"));
+        }
+
+        const std::string path = httplib::append_query_params("/query/batch", params);
+        const std::string content = body.dump();
+
+        // results[s][q] is the matches of query `q` on shard `s`.
+        std::vector<std::vector<shard_matches>> results(n_shards);
+        scatter([&](size_t s) {
+            for (const json& query : shards[s]->checked([&](httplib::Client& client) { return client.Post(path, content, "application/json"); })) {
+                results[s].push_back(shard_matches_from_json(query));
+            }
+        });
+
+        scoped_timer merge_timer(metrics::stage_merge);
+        json data = json::array();
+        for (size_t q = 0; q < signatures.size(); q++) {
+            std::vector<shard_matches> query(n_shards);
+            for (size_t s = 0; s < n_shards; s++) {
+                query[s] = std::move(results[s].at(q));
+            }
+
+            data += matches_to_json(merge_shard_matches(signatures[q], query, limit, min_score), wants_msgpack(request));
+        }
+
+        send_response(request, response, data);
     });
 
+    // GET /status
+    //    returns how many images are in all the shards
+    server.Get("/status", [&](const httplib::Request& request, httplib::Response& response) {
+        std::vector<uint64_t> counts(n_shards);
+        scatter([&](size_t s) {
+            counts[s] = shards[s]->checked([&](httplib::Client& client) { return client.Get("/status"); }).at("images").get<uint64_t>();
+        });
+
+        json data = {
+            { "images", std::accumulate(counts.begin(), counts.end(), uint64_t(0)) },
+            { "shards", n_shards },
+            { "version", "honooru" }
+        };
+
+        send_response(request, response, data);
+    });
+
+    // GET /metrics
+    //    returns the coordinator's own request metrics
+    server.Get("/metrics", [&](const httplib::Request& request, httplib::Response& response) {
+        response.set_content(metrics_text(), "text/plain; version=0.0.4");
+    });
+
+    configure_server(options);
+
     INFO("listening on {}:{}\n", host, port);
     server.listen(host.c_str(), port);
-    INFO("stopping server...\n");
+    INFO("stopping coordinator...\n");
+}
+
+void stop_http_server() {
+    if (server.is_running()) {
+        server.stop();
+    }
 }
 
 void help() {
     printf(
         "Usage: iqdb COMMAND [ARGS...]\n"
-        "  iqdb http [host] [port] [dbfile]  Run HTTP server on given host/port.\n"
-        "  iqdb help                         Show this help.\n");
+        "  iqdb http [host] [port] [dbfile] [OPTIONS...]  Run HTTP server on given host/port.\n"
+        "  iqdb coordinator [host] [port] [OPTIONS...]    Run HTTP server that spreads the images across\n"
+        "                                                 several `iqdb http` servers.\n"
+        "  iqdb import FILE [dbfile] [OPTIONS...]         Add the precomputed signatures in FILE (or - for stdin).\n"
+        "  iqdb help                                      Show this help.\n"
+        "\n"
+        "Options for `iqdb http`:\n"
+        "  --shards=N       Split the image index into N shards that are queried in parallel (default 1).\n"
+        "  --snapshot=FILE  Load the image index from a snapshot file instead of rebuilding it from the\n"
+        "                   database, and keep the snapshot up to date.\n"
+        "  --threads=N      Handle up to N requests at once (default: one per CPU, and at least 8).\n"
+        "  --keep-alive-max=N\n"
+        "                   Close a keep-alive connection after N requests (default 100).\n"
+        "  --keep-alive-timeout=SECONDS\n"
+        "                   Close a keep-alive connection after SECONDS idle (default 5).\n"
+        "  --max-payload=BYTES\n"
+        "                   Reject requests with bodies bigger than BYTES (default: no limit).\n"
+        "  --ingest-threads=N\n"
+        "                   Compute the signatures of async uploads on N threads (default: one per CPU).\n"
+        "  --ingest-queue=N Queue up to N async uploads before rejecting them (default 1024).\n"
+        "  --query-cache=N  Cache the results of up to N queries until the next write, or 0 for none\n"
+        "                   (default 1024).\n"
+        "\n"
+        "Options for `iqdb coordinator`:\n"
+        "  --shard-urls=URL,...\n"
+        "                   The `iqdb http` servers holding the images, e.g. http://10.0.0.1:5588. Each\n"
+        "                   post is stored on one of them, by a hash of its ID, so they must always be\n"
+        "                   given in the same order.\n"
+        "  --threads, --keep-alive-max, --keep-alive-timeout and --max-payload, as for `iqdb http`.\n"
+        "\n"
+        "Options for `iqdb import`:\n"
+        "  --format=FORMAT  The format of FILE: `ndjson` (the default) or `binary`.\n"
+        "  --shards=N       As for `iqdb http`.\n"
+        "  --snapshot=FILE  The snapshot file to update after importing.\n");
 
     exit(0);
 }
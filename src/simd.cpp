@@ -0,0 +1,176 @@
+/***************************************************************************\
+    simd.cpp - Vectorized kernels for the query scoring loops.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <cmath>
+
+#include <iqdb/simd.h>
+
+// The AVX2 and AVX-512 kernels are compiled with function-level target
+// attributes, so the rest of the program can still be built for generic x86-64.
+// https://gcc.gnu.org/onlinedocs/gcc/x86-Function-Attributes.html
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define IQDB_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace iqdb {
+
+static void lumin_distance_scalar(Score* scores, const Score* const avgl[3], const Score query[3], const Score weight[3], int n_colors, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        scores[i] = weight[0] * std::abs(avgl[0][i] - query[0]);
+    }
+
+    for (int c = 1; c < n_colors; c++) {
+        for (size_t i = 0; i < n; i++) {
+            scores[i] += weight[c] * std::abs(avgl[c][i] - query[c]);
+        }
+    }
+}
+
+static void subtract_weight_scalar(Score* scores, const imageId* ids, size_t n, Score weight) {
+    for (size_t i = 0; i < n; i++) {
+        scores[ids[i]] -= weight;
+    }
+}
+
+#ifdef IQDB_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+static void lumin_distance_avx2(Score* scores, const Score* const avgl[3], const Score query[3], const Score weight[3], int n_colors, size_t n) {
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    __m256 q[3], w[3];
+
+    for (int c = 0; c < n_colors; c++) {
+        q[c] = _mm256_set1_ps(query[c]);
+        w[c] = _mm256_set1_ps(weight[c]);
+    }
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(_mm256_loadu_ps(avgl[0] + i), q[0]));
+        __m256 s = _mm256_mul_ps(w[0], d);
+
+        for (int c = 1; c < n_colors; c++) {
+            d = _mm256_andnot_ps(sign_mask, _mm256_sub_ps(_mm256_loadu_ps(avgl[c] + i), q[c]));
+            s = _mm256_fmadd_ps(w[c], d, s);
+        }
+
+        _mm256_storeu_ps(scores + i, s);
+    }
+
+    for (; i < n; i++) {
+        Score s = 0;
+        for (int c = 0; c < n_colors; c++) {
+            s += weight[c] * std::abs(avgl[c][i] - query[c]);
+        }
+        scores[i] = s;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void lumin_distance_avx512(Score* scores, const Score* const avgl[3], const Score query[3], const Score weight[3], int n_colors, size_t n) {
+    __m512 q[3], w[3];
+
+    for (int c = 0; c < n_colors; c++) {
+        q[c] = _mm512_set1_ps(query[c]);
+        w[c] = _mm512_set1_ps(weight[c]);
+    }
+
+    for (size_t i = 0; i < n; i += 16) {
+        // The last iteration handles the remaining elements with a mask.
+        const __mmask16 mask = n - i >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (n - i)) - 1);
+
+        __m512 d = _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, avgl[0] + i), q[0]));
+        __m512 s = _mm512_mul_ps(w[0], d);
+
+        for (int c = 1; c < n_colors; c++) {
+            d = _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, avgl[c] + i), q[c]));
+            s = _mm512_fmadd_ps(w[c], d, s);
+        }
+
+        _mm512_mask_storeu_ps(scores + i, mask, s);
+    }
+}
+
+// AVX-512 has a scatter instruction, so the subtraction can be done with a
+// gather/sub/scatter. This is safe because the IDs in a bucket are unique, so
+// no two lanes ever write to the same score. AVX2 has no scatter, so it uses
+// the scalar loop.
+__attribute__((target("avx512f")))
+static void subtract_weight_avx512(Score* scores, const imageId* ids, size_t n, Score weight) {
+    const __m512 w = _mm512_set1_ps(weight);
+
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 mask = n - i >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << (n - i)) - 1);
+
+        const __m512i index = _mm512_maskz_loadu_epi32(mask, ids + i);
+        const __m512 s = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, scores, sizeof(Score));
+        _mm512_mask_i32scatter_ps(scores, mask, index, _mm512_sub_ps(s, w), sizeof(Score));
+    }
+}
+
+#endif // IQDB_X86_SIMD
+
+static const simd_kernels scalar_kernels = { simd_level::scalar, "scalar", lumin_distance_scalar, subtract_weight_scalar };
+
+#ifdef IQDB_X86_SIMD
+static const simd_kernels avx2_kernels = { simd_level::avx2, "avx2", lumin_distance_avx2, subtract_weight_scalar };
+static const simd_kernels avx512_kernels = { simd_level::avx512, "avx512", lumin_distance_avx512, subtract_weight_avx512 };
+#endif
+
+bool simd_supported(simd_level level) {
+    switch (level) {
+#ifdef IQDB_X86_SIMD
+    // https://gcc.gnu.org/onlinedocs/gcc/x86-Built-in-Functions.html
+    case simd_level::avx2:   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case simd_level::avx512: return __builtin_cpu_supports("avx512f");
+#endif
+    case simd_level::scalar: return true;
+    default:                 return false;
+    }
+}
+
+const simd_kernels& get_simd_kernels(simd_level level) {
+    if (!simd_supported(level)) {
+        return scalar_kernels;
+    }
+
+    switch (level) {
+#ifdef IQDB_X86_SIMD
+    case simd_level::avx2:   return avx2_kernels;
+    case simd_level::avx512: return avx512_kernels;
+#endif
+    default:                 return scalar_kernels;
+    }
+}
+
+const simd_kernels& get_simd_kernels() {
+    static const simd_kernels& kernels = [] () -> const simd_kernels& {
+        for (simd_level level : { simd_level::avx512, simd_level::avx2 }) {
+            if (simd_supported(level)) {
+                return get_simd_kernels(level);
+            }
+        }
+
+        return scalar_kernels;
+    }();
+
+    return kernels;
+}
+
+}
@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iqdb/snapshot.h>
+
+namespace iqdb {
+
+snapshot_writer::snapshot_writer(const std::string& path) : out_(path, std::ios::binary | std::ios::trunc) {
+    if (!out_) {
+        throw snapshot_error("couldn't open " + path + " for writing");
+    }
+}
+
+void snapshot_writer::writeString(const std::string& value) {
+    write<uint32_t>(static_cast<uint32_t>(value.size()));
+    writeBytes(value.data(), value.size());
+}
+
+void snapshot_writer::close() {
+    out_.close();
+
+    if (!out_) {
+        throw snapshot_error("failed to write snapshot");
+    }
+}
+
+void snapshot_writer::align() {
+    static const char padding[8] = {};
+    writeBytes(padding, (8 - size_ % 8) % 8);
+}
+
+void snapshot_writer::writeBytes(const void* data, size_t n) {
+    out_.write(static_cast<const char*>(data), static_cast<std::streamsize>(n));
+    size_ += n;
+}
+
+snapshot_reader::snapshot_reader(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw snapshot_error("couldn't open " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::close(fd);
+        throw snapshot_error("couldn't read " + path);
+    }
+
+    // The mapping stays valid after the file is closed.
+    size_ = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED) {
+        throw snapshot_error("couldn't map " + path);
+    }
+
+    const size_t size = size_;
+    mapping_ = std::shared_ptr<const void>(data, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+    data_ = static_cast<const uint8_t*>(data);
+}
+
+std::string snapshot_reader::readString() {
+    const uint32_t n = read<uint32_t>();
+    return std::string(reinterpret_cast<const char*>(readBytes(n)), n);
+}
+
+void snapshot_reader::align() {
+    readBytes((8 - pos_ % 8) % 8);
+}
+
+const uint8_t* snapshot_reader::readBytes(size_t n) {
+    if (n > size_ - pos_) {
+        throw snapshot_error("snapshot is truncated");
+    }
+
+    const uint8_t* data = data_ + pos_;
+    pos_ += n;
+    return data;
+}
+
+}
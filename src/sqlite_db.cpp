@@ -1,9 +1,13 @@
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <optional>
+#include <unordered_set>
 #include <vector>
 
 #include <iqdb/debug.h>
+#include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
 #include <iqdb/sqlite_db.h>
 #include <iqdb/types.h>
@@ -12,9 +16,245 @@ namespace iqdb {
 
 using namespace sqlite_orm;
 
+// Keep the connection open, and set it up for fast writes. In WAL mode a
+// commit only appends to the log, and with `synchronous = NORMAL` it doesn't
+// wait for the log to be synced to disk. A crash of iqdb never loses a
+// committed change, but a power loss may lose the last few.
+// https://www.sqlite.org/wal.html
+// https://www.sqlite.org/pragma.html#pragma_synchronous
+static sqlite3* connect(SqliteDB::Storage& storage) {
+    storage.open_forever();
+    sqlite3* db = storage.get_connection().get();
+
+    char* error = nullptr;
+    if (sqlite3_exec(db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;", nullptr, nullptr, &error) != SQLITE_OK) {
+        const std::string message = error ? error : sqlite3_errmsg(db);
+        sqlite3_free(error);
+        throw fatal_error(fmt::format("couldn't configure database: {}", message));
+    }
+
+    return db;
+}
+
+// Rename an images table in the old layout to `images_old`, so that
+// `initStorage` makes a new one. The images are copied over by `migrate`.
+static const std::string& renameOldImages(const std::string& path) {
+    sqlite3* db = nullptr;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+        const std::string error = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw fatal_error(fmt::format("couldn't open database: {}", error));
+    }
+
+    // Only the old layout has an `avglf1` column. The md5 index is dropped
+    // too, or it would be kept on the old table instead of being remade.
+    sqlite3_stmt* stmt = nullptr;
+    const bool old_layout = sqlite3_prepare_v2(db, "SELECT avglf1 FROM images LIMIT 0", -1, &stmt, nullptr) == SQLITE_OK;
+    sqlite3_finalize(stmt);
+
+    char* error = nullptr;
+    if (old_layout && sqlite3_exec(db, "BEGIN; DROP INDEX IF EXISTS idx_images_md5; ALTER TABLE images RENAME TO images_old; COMMIT;", nullptr, nullptr, &error) != SQLITE_OK) {
+        const std::string message = error ? error : sqlite3_errmsg(db);
+        sqlite3_free(error);
+        sqlite3_close(db);
+        throw fatal_error(fmt::format("couldn't migrate database: {}", message));
+    }
+
+    sqlite3_close(db);
+    return path;
+}
+
+SqliteDB::SqliteDB(const std::string& path, bool log_changes) :
+    storage_(initStorage(renameOldImages(path))),
+    db_(connect(storage_)),
+    log_changes_(log_changes),
+    begin_(prepare("BEGIN")),
+    commit_(prepare("COMMIT")),
+    rollback_(prepare("ROLLBACK")),
+    savepoint_(prepare("SAVEPOINT job")),
+    release_(prepare("RELEASE job")),
+    rollback_to_(prepare("ROLLBACK TO job")),
+    insert_image_(prepare("INSERT OR REPLACE INTO images (post_id, md5, sig) VALUES (?, ?, ?)")),
+    delete_image_(prepare("DELETE FROM images WHERE post_id = ?")),
+    insert_change_(prepare("INSERT INTO changes (post_id) VALUES (?)")) {
+    migrate();
+
+    if (!log_changes_) {
+        stopLoggingChanges();
+    }
+}
+
+SqliteDB::Statement SqliteDB::prepare(const char* sql) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v3(db_, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+        throw fatal_error(fmt::format("couldn't prepare `{}`: {}", sql, sqlite3_errmsg(db_)));
+    }
+
+    return Statement(stmt, sqlite3_finalize);
+}
+
+void SqliteDB::execute(const Statement& stmt) {
+    const int status = sqlite3_step(stmt.get());
+    const std::string error = status == SQLITE_DONE ? "" : sqlite3_errmsg(db_);
+
+    // Unbind the parameters too, as they may point to strings that are about to be freed.
+    sqlite3_reset(stmt.get());
+    sqlite3_clear_bindings(stmt.get());
+
+    if (status != SQLITE_DONE) {
+        throw fatal_error(fmt::format("couldn't run `{}`: {}", sqlite3_sql(stmt.get()), error));
+    }
+}
+
+void SqliteDB::transaction(const std::function<void ()>& func) {
+    {
+        std::unique_lock lock(sql_mutex_);
+        if (!sqlite3_get_autocommit(db_)) {
+            lock.unlock();
+            func();
+            return;
+        }
+
+        execute(begin_);
+    }
+
+    try {
+        func();
+
+        std::unique_lock lock(sql_mutex_);
+        execute(commit_);
+    } catch (...) {
+        // A failed commit may have already rolled back the transaction.
+        std::unique_lock lock(sql_mutex_);
+        if (!sqlite3_get_autocommit(db_)) {
+            execute(rollback_);
+        }
+
+        throw;
+    }
+}
+
+void SqliteDB::savepoint(const std::function<void ()>& func) {
+    {
+        std::unique_lock lock(sql_mutex_);
+        execute(savepoint_);
+    }
+
+    try {
+        func();
+
+        std::unique_lock lock(sql_mutex_);
+        execute(release_);
+    } catch (...) {
+        // Rolling back to a savepoint leaves it open, so it's released too.
+        // https://www.sqlite.org/lang_savepoint.html
+        std::unique_lock lock(sql_mutex_);
+        if (!sqlite3_get_autocommit(db_)) {
+            execute(rollback_to_);
+            execute(release_);
+        }
+
+        throw;
+    }
+}
+
+void SqliteDB::logChange(const postId& post_id) {
+    if (!log_changes_) {
+        return;
+    }
+
+    sqlite3_bind_text(insert_change_.get(), 1, post_id.data(), post_id.size(), SQLITE_STATIC);
+    execute(insert_change_);
+}
+
+void SqliteDB::stopLoggingChanges() {
+    // The changes table uses AUTOINCREMENT, so the new change still comes after
+    // every change that was deleted.
+    // https://www.sqlite.org/autoinc.html
+    char* error = nullptr;
+    if (sqlite3_exec(db_, "BEGIN; DELETE FROM changes; INSERT INTO changes (post_id) VALUES (''); COMMIT;", nullptr, nullptr, &error) != SQLITE_OK) {
+        const std::string message = error ? error : sqlite3_errmsg(db_);
+        sqlite3_free(error);
+        sqlite3_exec(db_, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw fatal_error(fmt::format("couldn't clear the change log: {}", message));
+    }
+}
+
+void SqliteDB::insertImage(std::string_view post_id, std::string_view md5, const HaarSignature& signature) {
+    const std::string sig = signature.encode();
+    sqlite3_stmt* stmt = insert_image_.get();
+
+    sqlite3_bind_text(stmt, 1, post_id.data(), post_id.size(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, md5.data(), md5.size(), SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 3, sig.data(), sig.size(), SQLITE_STATIC);
+
+    execute(insert_image_);
+}
+
+void SqliteDB::migrate() {
+    sqlite3_stmt* raw_stmt = nullptr;
+    const int prepared = sqlite3_prepare_v2(db_, "SELECT post_id, md5, avglf1, avglf2, avglf3, sig FROM images_old", -1, &raw_stmt, nullptr);
+    Statement select(raw_stmt, sqlite3_finalize);
+
+    if (prepared != SQLITE_OK) {
+        return;
+    }
+
+    INFO("migrating images to the compact signature format...\n");
+    size_t n_images = 0;
+
+    // The images aren't changed, so the migration isn't logged as changes.
+    transaction([&] {
+        std::unique_lock lock(sql_mutex_);
+
+        sqlite3_stmt* stmt = select.get();
+        int status;
+        while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+            auto text = [&](int column) {
+                return std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(stmt, column)), sqlite3_column_bytes(stmt, column));
+            };
+
+            if (sqlite3_column_bytes(stmt, 5) != sizeof(signature_t)) {
+                WARN("skipping post {}: its signature is {} bytes, not {}\n", text(0), sqlite3_column_bytes(stmt, 5), sizeof(signature_t));
+                continue;
+            }
+
+            HaarSignature signature;
+            for (int c = 0; c < 3; c++) {
+                signature.avglf[c] = sqlite3_column_double(stmt, 2 + c);
+            }
+            std::memcpy(signature.sig, sqlite3_column_blob(stmt, 5), sizeof(signature_t));
+
+            insertImage(text(0), text(1), signature);
+            n_images++;
+        }
+
+        // The table can't be dropped while it's being read.
+        const std::string error = sqlite3_errmsg(db_);
+        select.reset();
+
+        if (status != SQLITE_DONE) {
+            throw fatal_error(fmt::format("couldn't migrate images: {}", error));
+        } else if (sqlite3_exec(db_, "DROP TABLE images_old", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw fatal_error(fmt::format("couldn't drop the old images table: {}", sqlite3_errmsg(db_)));
+        }
+    });
+
+    // Give the space used by the old table back to the filesystem.
+    if (sqlite3_exec(db_, "VACUUM", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        WARN("couldn't vacuum database: {}\n", sqlite3_errmsg(db_));
+    }
+
+    INFO("migrated {} images\n", n_images);
+}
+
 HaarSignature Image::haar() const {
-    lumin_t avglf = { avglf1, avglf2, avglf3 };
-    return HaarSignature(avglf, *(signature_t*)sig.data());
+    std::optional<HaarSignature> signature = HaarSignature::decode(std::string_view(sig.data(), sig.size()));
+    if (!signature) {
+        throw fatal_error(fmt::format("post {} has an invalid signature", post_id));
+    }
+
+    return *signature;
 }
 
 void SqliteDB::eachImage(std::function<void (const Image&)> func) {
@@ -23,6 +263,38 @@ void SqliteDB::eachImage(std::function<void (const Image&)> func) {
     }
 }
 
+void SqliteDB::eachImageRow(const std::function<void (const ImageRow&)>& func) {
+    std::unique_lock lock(sql_mutex_);
+    auto connection = storage_.get_connection();
+    sqlite3* db = connection.get();
+
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT post_id, md5, sig FROM images", -1, &stmt, nullptr) != SQLITE_OK) {
+        throw fatal_error(fmt::format("couldn't read images: {}", sqlite3_errmsg(db)));
+    }
+
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto text = [&](int column) {
+            return std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(stmt, column)), sqlite3_column_bytes(stmt, column));
+        };
+
+        ImageRow row;
+        row.post_id = text(0);
+        row.md5 = text(1);
+        row.sig = std::string_view(static_cast<const char*>(sqlite3_column_blob(stmt, 2)), sqlite3_column_bytes(stmt, 2));
+
+        func(row);
+    }
+
+    const std::string error = sqlite3_errmsg(db);
+    sqlite3_finalize(stmt);
+
+    if (status != SQLITE_DONE) {
+        throw fatal_error(fmt::format("couldn't read images: {}", error));
+    }
+}
+
 std::optional<Image> SqliteDB::getImage(postId post_id) {
     std::unique_lock lock(sql_mutex_);
     auto results = storage_.get_all<Image>(where(c(&Image::post_id) == post_id));
@@ -43,24 +315,54 @@ std::vector<Image> SqliteDB::getByMD5(const std::string& md5) {
 }
 
 void SqliteDB::addImage(postId post_id, const std::string& md5, HaarSignature signature) {
-    const char* sig_ptr = (const char*)signature.sig;
-    std::vector<char> sig_blob(sig_ptr, sig_ptr + sizeof(signature.sig));
+    DEBUG("adding post to DB [post_id={}]\n", post_id);
 
-    Image image = {
-        post_id, md5, signature.avglf[0], signature.avglf[1], signature.avglf[2], sig_blob
-    };
+    transaction([&] {
+        std::unique_lock lock(sql_mutex_);
+        insertImage(post_id, md5, signature);
+        logChange(post_id);
+    });
+}
 
-    INFO("adding post to DB [post_id={}]\n", image.post_id);
+void SqliteDB::removeImage(postId post_id) {
+    transaction([&] {
+        std::unique_lock lock(sql_mutex_);
+        sqlite3_bind_text(delete_image_.get(), 1, post_id.data(), post_id.size(), SQLITE_STATIC);
 
-    storage_.transaction([&] {
-        removeImage(post_id);
-        storage_.replace(image);
-        return true;
+        execute(delete_image_);
+        logChange(post_id);
     });
 }
 
-void SqliteDB::removeImage(postId post_id) {
-    storage_.remove_all<Image>(where(c(&Image::post_id) == post_id));
+int64_t SqliteDB::lastChange() {
+    std::unique_lock lock(sql_mutex_);
+    auto seq = storage_.max(&Change::seq);
+
+    return seq ? *seq : 0;
+}
+
+std::vector<postId> SqliteDB::changesSince(int64_t seq) {
+    std::unique_lock lock(sql_mutex_);
+    auto changes = storage_.get_all<Change>(where(c(&Change::seq) > seq), order_by(&Change::seq));
+
+    // A post changed several times only needs to be replayed once.
+    std::vector<postId> post_ids;
+    std::unordered_set<postId> seen;
+    for (auto it = changes.rbegin(); it != changes.rend(); ++it) {
+        if (seen.insert(it->post_id).second) {
+            post_ids.push_back(it->post_id);
+        }
+    }
+
+    std::reverse(post_ids.begin(), post_ids.end());
+    return post_ids;
+}
+
+void SqliteDB::trimChanges(int64_t seq) {
+    const int64_t last = lastChange();
+
+    std::unique_lock lock(sql_mutex_);
+    storage_.remove_all<Change>(where(c(&Change::seq) < std::min(seq, last)));
 }
 
 }
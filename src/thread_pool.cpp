@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include <iqdb/metrics.h>
+#include <iqdb/thread_pool.h>
+
+namespace iqdb {
+
+thread_pool::thread_pool(size_t n_threads) {
+    for (size_t i = 0; i < n_threads; i++) {
+        threads_.emplace_back([this] { worker(); });
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::unique_lock lock(mutex_);
+        stopping_ = true;
+    }
+
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void thread_pool::worker() {
+    while (true) {
+        std::function<void()> task;
+
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+
+            if (tasks_.empty()) {
+                return;
+            }
+
+            metrics::thread_pool_wait.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - tasks_.front().second).count());
+            metrics::thread_pool_queue_depth.sub();
+            task = std::move(tasks_.front().first);
+            tasks_.pop_front();
+        }
+
+        task();
+    }
+}
+
+void thread_pool::parallel_for(size_t n, const std::function<void(size_t)>& func) {
+    // The state shared between the calling thread and the helper tasks. The
+    // helpers may start after all the work is already done, so it's kept alive
+    // until the last one of them has run.
+    struct state {
+        std::atomic<size_t> next = 0;
+        size_t done = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    auto shared = std::make_shared<state>();
+
+    // Claim and run indexes until there are none left.
+    auto run = [shared, n, &func] {
+        for (size_t i; (i = shared->next++) < n;) {
+            std::exception_ptr error;
+
+            try {
+                func(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::unique_lock lock(shared->mutex);
+            if (error && !shared->error) {
+                shared->error = error;
+            }
+
+            if (++shared->done == n) {
+                shared->cv.notify_all();
+            }
+        }
+    };
+
+    const size_t n_helpers = std::min(n > 0 ? n - 1 : 0, threads_.size());
+    if (n_helpers > 0) {
+        const auto now = std::chrono::steady_clock::now();
+        std::unique_lock lock(mutex_);
+        for (size_t i = 0; i < n_helpers; i++) {
+            tasks_.emplace_back(run, now);
+        }
+        metrics::thread_pool_queue_depth.add(static_cast<int64_t>(n_helpers));
+    }
+    cv_.notify_all();
+
+    run();
+
+    std::unique_lock lock(shared->mutex);
+    shared->cv.wait(lock, [&] { return shared->done == n; });
+
+    if (shared->error) {
+        std::rethrow_exception(shared->error);
+    }
+}
+
+}
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <vector>
+
+#include <iqdb/metrics.h>
+#include <iqdb/write_queue.h>
+
+namespace iqdb {
+
+write_queue::write_queue(group_func group, job_func each, size_t max_group) :
+    group_(std::move(group)), each_(std::move(each)), max_group_(group_ ? std::max<size_t>(max_group, 1) : 1), thread_([this] { worker(); }) {
+}
+
+write_queue::~write_queue() {
+    {
+        std::unique_lock lock(mutex_);
+        stopping_ = true;
+    }
+
+    cv_.notify_all();
+    thread_.join();
+}
+
+std::future<void> write_queue::submit(std::function<void()> func) {
+    job j = { std::move(func), {}, nullptr, std::chrono::steady_clock::now() };
+    std::future<void> result = j.done.get_future();
+
+    {
+        std::unique_lock lock(mutex_);
+        jobs_.push_back(std::move(j));
+        metrics::write_queue_depth.add();
+    }
+
+    cv_.notify_one();
+    return result;
+}
+
+void write_queue::worker() {
+    std::vector<job> group;
+
+    while (true) {
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+
+            // Finish the queued jobs before stopping, so no writes are lost.
+            if (jobs_.empty()) {
+                return;
+            }
+
+            const size_t n = std::min(jobs_.size(), max_group_);
+            for (size_t i = 0; i < n; i++) {
+                group.push_back(std::move(jobs_.front()));
+                jobs_.pop_front();
+            }
+            metrics::write_queue_depth.sub(static_cast<int64_t>(n));
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        for (const job& j : group) {
+            metrics::write_queue_wait.observe(std::chrono::duration<double>(start - j.queued).count());
+        }
+        metrics::write_group_size.observe(static_cast<double>(group.size()));
+
+        // A job that throws doesn't stop the rest of its group from running.
+        auto run_jobs = [&] {
+            for (job& j : group) {
+                try {
+                    if (each_) {
+                        each_(j.func);
+                    } else {
+                        j.func();
+                    }
+                } catch (...) {
+                    j.error = std::current_exception();
+                }
+            }
+        };
+
+        std::exception_ptr group_error;
+        try {
+            if (group_) {
+                group_(run_jobs);
+            } else {
+                run_jobs();
+            }
+        } catch (...) {
+            group_error = std::current_exception();
+        }
+        metrics::write_group_duration.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+        for (job& j : group) {
+            if (j.error || group_error) {
+                j.done.set_exception(j.error ? j.error : group_error);
+            } else {
+                j.done.set_value();
+            }
+        }
+
+        group.clear();
+    }
+}
+
+}
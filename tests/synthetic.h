@@ -0,0 +1,204 @@
+#ifndef IQDB_TESTS_SYNTHETIC_H
+#define IQDB_TESTS_SYNTHETIC_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gd.h>
+#include <fmt/format.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/resizer.h>
+
+namespace iqdb {
+
+// Generates random signatures with the same skew as the signatures of real
+// images, so that the buckets of a synthetic index have realistic sizes.
+//
+// The coefficients of a real image are mostly in the coarse levels of the Haar
+// transform, near the top left of the 128x128 matrix: the first row and column
+// of each level hold the large, low-frequency coefficients. Each coefficient
+// is placed by picking a level for its row and for its column, with the coarse
+// levels much more likely, and then a random position within those levels.
+// About 80% of the coefficients end up in the first 8 rows, as in real images,
+// so the buckets of the first few hundred indexes hold most of the entries.
+class signature_generator {
+public:
+    explicit signature_generator(unsigned seed = 1234) : rng_(seed) {}
+
+    HaarSignature operator()() {
+        HaarSignature sig;
+        const bool grayscale = std::uniform_real_distribution<double>(0, 1)(rng_) < grayscale_ratio;
+
+        // Y is in [0, 1]. I and Q are in [-0.5, 0.5], but usually near 0, and
+        // less than 0.006 for grayscale images.
+        sig.avglf[0] = std::uniform_real_distribution<double>(0.05, 0.95)(rng_);
+        const double chroma = grayscale ? 0.001 : 0.05;
+        sig.avglf[1] = std::clamp(std::normal_distribution<double>(0, chroma)(rng_), -0.5, 0.5);
+        sig.avglf[2] = std::clamp(std::normal_distribution<double>(0, chroma)(rng_), -0.5, 0.5);
+
+        for (auto& channel : sig.sig) {
+            int n = 0;
+            while (n < NUM_COEFS) {
+                const int index = position() * NUM_PIXELS + position();
+
+                // Index 0 is the avgl value, and each index is used at most once.
+                if (index == 0 || std::any_of(channel, channel + n, [&](Idx coef) { return std::abs(coef) == index; })) {
+                    continue;
+                }
+
+                channel[n++] = static_cast<Idx>(rng_() % 2 ? index : -index);
+            }
+        }
+
+        return HaarSignature(sig.avglf, sig.sig);
+    }
+
+    // A synthetic image with post ID `n`.
+    image_info image(size_t n) {
+        return image_info{ std::to_string(n), fmt::format("{:032x}", n), (*this)() };
+    }
+
+    // Synthetic images with post IDs `[first, first + count)`.
+    std::vector<image_info> images(size_t first, size_t count) {
+        std::vector<image_info> result;
+        result.reserve(count);
+
+        for (size_t n = first; n < first + count; n++) {
+            result.push_back(image(n));
+        }
+
+        return result;
+    }
+
+private:
+    // How often a real image is grayscale.
+    static constexpr double grayscale_ratio = 0.15;
+
+    // A row or column of the Haar matrix. Level 0 is position 0, and level L is
+    // positions [2^(L-1), 2^L).
+    int position() {
+        const int level = level_(rng_);
+        if (level == 0) {
+            return 0;
+        }
+
+        const int first = 1 << (level - 1);
+        return first + static_cast<int>(rng_() % static_cast<unsigned>(first));
+    }
+
+    std::mt19937 rng_;
+    std::discrete_distribution<int> level_{ 6, 8, 8, 6, 4, 2, 1, 0.5 };
+};
+
+// Add `count` synthetic images to `db`, in batches like `iqdb import`.
+inline void add_synthetic_images(IQDB& db, size_t count, unsigned seed = 1234) {
+    signature_generator generator(seed);
+    const size_t batch_size = 10000;
+
+    for (size_t first = 0; first < count; first += batch_size) {
+        db.addImages(generator.images(first, std::min(batch_size, count - first)));
+
+        if (db.needsCompaction()) {
+            db.compact();
+        }
+    }
+
+    db.compact();
+}
+
+// A 128x128 RGB image: noise, or smooth gradients like most real images.
+struct rgb_image {
+    std::vector<unsigned char> r, g, b;
+};
+
+inline rgb_image make_image(bool noise, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> freq(0.01, 0.2);
+    const double fx = freq(rng), fy = freq(rng);
+    rgb_image img{ std::vector<unsigned char>(NUM_PIXELS_SQUARED), std::vector<unsigned char>(NUM_PIXELS_SQUARED), std::vector<unsigned char>(NUM_PIXELS_SQUARED) };
+
+    for (int y = 0; y < NUM_PIXELS; y++) {
+        for (int x = 0; x < NUM_PIXELS; x++) {
+            const int i = y * NUM_PIXELS + x;
+            if (noise) {
+                img.r[i] = static_cast<unsigned char>(rng());
+                img.g[i] = static_cast<unsigned char>(rng());
+                img.b[i] = static_cast<unsigned char>(rng());
+            } else {
+                const int v = 128 + static_cast<int>(100 * std::sin(x * fx + y * fy)) + static_cast<int>(rng() % 16);
+                img.r[i] = static_cast<unsigned char>(std::clamp(v, 0, 255));
+                img.g[i] = static_cast<unsigned char>(img.r[i] / 2 + (x ^ y) % 32);
+                img.b[i] = static_cast<unsigned char>(255 - img.r[i]);
+            }
+        }
+    }
+
+    return img;
+}
+
+// Random avgl values in the same ranges as real images (Y in [0, 1], I and Q in [-0.5, 0.5]).
+inline std::vector<Score> random_avgl(size_t n, Score lo, Score hi) {
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<Score> dist(lo, hi);
+    std::vector<Score> v(n);
+    std::generate(v.begin(), v.end(), [&] { return dist(rng); });
+    return v;
+}
+
+// A sorted bucket containing every `stride`th image ID.
+inline std::vector<imageId> make_bucket(size_t n, size_t stride) {
+    std::vector<imageId> bucket;
+    for (size_t i = 0; i < n; i += stride) {
+        bucket.push_back(static_cast<imageId>(i));
+    }
+    return bucket;
+}
+
+enum class image_format { jpeg, png, webp, avif };
+
+// A `width`x`height` image of smooth gradients with some noise, like a photo,
+// encoded as a file of the given format.
+inline std::string synthetic_image_file(int width, int height, image_format format) {
+    std::mt19937 rng(1234);
+    gdImagePtr img = gdImageCreateTrueColor(width, height);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const int v = 128 + static_cast<int>(100 * std::sin(x * 0.01 + y * 0.02)) + static_cast<int>(rng() % 16);
+            gdImageSetPixel(img, x, y, gdTrueColor(v, (v + x) % 256, 255 - v));
+        }
+    }
+
+    int size = 0;
+    void* data = nullptr;
+    switch (format) {
+    case image_format::jpeg: data = gdImageJpegPtr(img, &size, 90); break;
+    case image_format::png: data = gdImagePngPtr(img, &size); break;
+    case image_format::webp: data = gdImageWebpPtrEx(img, &size, 90); break;
+#ifdef IQDB_GD_HAVE_AVIF
+    // The fastest encoder speed, as the benchmarks encode large images.
+    case image_format::avif: data = gdImageAvifPtrEx(img, &size, 90, 10); break;
+#else
+    case image_format::avif: break;
+#endif
+    }
+
+    if (!data) {
+        gdImageDestroy(img);
+        throw std::runtime_error("libgd could not encode the synthetic image");
+    }
+    std::string file(static_cast<const char*>(data), static_cast<size_t>(size));
+
+    gdFree(data);
+    gdImageDestroy(img);
+    return file;
+}
+
+}
+
+#endif
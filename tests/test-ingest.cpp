@@ -0,0 +1,465 @@
+// Checks that decoding a large file at a reduced size gives nearly the same
+// signature as decoding it at full size, that the buckets hold the right IDs
+// however they were built, and that a write is only seen once it's committed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+#include <iqdb/ingest_queue.h>
+#include <iqdb/snapshot.h>
+#include <iqdb/write_queue.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+// The signature of an image as libgd decodes it, at its full size. The decoded
+// image is re-encoded as a PNG, which has no reduced-size decoder.
+static HaarSignature full_size_signature(const std::string& file, gdImagePtr (*create)(int, void*)) {
+    gdImagePtr img = create(static_cast<int>(file.size()), const_cast<char*>(file.data()));
+    REQUIRE(img);
+
+    int size = 0;
+    void* data = gdImagePngPtr(img, &size);
+    const std::string png(static_cast<const char*>(data), static_cast<size_t>(size));
+
+    gdFree(data);
+    gdImageDestroy(img);
+    return HaarSignature::from_file_content(png);
+}
+
+// Checks that `actual`, from a file decoded at a reduced size, is close enough
+// to `expected`, from the same file decoded at full size, that the image still
+// finds itself as the best match among other images. The noise in a synthetic
+// image averages out differently at each scale, so they score 90 to 99.
+static void require_similar(const HaarSignature& actual, const HaarSignature& expected) {
+    for (int c = 0; c < 3; c++) {
+        REQUIRE(actual.avglf[c] == Approx(expected.avglf[c]).margin(0.005));
+
+        std::vector<Idx> common;
+        std::set_intersection(expected.sig[c], expected.sig[c] + NUM_COEFS, actual.sig[c], actual.sig[c] + NUM_COEFS, std::back_inserter(common));
+        REQUIRE(common.size() >= NUM_COEFS - 8);
+    }
+
+    IQDB db;
+    add_synthetic_images(db, 10000);
+    db.addImage("10000", fmt::format("{:032x}", 10000), expected);
+
+    const sim_vector matches = db.queryFromSignature(actual, 1);
+    REQUIRE(matches.size() == 1);
+    REQUIRE(matches[0].id == "10000");
+    REQUIRE(matches[0].score >= 85);
+}
+
+// libjpeg scales a JPEG down by up to 1/8 while decoding it, so it's never
+// decoded at full size. An image that needs no scaling is decoded exactly as
+// libgd would decode it.
+TEST_CASE("scaled JPEG decode matches full decode", "[ingest]") {
+    const auto [width, height] = GENERATE(std::pair(100, 80), std::pair(300, 200), std::pair(1000, 800), std::pair(2000, 1500), std::pair(4000, 3000));
+    const std::string file = synthetic_image_file(width, height, image_format::jpeg);
+
+    const HaarSignature actual = HaarSignature::from_file_content(file);
+    const HaarSignature expected = full_size_signature(file, gdImageCreateFromJpegPtr);
+
+    if (width < 2 * NUM_PIXELS || height < 2 * NUM_PIXELS) {
+        REQUIRE(actual == expected);
+    } else {
+        require_similar(actual, expected);
+    }
+}
+
+// libwebp scales a WebP down while decoding it like libjpeg does a JPEG, when
+// iqdb is built with it. Otherwise libgd decodes it at full size.
+TEST_CASE("scaled WebP decode matches full decode", "[ingest]") {
+    const auto [width, height] = GENERATE(std::pair(300, 200), std::pair(1000, 800), std::pair(4000, 3000));
+    const std::string file = synthetic_image_file(width, height, image_format::webp);
+
+    const HaarSignature actual = HaarSignature::from_file_content(file);
+    const HaarSignature expected = full_size_signature(file, gdImageCreateFromWebpPtr);
+    require_similar(actual, expected);
+}
+
+#ifdef IQDB_GD_HAVE_AVIF
+// AVIF has no reduced-size decoder, so it's always decoded exactly as libgd
+// would decode it.
+TEST_CASE("AVIF decode matches full decode", "[ingest]") {
+    const std::string file = synthetic_image_file(1000, 800, image_format::avif);
+
+    const HaarSignature actual = HaarSignature::from_file_content(file);
+    const HaarSignature expected = full_size_signature(file, gdImageCreateFromAvifPtr);
+    REQUIRE(actual == expected);
+}
+#endif
+
+// The coefficients of a decoded signature index the buckets, so a corrupt one
+// is rejected rather than loaded.
+TEST_CASE("decode rejects invalid coefficients", "[ingest]") {
+    signature_generator generator;
+    HaarSignature sig = generator();
+    REQUIRE(sig.is_valid());
+    REQUIRE(HaarSignature::decode(sig.encode()) == sig.quantized());
+    REQUIRE(HaarSignature::from_hash(sig.to_string()) == sig);
+
+    for (double value : sig.quantized().avglf) {
+        REQUIRE(value == static_cast<float>(value));
+    }
+
+    HaarSignature reversed = sig;
+    std::reverse(reversed.sig[2], reversed.sig[2] + NUM_COEFS);
+    REQUIRE(reversed.quantized() == sig.quantized());
+
+    const Idx coef = GENERATE(Idx(0), Idx(NUM_PIXELS_SQUARED), Idx(-NUM_PIXELS_SQUARED - 1));
+    sig.sig[1][NUM_COEFS - 1] = coef;
+    REQUIRE_FALSE(sig.is_valid());
+    REQUIRE_FALSE(HaarSignature::decode(sig.encode()));
+    REQUIRE_THROWS_AS(sig.quantized(), param_error);
+    REQUIRE_THROWS_AS(HaarSignature::from_hash(sig.to_string()), param_error);
+
+    IQDB db;
+    REQUIRE_THROWS_AS(db.addImage("1", "", sig), param_error);
+    REQUIRE_THROWS_AS(db.addImages({ { "1", "", sig } }), param_error);
+    REQUIRE_THROWS_AS(db.queryExact(sig), param_error);
+}
+
+// The IDs in each bucket, as (color, coef) => IDs.
+using bucket_ids = std::map<std::pair<int, int>, std::vector<imageId>>;
+
+// The buckets of `signatures[id]` for each image ID, without the images that
+// `deleted` is true for. Grayscale images are only in the Y buckets.
+static bucket_ids expected_ids(const std::vector<HaarSignature>& signatures, const std::function<bool(imageId)>& deleted = nullptr) {
+    bucket_ids result;
+    for (imageId id = 0; id < signatures.size(); id++) {
+        if (deleted && deleted(id)) {
+            continue;
+        }
+
+        for (int c = 0; c < signatures[id].num_colors(); c++) {
+            for (int coef : signatures[id].sig[c]) {
+                result[{ c, coef }].push_back(id);
+            }
+        }
+    }
+
+    return result;
+}
+
+// Checks that every bucket of `buckets` holds the IDs in `expected` that are
+// below `end`, in order, and that the other buckets are empty.
+static void require_ids(const bucket_set& buckets, const bucket_ids& expected, imageId end) {
+    for (int c = 0; c < 3; c++) {
+        for (int coef = -NUM_PIXELS_SQUARED + 1; coef < NUM_PIXELS_SQUARED; coef++) {
+            if (coef == 0) {
+                continue;
+            }
+
+            std::vector<imageId> actual;
+            buckets.eachChunk(c, coef, end, [&](const imageId* ids, size_t n) {
+                REQUIRE(n <= bucket_set::chunk_size);
+                actual.insert(actual.end(), ids, ids + n);
+            });
+
+            auto it = expected.find({ c, coef });
+            std::vector<imageId> ids = it == expected.end() ? std::vector<imageId>() : it->second;
+            ids.erase(std::lower_bound(ids.begin(), ids.end(), end), ids.end());
+
+            INFO("color " << c << ", coef " << coef);
+            REQUIRE(actual == ids);
+            REQUIRE(buckets.empty(c, coef, end) == ids.empty());
+        }
+    }
+}
+
+TEST_CASE("bucket_set contents", "[ingest]") {
+    signature_generator generator;
+    std::vector<HaarSignature> signatures;
+    for (int i = 0; i < 20000; i++) {
+        signatures.push_back(generator());
+    }
+
+    const imageId n = static_cast<imageId>(signatures.size());
+    const bucket_ids expected = expected_ids(signatures);
+    size_t n_ids = 0;
+    for (const auto& [bucket, ids] : expected) {
+        n_ids += ids.size();
+    }
+
+    image_table images;
+    bucket_set buckets;
+    for (const HaarSignature& sig : signatures) {
+        buckets.add(sig, images.add(sig));
+    }
+
+    SECTION("add then compact") {
+        REQUIRE(buckets.tailSize() == n_ids);
+        REQUIRE(buckets.compactedSize() == 0);
+        require_ids(buckets, expected, n);
+
+        const bucket_set compacted = buckets.compacted();
+        REQUIRE(compacted.tailSize() == 0);
+        REQUIRE(compacted.compactedSize() == n_ids);
+        require_ids(compacted, expected, n);
+    }
+
+    // The IDs of a bucket are read from the compressed list, then from the
+    // tail, which is cut off at `end`. The compressed IDs are always below the
+    // `end` of a query, as the buckets are only compacted from the latest
+    // image table.
+    SECTION("tail plus compressed") {
+        bucket_set partial;
+        for (imageId id = 0; id < n / 2; id++) {
+            partial.add(signatures[id], id);
+        }
+
+        bucket_set both = partial.compacted();
+        for (imageId id = n / 2; id < n; id++) {
+            both.add(signatures[id], id);
+        }
+
+        REQUIRE(both.compactedSize() + both.tailSize() == n_ids);
+        require_ids(both, expected, n);
+        require_ids(both, expected, n / 2);
+        require_ids(both, expected, n / 2 + n / 4);
+        require_ids(both.compacted(), expected, n);
+    }
+
+    SECTION("purge of deleted ids") {
+        auto deleted = [](imageId id) { return id % 3 == 0; };
+        for (imageId id = 0; id < n; id++) {
+            if (deleted(id)) {
+                images.setDeleted(id);
+            }
+        }
+
+        const bucket_ids remaining = expected_ids(signatures, deleted);
+        require_ids(buckets.compacted(&images), remaining, n);
+
+        // Purging the compressed lists of an already compacted set.
+        require_ids(buckets.compacted().compacted(&images), remaining, n);
+
+        // Without `purge`, the deleted IDs are kept.
+        require_ids(buckets.compacted(), expected, n);
+    }
+
+    // The partial sets are built from interleaved batches, as `loadImages`
+    // builds one per worker.
+    SECTION("merge partial sets") {
+        const size_t n_parts = 4, batch_size = 1000;
+        std::vector<bucket_set> parts(n_parts);
+        for (imageId id = 0; id < n; id++) {
+            parts[(id / batch_size) % n_parts].add(signatures[id], id);
+        }
+
+        // One of the parts is compacted, so both halves of a bucket are merged.
+        parts[1] = parts[1].compacted();
+
+        thread_pool pool(3);
+        const bucket_set merged = bucket_set::merged(parts, pool);
+        REQUIRE(merged.tailSize() == 0);
+        REQUIRE(merged.compactedSize() == n_ids);
+        require_ids(merged, expected, n);
+    }
+}
+
+// A corrupt snapshot can't be allowed to make a query decode past the arena,
+// or subtract from the scores of images that don't exist.
+TEST_CASE("bucket_set load rejects corrupt posting lists", "[ingest]") {
+    const imageId n = 1000;
+    signature_generator generator;
+    bucket_set buckets;
+    for (imageId id = 0; id < n; id++) {
+        buckets.add(generator(), id);
+    }
+    buckets = buckets.compacted();
+
+    const std::string path = (std::filesystem::temp_directory_path() / "iqdb-test-buckets.snapshot").string();
+    {
+        snapshot_writer out(path);
+        buckets.save(out);
+        out.close();
+    }
+
+    auto load = [&](imageId end) {
+        snapshot_reader in(path);
+        bucket_set loaded;
+        loaded.load(in, end);
+        return loaded;
+    };
+
+    REQUIRE(load(n).compactedSize() == buckets.compactedSize());
+    REQUIRE_THROWS_AS(load(n - 1), snapshot_error);
+
+    // The first plane is its arena's size, the arena, and then its posting
+    // lists, each an offset, the bytes, the count and the last ID, padded to
+    // 24 bytes. One of its lists that isn't empty is corrupted.
+    std::string file;
+    {
+        std::ifstream in(path, std::ios::binary);
+        file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    uint64_t arena_size;
+    std::memcpy(&arena_size, file.data(), sizeof(arena_size));
+    size_t list = 8 + (arena_size + 7) / 8 * 8;
+    auto field = [&](size_t at) { return reinterpret_cast<uint32_t*>(file.data() + list + at); };
+    while (*field(12) == 0) {
+        list += 24;
+    }
+
+    const int corruption = GENERATE(0, 1, 2, 3);
+    if (corruption == 0) {
+        *field(12) = *field(8) + 1;       // more IDs than bytes
+    } else if (corruption == 1) {
+        const uint64_t offset = std::numeric_limits<uint64_t>::max() - 8;
+        std::memcpy(file.data() + list, &offset, sizeof(offset));
+        *field(8) = 16;                   // the list's end overflows
+    } else if (corruption == 2) {
+        *field(16) = n;                   // the last ID is past the images
+    } else {
+        *field(16) -= 1;                  // the IDs don't end at the last ID
+    }
+
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(file.data(), static_cast<std::streamsize>(file.size()));
+    }
+
+    REQUIRE_THROWS_AS(load(n), snapshot_error);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("transaction", "[ingest]") {
+    IQDB db;
+    signature_generator generator(4321);
+    const std::vector<image_info> images = generator.images(0, 4);
+    db.addImages({ images[0], images[1] });
+
+    auto in_memory = [&](const image_info& image) {
+        return !db.queryExact(image.haar).empty();
+    };
+
+    SECTION("changes are only seen once they're committed") {
+        db.transaction([&] {
+            db.addImage(images[2].post_id, images[2].md5, images[2].haar);
+            db.removeImage(images[0].post_id);
+
+            REQUIRE(db.getImgCount() == 2);
+            REQUIRE(in_memory(images[0]));
+            REQUIRE(!in_memory(images[2]));
+        });
+
+        REQUIRE(db.getImgCount() == 2);
+        REQUIRE(!in_memory(images[0]));
+        REQUIRE(in_memory(images[2]));
+        REQUIRE(!db.getImage(images[0].post_id));
+        REQUIRE(db.getImage(images[2].post_id));
+    }
+
+    SECTION("a transaction that fails isn't committed") {
+        REQUIRE_THROWS_AS(db.transaction([&] {
+            db.addImage(images[2].post_id, images[2].md5, images[2].haar);
+            db.removeImage(images[0].post_id);
+            throw param_error("failed");
+        }), param_error);
+
+        REQUIRE(db.getImgCount() == 2);
+        REQUIRE(in_memory(images[0]));
+        REQUIRE(!in_memory(images[2]));
+        REQUIRE(db.getImage(images[0].post_id));
+        REQUIRE(!db.getImage(images[2].post_id));
+    }
+
+    SECTION("a nested transaction that fails is undone on its own") {
+        db.transaction([&] {
+            db.addImage(images[2].post_id, images[2].md5, images[2].haar);
+
+            REQUIRE_THROWS_AS(db.transaction([&] {
+                db.removeImage(images[1].post_id);
+                db.addImage(images[3].post_id, images[3].md5, images[3].haar);
+                throw param_error("failed");
+            }), param_error);
+
+            // the rolled back removal doesn't count
+            db.removeImage(images[1].post_id);
+        });
+
+        REQUIRE(db.getImgCount() == 2);
+        REQUIRE(in_memory(images[0]));
+        REQUIRE(!in_memory(images[1]));
+        REQUIRE(in_memory(images[2]));
+        REQUIRE(!in_memory(images[3]));
+        REQUIRE(!db.getImage(images[1].post_id));
+        REQUIRE(!db.getImage(images[3].post_id));
+    }
+
+    SECTION("the last change to a post is kept") {
+        db.transaction([&] {
+            db.addImage(images[0].post_id, images[0].md5, images[2].haar);
+            db.removeImage(images[1].post_id);
+            db.addImage(images[1].post_id, images[1].md5, images[3].haar);
+            db.addImage(images[2].post_id, images[2].md5, images[2].haar);
+            db.removeImage(images[2].post_id);
+        });
+
+        REQUIRE(db.getImgCount() == 2);
+        REQUIRE(db.queryExact(images[2].haar).at(0).id == images[0].post_id);
+        REQUIRE(db.queryExact(images[3].haar).at(0).id == images[1].post_id);
+        REQUIRE(!db.getImage(images[2].post_id));
+    }
+}
+
+TEST_CASE("ingest_queue", "[ingest]") {
+    // The writer's groups fail before running their jobs, as if BEGIN failed.
+    std::atomic<bool> failing = true;
+    write_queue writer([&](const std::function<void()>& jobs) {
+        if (failing) {
+            throw std::runtime_error("couldn't begin");
+        }
+
+        jobs();
+    });
+
+    std::vector<image_info> added;
+    ingest_queue ingest(writer, [&](std::vector<image_info> images) { added.insert(added.end(), images.begin(), images.end()); }, 2, 16);
+
+    auto wait = [&](uint64_t id) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (true) {
+            const std::optional<ingest_queue::job_status> job = ingest.status(id);
+            REQUIRE(job);
+
+            if (job->state == ingest_queue::job_state::done || job->state == ingest_queue::job_state::failed || std::chrono::steady_clock::now() > deadline) {
+                return *job;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+
+    const std::string file = synthetic_image_file(100, 80, image_format::jpeg);
+    const ingest_queue::job_status failed = wait(*ingest.submit("1", "", file));
+    REQUIRE(failed.state == ingest_queue::job_state::failed);
+    REQUIRE(failed.error == "couldn't begin");
+
+    // a failed flush doesn't stop the next uploads from being flushed
+    failing = false;
+    const ingest_queue::job_status done = wait(*ingest.submit("2", "", file));
+    REQUIRE(done.state == ingest_queue::job_state::done);
+    REQUIRE(added.size() == 1);
+    REQUIRE(added[0].post_id == "2");
+}
@@ -0,0 +1,269 @@
+// Checks that the index loaded from the SQLite DB or from a snapshot gives the
+// same results as the index it was saved from, and that `iqdb import` rebuilds
+// the snapshot.
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+#include <catch2/catch.hpp>
+#include <nlohmann/json.hpp>
+#include <iqdb/bulk.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/snapshot.h>
+#include <iqdb/sqlite_db.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+using nlohmann::json;
+
+// The results of querying `db` for each of `signatures`, as (post ID, score).
+static std::vector<std::vector<std::pair<postId, Score>>> query_results(IQDB& db, const std::vector<HaarSignature>& signatures) {
+    std::vector<std::vector<std::pair<postId, Score>>> results;
+    for (const HaarSignature& signature : signatures) {
+        results.emplace_back();
+        for (const sim_value& match : db.queryFromSignature(signature, 20)) {
+            results.back().emplace_back(match.id, match.score);
+        }
+    }
+
+    return results;
+}
+
+// Run `sql` on the DB without iqdb, so the changes aren't logged. An index that
+// doesn't see them can only have been loaded from a snapshot.
+static void change_behind_iqdb(const std::string& database, const std::string& sql) {
+    sqlite3* db = nullptr;
+    REQUIRE(sqlite3_open(database.c_str(), &db) == SQLITE_OK);
+    REQUIRE(sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK);
+    sqlite3_close(db);
+}
+
+// Loading the DB with the parallel pipeline must build the same index as
+// adding the images one batch at a time, whichever way the workers split it.
+TEST_CASE("loadDatabase matches the index it was built from", "[load]") {
+    const size_t n = 20000;
+    const size_t shards = GENERATE(1, 3, 16);
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string database = (dir / "iqdb-test-load.sqlite").string();
+
+    auto remove_files = [&] {
+        for (const std::string& file : { database, database + "-wal", database + "-shm" }) {
+            std::filesystem::remove(file);
+        }
+    };
+
+    remove_files();
+
+    signature_generator generator;
+    const std::vector<image_info> images = generator.images(0, n);
+    std::vector<HaarSignature> queries;
+    for (size_t i = 0; i < n; i += 500) {
+        queries.push_back(images[i + 3].haar);
+        queries.push_back(generator());
+    }
+
+    IQDB expected_db(":memory:", shards);
+    expected_db.addImages(images);
+    expected_db.compact();
+
+    {
+        IQDB db(database, shards);
+        db.addImages(images);
+    }
+
+    IQDB db(database, shards);
+    REQUIRE(db.getImgCount() == n);
+    REQUIRE(!db.needsCompaction());
+    REQUIRE(query_results(db, queries) == query_results(expected_db, queries));
+
+    remove_files();
+}
+
+TEST_CASE("snapshot", "[load]") {
+    const size_t n = 20000, shards = 2;
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string database = (dir / "iqdb-test-snapshot.sqlite").string();
+    const std::string snapshot = (dir / "iqdb-test-snapshot.snapshot").string();
+    const std::string other_snapshot = (dir / "iqdb-test-snapshot-other.snapshot").string();
+
+    auto remove_files = [&] {
+        for (const std::string& file : { database, database + "-wal", database + "-shm", snapshot, other_snapshot }) {
+            std::filesystem::remove(file);
+        }
+    };
+
+    remove_files();
+
+    // every 7th image is removed before the snapshot is saved. `expected_db`
+    // gets the same changes, and is compacted whenever a snapshot is saved, as
+    // the scale of a query's scores depends on which buckets are empty.
+    signature_generator generator;
+    const std::vector<image_info> images = generator.images(0, n);
+    IQDB expected_db(":memory:", shards);
+    auto add_images = [&](IQDB& db) {
+        db.addImages(images);
+        for (size_t i = 0; i < n; i += 7) {
+            db.removeImage(images[i].post_id);
+        }
+    };
+
+    std::vector<HaarSignature> queries;
+    for (size_t i = 0; i < n; i += 1000) {
+        queries.push_back(images[i + 1].haar);
+        queries.push_back(generator());
+    }
+
+    {
+        IQDB db(database, shards, snapshot);
+        add_images(db);
+        db.saveSnapshot(snapshot);
+        add_images(expected_db);
+        expected_db.compact();
+        REQUIRE(query_results(db, queries) == query_results(expected_db, queries));
+    }
+
+    SECTION("save and load") {
+        change_behind_iqdb(database, "DELETE FROM images");
+
+        IQDB db(database, shards, snapshot);
+        REQUIRE(db.getImgCount() == expected_db.getImgCount());
+        REQUIRE(query_results(db, queries) == query_results(expected_db, queries));
+    }
+
+    SECTION("changes made after the snapshot are replayed") {
+        const std::vector<image_info> added = signature_generator(5678).images(n, 100);
+        auto change_images = [&](IQDB& db) {
+            db.addImages(added);
+            db.removeImage(images[1].post_id);
+            db.removeImage(added[0].post_id);
+
+            // a post changed twice is only replayed once, as it is last
+            db.removeImage(images[2].post_id);
+            db.addImage(images[2].post_id, images[2].md5, added[1].haar);
+        };
+
+        {
+            IQDB db(database, shards, snapshot);
+            change_images(db);
+        }
+
+        // the replayed snapshot is saved again
+        change_images(expected_db);
+        expected_db.compact();
+        change_behind_iqdb(database, "DELETE FROM images WHERE post_id = '3'");
+
+        IQDB db(database, shards, snapshot);
+        REQUIRE(db.getImgCount() == expected_db.getImgCount());
+
+        std::vector<HaarSignature> changed = queries;
+        for (const image_info& image : added) {
+            changed.push_back(image.haar);
+        }
+        changed.push_back(images[2].haar);
+
+        REQUIRE(query_results(db, changed) == query_results(expected_db, changed));
+        REQUIRE(db.queryExact(added[2].haar.quantized()).size() == 1);
+        REQUIRE(db.queryExact(added[0].haar.quantized()).empty());
+        REQUIRE(db.queryExact(images[1].haar.quantized()).empty());
+        REQUIRE(db.queryExact(images[3].haar.quantized()).size() == 1);
+    }
+
+    SECTION("a truncated snapshot or one from another version can't be loaded") {
+        const std::string copy = snapshot + ".copy";
+        std::filesystem::copy_file(snapshot, copy, std::filesystem::copy_options::overwrite_existing);
+
+        const bool truncated = GENERATE(false, true);
+        if (truncated) {
+            std::filesystem::resize_file(snapshot, std::filesystem::file_size(snapshot) / 2);
+        } else {
+            // the version follows the 8 byte magic
+            std::fstream file(snapshot, std::ios::in | std::ios::out | std::ios::binary);
+            const uint32_t version = 1000;
+            file.seekp(8);
+            file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        }
+
+        // loaded from the DB, as the other snapshot doesn't exist yet
+        IQDB db(database, shards, other_snapshot);
+        REQUIRE(db.getImgCount() == expected_db.getImgCount());
+
+        REQUIRE_THROWS_AS(db.loadSnapshot(snapshot), snapshot_error);
+        REQUIRE(db.getImgCount() == 0);
+        REQUIRE(db.queryFromSignature(queries[0]).empty());
+
+        // the same snapshot is fine before it's damaged
+        REQUIRE_NOTHROW(db.loadSnapshot(copy));
+        REQUIRE(query_results(db, queries) == query_results(expected_db, queries));
+        std::filesystem::remove(copy);
+
+        // and iqdb rebuilds the index from the DB instead of a damaged one
+        IQDB rebuilt(database, shards, snapshot);
+        REQUIRE(query_results(rebuilt, queries) == query_results(expected_db, queries));
+    }
+
+    remove_files();
+}
+
+TEST_CASE("import_file", "[load]") {
+    const size_t n = 20000, shards = 2;
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string database = (dir / "iqdb-test-import.sqlite").string();
+    const std::string snapshot = (dir / "iqdb-test-import.snapshot").string();
+    const std::string input = (dir / "iqdb-test-import.ndjson").string();
+
+    auto remove_files = [&] {
+        for (const std::string& file : { database, database + "-wal", database + "-shm", snapshot, input }) {
+            std::filesystem::remove(file);
+        }
+    };
+
+    remove_files();
+
+    // half of the images are in the DB and its snapshot before the import
+    signature_generator generator;
+    const std::vector<image_info> images = generator.images(0, n);
+    const std::vector<image_info> existing(images.begin(), images.begin() + n / 2);
+    {
+        IQDB db(database, shards, snapshot);
+        db.addImages(existing);
+        db.saveSnapshot(snapshot);
+    }
+
+    {
+        std::ofstream file(input, std::ios::binary);
+        for (size_t i = n / 2; i < n; i++) {
+            const json line = { { "post_id", images[i].post_id }, { "md5", images[i].md5 }, { "hash", images[i].haar.to_string() } };
+            file << line.dump() << '\n';
+        }
+    }
+
+    import_file(input, database, { bulk_format::ndjson, shards, snapshot });
+
+    IQDB expected_db(":memory:", shards);
+    expected_db.addImages(images);
+    expected_db.compact();
+
+    std::vector<HaarSignature> queries;
+    for (size_t i = 0; i < n; i += 1000) {
+        queries.push_back(images[i + 1].haar);
+        queries.push_back(generator());
+    }
+
+    // every image is in the DB, and in the rebuilt snapshot. the DB is opened
+    // as if for a snapshot, or the change log would be cleared.
+    size_t rows = 0;
+    SqliteDB(database, true).eachImageRow([&](const ImageRow&) { rows++; });
+    REQUIRE(rows == n);
+
+    change_behind_iqdb(database, "DELETE FROM images");
+    IQDB db(database, shards, snapshot);
+    REQUIRE(db.getImgCount() == n);
+    REQUIRE(query_results(db, queries) == query_results(expected_db, queries));
+
+    remove_files();
+}
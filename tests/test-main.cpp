@@ -0,0 +1,12 @@
+// The Catch2 main() for iqdb_test. Run `iqdb_test --help` for options.
+// debug.h comes first, since Catch2 defines INFO and WARN macros.
+#include <iqdb/debug.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch2/catch.hpp>
+
+int main(int argc, char* argv[]) {
+    // Turn off logging, so the tests that load a DB don't log every load.
+    iqdb::debug_level = 4;
+    return Catch::Session().run(argc, argv);
+}
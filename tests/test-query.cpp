@@ -0,0 +1,269 @@
+// Checks that the faster ways of querying, the query cache, and merging the
+// results of a coordinator's shards give the same results as a plain query.
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imgdb.h>
+#include <iqdb/metrics.h>
+#include <iqdb/query_cache.h>
+#include <iqdb/server.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+// `queryPruned` scores the images it finds from their signatures instead of
+// from the buckets, so its scores have to be the same as those of `query`. A
+// grayscale image is only in the Y buckets, so it can't be credited for its I
+// and Q coefficients, even when a color query has the same ones.
+TEST_CASE("queryPruned scores match query", "[query]") {
+    signature_generator generator;
+    index_shard shard;
+    std::vector<HaarSignature> signatures;
+
+    auto add = [&](const HaarSignature& signature) {
+        signatures.push_back(signature);
+        shard.buckets->add(signature, shard.images.add(signature));
+    };
+
+    for (int i = 0; i < 100000; i++) {
+        add(generator());
+    }
+
+    // A color query that's nearly gray, and grayscale copies of it with all of
+    // its coefficients, so the copies only differ from it by their colors.
+    HaarSignature query = generator();
+    query.avglf[1] = query.avglf[2] = 0.004;
+    REQUIRE(!query.is_grayscale());
+
+    add(query);
+    for (int i = 0; i < 4; i++) {
+        HaarSignature grayscale = query;
+        grayscale.avglf[0] += 0.001 * i;
+        grayscale.avglf[1] = grayscale.avglf[2] = 0.002;
+        REQUIRE(grayscale.is_grayscale());
+        add(grayscale);
+    }
+
+    const size_t numres = 10;
+    std::vector<scored_image> full = shard.query(query, numres);
+    std::sort(full.begin(), full.end());
+
+    // The query itself is the best match. The grayscale copies only match its
+    // Y coefficients, so they're far behind.
+    REQUIRE(full[0].second == signatures.size() - 5);
+
+    // The threshold of `min_score=90`, which a grayscale copy wrongly credited
+    // for its I and Q coefficients would pass.
+    const Score threshold = full[0].first * 0.9f;
+    std::vector<scored_image> expected;
+    for (const scored_image& result : full) {
+        if (result.first <= threshold) {
+            expected.push_back(result);
+        }
+    }
+
+    std::optional<std::vector<scored_image>> actual = shard.queryPruned(query, numres, threshold, [&](imageId id) -> const HaarSignature& { return signatures[id]; });
+    REQUIRE(actual);
+    std::sort(actual->begin(), actual->end());
+
+    REQUIRE(actual->size() == expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        CHECK(actual->at(i).second == expected[i].second);
+        CHECK(actual->at(i).first == Approx(expected[i].first).epsilon(1e-5));
+    }
+
+    // The limit is the client's, so it can be far more than there are images.
+    const size_t no_limit = std::numeric_limits<size_t>::max();
+    REQUIRE(shard.query(query, no_limit).size() == signatures.size());
+
+    actual = shard.queryPruned(query, no_limit, threshold, [&](imageId id) -> const HaarSignature& { return signatures[id]; });
+    REQUIRE(actual);
+    REQUIRE(actual->size() >= expected.size());
+}
+
+TEST_CASE("queryBatch matches query", "[query]") {
+    signature_generator generator;
+    index_shard shard;
+    for (int i = 0; i < 20000; i++) {
+        const HaarSignature signature = generator();
+        shard.buckets->add(signature, shard.images.add(signature));
+    }
+
+    std::vector<HaarSignature> batch;
+    for (int i = 0; i < 16; i++) {
+        batch.push_back(generator());
+    }
+
+    // Run twice, so the second batch reuses the first one's score arrays.
+    for (int run = 0; run < 2; run++) {
+        std::vector<std::vector<scored_image>> results = shard.queryBatch(batch, 10);
+        REQUIRE(results.size() == batch.size());
+
+        for (size_t q = 0; q < batch.size(); q++) {
+            std::vector<scored_image> expected = shard.query(batch[q], 10);
+            std::sort(expected.begin(), expected.end());
+            std::sort(results[q].begin(), results[q].end());
+            REQUIRE(results[q] == expected);
+        }
+    }
+}
+
+// The post IDs and scores of a query's results.
+static std::vector<std::pair<postId, Score>> ids_and_scores(const sim_vector& matches) {
+    std::vector<std::pair<postId, Score>> result;
+    for (const sim_value& match : matches) {
+        result.emplace_back(match.id, match.score);
+    }
+
+    return result;
+}
+
+TEST_CASE("query cache", "[query]") {
+    signature_generator generator(5678);
+
+    SECTION("a write bumps the epoch and misses the cache") {
+        IQDB db(":memory:", 2, "", 16);
+        add_synthetic_images(db, 10000);
+        const HaarSignature query = generator();
+
+        auto query_db = [&](bool hit) {
+            const uint64_t hits = metrics::query_cache_hits.value(), misses = metrics::query_cache_misses.value();
+            const sim_vector matches = db.queryFromSignature(query, 10);
+            REQUIRE(metrics::query_cache_hits.value() == hits + hit);
+            REQUIRE(metrics::query_cache_misses.value() == misses + !hit);
+            return ids_and_scores(matches);
+        };
+
+        const auto first = query_db(false);
+        REQUIRE(query_db(true) == first);
+
+        // the cache never returns the results from before an image was added or removed
+        db.addImage("new", fmt::format("{:032x}", 10000), query);
+        const auto added = query_db(false);
+        REQUIRE(added[0].first == "new");
+        REQUIRE(added[0].second == Approx(100).margin(0.1));
+        REQUIRE(query_db(true) == added);
+
+        // the removed image stays in the buckets until they're compacted, so
+        // only the IDs are the same as before it was added
+        db.removeImage("new");
+        const auto removed = query_db(false);
+        REQUIRE(removed.size() == first.size());
+        for (size_t i = 0; i < first.size(); i++) {
+            REQUIRE(removed[i].first == first[i].first);
+        }
+    }
+
+    SECTION("CLOCK eviction") {
+        const size_t capacity = 4;
+        query_cache cache(capacity);
+        std::vector<HaarSignature> queries;
+        for (int i = 0; i < 8; i++) {
+            queries.push_back(generator());
+        }
+
+        auto insert = [&](size_t i, uint64_t epoch) {
+            const sim_vector matches = { sim_value(std::to_string(i), 100, "", queries[i]) };
+            cache.insert(queries[i], 10, std::nullopt, epoch, { matches, {} });
+        };
+
+        auto cached = [&](size_t i, uint64_t epoch) {
+            const std::optional<query_cache::results> results = cache.find(queries[i], 10, std::nullopt, epoch);
+            REQUIRE((!results || results->matches.at(0).id == std::to_string(i)));
+            return results.has_value();
+        };
+
+        for (size_t i = 0; i < capacity; i++) {
+            insert(i, 1);
+        }
+
+        // the results are only for the same query, limit and minimum score
+        REQUIRE(cached(0, 1));
+        REQUIRE_FALSE(cache.find(queries[0], 20, std::nullopt, 1));
+        REQUIRE_FALSE(cache.find(queries[0], 10, 90.0f, 1));
+        REQUIRE_FALSE(cached(capacity, 1));
+
+        // the entries that were hit get another pass, so the unused entry 3 is evicted
+        REQUIRE(cached(1, 1));
+        REQUIRE(cached(2, 1));
+        insert(4, 1);
+        REQUIRE(cached(4, 1));
+        REQUIRE_FALSE(cached(3, 1));
+        REQUIRE(cached(0, 1));
+        REQUIRE(cached(1, 1));
+        REQUIRE(cached(2, 1));
+
+        // every entry was just hit, so the clock hand clears them all, and
+        // evicts the first one it comes back to
+        insert(5, 1);
+        size_t n_cached = 0;
+        for (size_t i = 0; i < queries.size(); i++) {
+            n_cached += cached(i, 1);
+        }
+        REQUIRE(n_cached == capacity);
+        REQUIRE(cached(5, 1));
+
+        // after a write, every entry is stale and a miss, and is evicted first
+        for (size_t i = 0; i < queries.size(); i++) {
+            REQUIRE_FALSE(cached(i, 2));
+        }
+
+        for (size_t i = 0; i < capacity; i++) {
+            insert(i, 2);
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            REQUIRE(cached(i, 2));
+        }
+    }
+}
+
+// A coordinator over several shards has to give the same matches, with the
+// same scores, as a single instance holding all of their images.
+TEST_CASE("merge_shard_matches matches an unsharded index", "[query]") {
+    const size_t n = 30000, n_shards = 3, limit = 10;
+    const std::optional<Score> min_score = GENERATE(std::optional<Score>(), std::optional<Score>(20.0f));
+
+    signature_generator generator;
+    const std::vector<image_info> images = generator.images(0, n);
+    IQDB unsharded;
+    unsharded.addImages(images);
+
+    // the shards get the images in runs, so some buckets are only empty in
+    // some of the shards
+    std::vector<std::unique_ptr<IQDB>> shards;
+    for (size_t s = 0; s < n_shards; s++) {
+        shards.push_back(std::make_unique<IQDB>());
+    }
+    for (size_t i = 0; i < n; i++) {
+        shards[(i / 4000) % n_shards]->addImage(images[i].post_id, images[i].md5, images[i].haar);
+    }
+
+    std::vector<HaarSignature> queries;
+    for (size_t i = 0; i < 50; i++) {
+        queries.push_back(i % 2 ? images[i * 500].haar : generator());
+    }
+
+    for (const HaarSignature& query : queries) {
+        std::vector<shard_matches> results(n_shards);
+        for (size_t s = 0; s < n_shards; s++) {
+            results[s].matches = shards[s]->queryFromSignature(query, limit, min_score, &results[s].buckets);
+        }
+
+        const sim_vector expected = unsharded.queryFromSignature(query, limit, min_score);
+        const sim_vector actual = merge_shard_matches(query, results, limit, min_score);
+
+        REQUIRE(actual.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            REQUIRE(actual[i].id == expected[i].id);
+            REQUIRE(actual[i].score == Approx(expected[i].score).epsilon(1e-4));
+        }
+    }
+}
@@ -0,0 +1,56 @@
+// Checks that the query kernels in simd.cpp give the same scores as the scalar
+// ones, for each instruction set supported by this CPU.
+
+#include <algorithm>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <iqdb/imglib.h>
+#include <iqdb/simd.h>
+
+#include "synthetic.h"
+
+using namespace iqdb;
+
+static const simd_level levels[] = { simd_level::scalar, simd_level::avx2, simd_level::avx512 };
+
+TEST_CASE("lumin_distance", "[simd]") {
+    const size_t n = GENERATE(10000, 1000000);
+    const auto y = random_avgl(n, 0, 1), i = random_avgl(n, -0.5, 0.5), q = random_avgl(n, -0.5, 0.5);
+    const Score* avgl[3] = { y.data(), i.data(), q.data() };
+    const Score query[3] = { 0.5f, 0.1f, -0.1f };
+
+    std::vector<Score> expected(n), scores(n);
+    get_simd_kernels(simd_level::scalar).lumin_distance(expected.data(), avgl, query, weights[0], 3, n);
+
+    for (simd_level level : levels) {
+        if (!simd_supported(level)) {
+            continue;
+        }
+
+        get_simd_kernels(level).lumin_distance(scores.data(), avgl, query, weights[0], 3, n);
+
+        for (size_t k = 0; k < n; k++) {
+            REQUIRE(scores[k] == Approx(expected[k]).epsilon(1e-5));
+        }
+    }
+}
+
+TEST_CASE("subtract_weight", "[simd]") {
+    const size_t n = 1000000;
+    const size_t stride = GENERATE(1, 16, 256);
+    const auto bucket = make_bucket(n, stride);
+
+    std::vector<Score> expected(n, 0), scores(n, 0);
+    get_simd_kernels(simd_level::scalar).subtract_weight(expected.data(), bucket.data(), bucket.size(), 0.5f);
+
+    for (simd_level level : levels) {
+        if (!simd_supported(level)) {
+            continue;
+        }
+
+        std::fill(scores.begin(), scores.end(), 0.0f);
+        get_simd_kernels(level).subtract_weight(scores.data(), bucket.data(), bucket.size(), 0.5f);
+        REQUIRE(scores == expected);
+    }
+}